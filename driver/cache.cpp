@@ -25,12 +25,21 @@
 // The hash depends on the IR code (obviously), but also on the compiler+LLVM
 // versions and several compile flags (e.g. -O*, -mcpu, and -mattr).
 //
+// With -cache-remote, entries missing in the local cache directory are fetched
+// from a shared backend (see cache_backend.h), and new entries are uploaded to
+// it. Any remote failure falls through to local compilation.
+//
 //===----------------------------------------------------------------------===//
 
 #include "driver/cache.h"
 
 #include "dmd/errors.h"
+#include "dmd/mangle.h"
+#include "dmd/module.h"
+#include "dmd/template.h"
+#include "driver/cache_backend.h"
 #include "driver/cache_pruning.h"
+#include "driver/cache_stats.h"
 #include "driver/cl_options.h"
 #include "driver/cl_options_sanitizers.h"
 #include "driver/ldc-version.h"
@@ -44,10 +53,22 @@
 #include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/Support/TimeValue.h"
 #endif
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Compression.h"
+#include "llvm/Support/Endian.h"
+#if LDC_LLVM_VER >= 500
+#include "llvm/Support/Error.h"
+#endif
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
 
 // Include close() declaration.
 #if !defined(_MSC_VER) && !defined(__MINGW32__)
@@ -139,6 +160,44 @@ llvm::cl::opt<unsigned> pruneSizeLimitPercentage(
         "space (default: 75%). Implies -cache-prune."),
     llvm::cl::value_desc("perc"), llvm::cl::init(75));
 
+llvm::cl::opt<bool> frontendCache(
+    "cache-frontend", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Look up object files in the -cache directory before "
+                   "generating the IR, keyed on the source files (skips IR "
+                   "generation and optimization on a hit; experimental)."));
+
+llvm::cl::opt<std::string> remoteCache(
+    "cache-remote", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Share the -cache entries via <url>, an http:// cache server "
+                   "(GET/PUT <url>/<entry>) or a shared directory."),
+    llvm::cl::value_desc("url"));
+llvm::cl::opt<unsigned> remoteCacheTimeout(
+    "cache-remote-timeout", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Timeout for requests to the -cache-remote server, in "
+                   "milliseconds (default: 2000)."),
+    llvm::cl::value_desc("ms"), llvm::cl::init(2000));
+
+llvm::cl::opt<bool> compressEntries(
+    "cache-compress", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Compress new cache entries with zlib. Compressed entries "
+                   "are always retrieved by decompressing (not linking) them."));
+llvm::cl::opt<unsigned> compressionLevel(
+    "cache-compress-level", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Sets the zlib compression level of new cache entries to "
+                   "<level> (1-9, default: 6). Implies -cache-compress."),
+    llvm::cl::value_desc("level"), llvm::cl::init(6));
+
+llvm::cl::opt<bool> cacheStats(
+    "cache-stats", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Accumulate statistics (hits, misses, sizes, times, "
+                   "evictions) in the -cache directory."));
+llvm::cl::opt<std::string> cacheStatsReport(
+    "cache-stats-report", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Write the cache statistics of this invocation and the "
+                   "accumulated ones to JSON file <file> ('-' for stdout). "
+                   "Implies -cache-stats."),
+    llvm::cl::value_desc("file"));
+
 enum class RetrievalMode { Copy, HardLink, AnyLink, SymLink };
 llvm::cl::opt<RetrievalMode> cacheRecoveryMode(
     "cache-retrieval", llvm::cl::ZeroOrMore,
@@ -169,6 +228,171 @@ bool isPruningEnabled() {
   return false;
 }
 
+bool isCompressionEnabled() {
+  return compressEntries || compressionLevel.getNumOccurrences() > 0;
+}
+
+// Compressed cache entries start with this header: a magic, followed by the
+// uncompressed size (64-bit little endian). The zlib stream follows.
+const char compressedEntryMagic[4] = {'L', 'D', 'C', 'Z'};
+const size_t compressedEntryHeaderSize = 12;
+
+bool compressBuffer(llvm::StringRef input,
+                    llvm::SmallVectorImpl<char> &output) {
+  const unsigned level = std::min(compressionLevel.getValue(), 9u);
+#if LDC_LLVM_VER >= 500
+  if (auto err = llvm::zlib::compress(input, output, level)) {
+    llvm::consumeError(std::move(err));
+    return false;
+  }
+  return true;
+#else
+  // LLVM 3.9 and 4.0 only have these levels and return a status code.
+  const auto zlibLevel =
+      level == 0 ? llvm::zlib::NoCompression
+                 : level <= 3 ? llvm::zlib::BestSpeedCompression
+                              : level <= 7 ? llvm::zlib::DefaultCompression
+                                           : llvm::zlib::BestSizeCompression;
+  return llvm::zlib::compress(input, output, zlibLevel) ==
+         llvm::zlib::StatusOK;
+#endif
+}
+
+bool uncompressBuffer(llvm::StringRef input,
+                      llvm::SmallVectorImpl<char> &output, size_t size) {
+#if LDC_LLVM_VER >= 500
+  if (auto err = llvm::zlib::uncompress(input, output, size)) {
+    llvm::consumeError(std::move(err));
+    return false;
+  }
+  return true;
+#else
+  return llvm::zlib::uncompress(input, output, size) == llvm::zlib::StatusOK;
+#endif
+}
+
+bool writeFile(llvm::StringRef path, llvm::ArrayRef<llvm::StringRef> parts) {
+  std::error_code ec;
+  llvm::raw_fd_ostream os(path, ec, llvm::sys::fs::F_None);
+  if (ec)
+    return false;
+  for (auto part : parts)
+    os << part;
+  os.close();
+  if (os.has_error()) {
+    os.clear_error();
+    return false;
+  }
+  return true;
+}
+
+// Writes the compressed contents of `objectFile` to the cache entry
+// `entryFile`. Returns false if compression isn't possible.
+bool writeCompressedEntry(llvm::StringRef objectFile,
+                          llvm::StringRef entryFile) {
+  if (!llvm::zlib::isAvailable())
+    return false;
+  auto buffer = llvm::MemoryBuffer::getFile(objectFile);
+  if (!buffer)
+    return false;
+  const llvm::StringRef contents = (*buffer)->getBuffer();
+
+  const auto startTime = std::chrono::steady_clock::now();
+  llvm::SmallVector<char, 0> compressed;
+  if (!compressBuffer(contents, compressed))
+    return false;
+  cache::stats::addTime(cache::stats::CompressMicroseconds,
+                        std::chrono::steady_clock::now() - startTime);
+
+  char header[compressedEntryHeaderSize];
+  memcpy(header, compressedEntryMagic, sizeof(compressedEntryMagic));
+  llvm::support::endian::write64le(header + sizeof(compressedEntryMagic),
+                                   contents.size());
+  if (!writeFile(entryFile,
+                 {llvm::StringRef(header, sizeof(header)),
+                  llvm::StringRef(compressed.data(), compressed.size())}))
+    return false;
+
+  cache::stats::add(cache::stats::CompressionInputBytes, contents.size());
+  cache::stats::add(cache::stats::CompressionOutputBytes,
+                    sizeof(header) + compressed.size());
+  return true;
+}
+
+// Returns true if `entryFile` is a compressed cache entry and stores its
+// uncompressed size in `uncompressedSize`.
+bool isCompressedEntry(llvm::StringRef entryFile, uint64_t &uncompressedSize) {
+  auto header = llvm::MemoryBuffer::getFileSlice(
+      entryFile, compressedEntryHeaderSize, /*Offset=*/0);
+  if (!header || (*header)->getBufferSize() < compressedEntryHeaderSize)
+    return false;
+
+  const char *data = (*header)->getBufferStart();
+  if (memcmp(data, compressedEntryMagic, sizeof(compressedEntryMagic)) != 0)
+    return false;
+  uncompressedSize =
+      llvm::support::endian::read64le(data + sizeof(compressedEntryMagic));
+  return true;
+}
+
+bool decompressEntry(llvm::StringRef entryFile, uint64_t uncompressedSize,
+                     llvm::StringRef objectFile) {
+  auto buffer = llvm::MemoryBuffer::getFile(entryFile);
+  if (!buffer)
+    return false;
+
+  const auto startTime = std::chrono::steady_clock::now();
+  llvm::SmallVector<char, 0> contents;
+  if (!uncompressBuffer(
+          (*buffer)->getBuffer().drop_front(compressedEntryHeaderSize),
+          contents, uncompressedSize))
+    return false;
+  cache::stats::addTime(cache::stats::DecompressMicroseconds,
+                        std::chrono::steady_clock::now() - startTime);
+
+  return writeFile(objectFile,
+                   {llvm::StringRef(contents.data(), contents.size())});
+}
+
+// Records the addition or retrieval of `cacheFile` in the journal of the cache
+// index (see cache_pruning.d), so that the pruner doesn't need to scan the
+// cache directory. Appending a short line is atomic, so no lock is needed.
+// The journal is only compacted by the pruner, so nothing is recorded without
+// pruning; the pruner picks up such files by rescanning the cache directory.
+void recordInCacheIndex(llvm::StringRef cacheFile) {
+  if (!isPruningEnabled())
+    return;
+
+  uint64_t size;
+  if (llvm::sys::fs::file_size(cacheFile, size))
+    return;
+
+  llvm::SmallString<128> journal(opts::cacheDir);
+  llvm::sys::path::append(journal, "ircache_index.journal");
+
+  const auto now = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::system_clock::now().time_since_epoch());
+
+  std::string line;
+  llvm::raw_string_ostream os(line);
+  os << llvm::sys::path::filename(cacheFile) << ' ' << size << ' '
+     << static_cast<long long>(now.count()) << '\n';
+  os.flush();
+
+  // Written with a single write() call when closed.
+  std::error_code ec;
+  llvm::raw_fd_ostream journalOS(journal, ec, llvm::sys::fs::F_Append);
+  if (ec)
+    return;
+  journalOS << line;
+  journalOS.close();
+  if (journalOS.has_error()) {
+    journalOS.clear_error();
+    IF_LOG Logger::println("Failed to append to the cache index: %s",
+                           journal.c_str());
+  }
+}
+
 #if LDC_LLVM_VER >= 400
 llvm::sys::TimePoint<std::chrono::seconds> getTimeNow() {
   using namespace std::chrono;
@@ -213,6 +437,71 @@ void storeCacheFileName(llvm::StringRef cacheObjectHash,
                                         "." + global.obj_ext);
 }
 
+// The remote backend, created on first use.
+std::unique_ptr<cache::CacheBackend> remoteBackend;
+bool remoteBackendInitialized = false;
+
+cache::CacheBackend *getRemoteBackend() {
+  if (remoteBackendInitialized)
+    return remoteBackend.get();
+  remoteBackendInitialized = true;
+
+  const std::string &location = remoteCache;
+  if (location.empty())
+    return nullptr;
+
+  std::string errorMsg;
+  remoteBackend =
+      cache::createCacheBackend(location, remoteCacheTimeout, errorMsg);
+  if (!remoteBackend) {
+    error(Loc(), "Invalid -cache-remote location %s: %s", location.c_str(),
+          errorMsg.c_str());
+    fatal();
+  }
+  IF_LOG Logger::println("Using remote cache: %s",
+                         remoteBackend->describe().c_str());
+  return remoteBackend.get();
+}
+
+// Returns true if the entry was fetched from the remote backend into
+// `cacheFile` in the local cache directory.
+bool fetchFromRemote(llvm::StringRef cacheFile) {
+  auto backend = getRemoteBackend();
+  if (!backend || llvm::sys::fs::create_directories(opts::cacheDir))
+    return false;
+
+  // Fetch to a temporary file first, so that concurrent compiler invocations
+  // never see a partial cache entry.
+  llvm::SmallString<128> tempFile;
+  if (llvm::sys::fs::createUniqueFile(llvm::Twine(cacheFile) + ".tmp%%%%%%%",
+                                      tempFile))
+    return false;
+  if (!backend->fetch(llvm::sys::path::filename(cacheFile), tempFile) ||
+      llvm::sys::fs::rename(tempFile, cacheFile)) {
+    llvm::sys::fs::remove(tempFile);
+    return false;
+  }
+
+  IF_LOG Logger::println("Fetched cache object from %s.",
+                         backend->describe().c_str());
+  cache::stats::add(cache::stats::RemoteFetches, 1);
+  return true;
+}
+
+void outputCodegenSettings(llvm::raw_ostream &hash_os);
+
+// Returns whether `arg` is -codegen-threads or its alias -j, which don't
+// influence the object code output. Sets `separateValue` if the number of
+// threads is the next argument ("-j 4").
+bool isCodegenThreadsArg(llvm::StringRef arg, bool &separateValue) {
+  arg = arg.ltrim('-');
+  llvm::StringRef name = arg.split('=').first;
+  if (name != "codegen-threads" && name != "j")
+    return false;
+  separateValue = name.size() == arg.size();
+  return true;
+}
+
 // Output to `hash_os` all commandline flags, and try to skip the ones that have
 // no influence on the object code output. The cmdline flags need to be added
 // to the ir2obj cache hash to uniquely identify the object file output.
@@ -273,6 +562,13 @@ void outputIR2ObjRelevantCmdlineArgs(llvm::raw_ostream &hash_os) {
       // All  "-cache..." options can be ignored
       if (strncmp(arg + 1, "cache", 5) == 0)
         continue;
+      // The number of codegen threads doesn't affect the output.
+      bool separateValue = false;
+      if (isCodegenThreadsArg(arg, separateValue)) {
+        if (separateValue && it + 1 != end_it)
+          ++it;
+        continue;
+      }
       // Ignore "-lib"
       if (arg[1] == 'l' && arg[2] == 'i' && arg[3] == 'b' && !arg[4])
         continue;
@@ -294,17 +590,24 @@ void outputIR2ObjRelevantCmdlineArgs(llvm::raw_ostream &hash_os) {
     hash_os << arg;
   }
 
-  // Adding these options to the hash should not be needed after adding all
-  // cmdline args. We keep this code here however, in case we find a different
-  // solution for dealing with LLVM commandline flags. See GH #1773.
-  // Also, having these options explicitly added to the hash protects against
-  // the possibility of different default settings on different platforms (while
-  // sharing the cache).
+  outputCodegenSettings(hash_os);
+}
+
+// Output to `hash_os` the settings that influence code generation.
+// Adding these options to the hash should not be needed after adding all
+// cmdline args. We keep this code here however, in case we find a different
+// solution for dealing with LLVM commandline flags. See GH #1773.
+// Also, having these options explicitly added to the hash protects against
+// the possibility of different default settings on different platforms (while
+// sharing the cache).
+void outputCodegenSettings(llvm::raw_ostream &hash_os) {
   outputOptimizationSettings(hash_os);
   opts::outputSanitizerSettings(hash_os);
   hash_os << opts::getCPUStr();
   hash_os << opts::getFeaturesStr();
   hash_os << opts::floatABI;
+  // The object file is bitcode (with a module summary for ThinLTO) with LTO.
+  hash_os << opts::ltoMode;
   const auto relocModel = opts::getRelocModel();
   if (relocModel.hasValue())
     hash_os << relocModel.getValue();
@@ -324,6 +627,106 @@ void outputIR2ObjRelevantCmdlineArgs(llvm::raw_ostream &hash_os) {
 #endif
 }
 
+// Output to `hash_os` all commandline flags except for the few known not to
+// influence the object file contents. In contrast to the IR-to-object cache,
+// flags whose effects would be observable in the IR (e.g., -d-version) have to
+// be included.
+void outputFrontendRelevantCmdlineArgs(llvm::raw_ostream &hash_os) {
+  auto it = opts::allArguments.begin();
+  auto end_it = opts::allArguments.end();
+  // The first argument is the compiler executable filename: we can skip it.
+  ++it;
+  for (; it != end_it; ++it) {
+    const llvm::StringRef arg = *it ? *it : "";
+    if (arg.empty())
+      continue;
+
+    bool separateValue = false;
+    if (isCodegenThreadsArg(arg, separateValue)) {
+      if (separateValue && it + 1 != end_it)
+        ++it;
+      continue;
+    }
+    if (arg.startswith("-cache") || arg == "-v" || arg == "-vv" ||
+        arg == "-c" || arg.startswith("-of") || arg.startswith("-od"))
+      continue;
+    // All arguments following -run can safely be ignored
+    if (arg == "-run")
+      break;
+
+    hash_os << arg << '\0';
+  }
+
+  outputCodegenSettings(hash_os);
+}
+
+struct FileContentHash {
+  std::string hash;
+  // Whether the file mentions __DATE__, __TIME__ or __TIMESTAMP__, which
+  // expand to the time of compilation.
+  bool usesTimeMacros;
+};
+
+// MD5 hashes of the contents of the source and string-imported files, shared
+// by all modules of a compilation.
+llvm::StringMap<FileContentHash> fileContentHashes;
+
+// Returns false if the file couldn't be read or uses one of the time macros;
+// the object file must not be served from the cache then.
+bool outputFileContentHash(llvm::raw_ostream &hash_os, llvm::StringRef path) {
+  auto it = fileContentHashes.find(path);
+  if (it == fileContentHashes.end()) {
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+      IF_LOG Logger::println("Cannot read '%s' for the front-end cache hash.",
+                             path.str().c_str());
+      return false;
+    }
+
+    const llvm::StringRef contents = (*buffer)->getBuffer();
+    llvm::MD5 hasher;
+    hasher.update(contents);
+    llvm::MD5::MD5Result result;
+    hasher.final(result);
+    llvm::SmallString<32> str;
+    llvm::MD5::stringifyResult(result, str);
+    // A plain text search; occurrences in comments merely disable the cache.
+    const bool usesTimeMacros =
+        contents.find("__DATE__") != llvm::StringRef::npos ||
+        contents.find("__TIME__") != llvm::StringRef::npos ||
+        contents.find("__TIMESTAMP__") != llvm::StringRef::npos;
+    it = fileContentHashes
+             .insert(std::make_pair(
+                 path, FileContentHash{str.str().str(), usesTimeMacros}))
+             .first;
+  }
+
+  if (it->second.usesTimeMacros) {
+    IF_LOG Logger::println("'%s' uses __DATE__, __TIME__ or __TIMESTAMP__, "
+                           "skipping the front-end cache.",
+                           path.str().c_str());
+    return false;
+  }
+
+  // The absolute path ends up in the debug info and __FILE_FULL_PATH__.
+  llvm::SmallString<128> absolutePath(path);
+  llvm::sys::fs::make_absolute(absolutePath);
+  hash_os << path << '\0' << absolutePath << '\0' << it->second.hash;
+  return true;
+}
+
+void addImportClosure(Module *m, llvm::SmallPtrSetImpl<Module *> &modules) {
+  llvm::SmallVector<Module *, 32> worklist;
+  worklist.push_back(m);
+  while (!worklist.empty()) {
+    Module *current = worklist.pop_back_val();
+    if (!modules.insert(current).second)
+      continue;
+    for (Module *imported : current->aimports)
+      worklist.push_back(imported);
+  }
+}
+
 // Output to `hash_os` all environment flags that influence object code output
 // in ways that are not observable in the pre-LLVM passes IR used for hashing.
 void outputIR2ObjRelevantEnvironmentOpts(llvm::raw_ostream &hash_os) {
@@ -335,6 +738,7 @@ void outputIR2ObjRelevantEnvironmentOpts(llvm::raw_ostream &hash_os) {
 namespace cache {
 
 void calculateModuleHash(llvm::Module *m, llvm::SmallString<32> &str) {
+  const auto startTime = std::chrono::steady_clock::now();
   raw_hash_ostream hash_os;
 
   // Let hash depend on the compiler version:
@@ -353,26 +757,113 @@ void calculateModuleHash(llvm::Module *m, llvm::SmallString<32> &str) {
   llvm::WriteBitcodeToFile(m, hash_os);
 #endif
   hash_os.resultAsString(str);
-  IF_LOG Logger::println("Module's LLVM bitcode hash is: %s", str.c_str());
+
+  const auto duration = std::chrono::steady_clock::now() - startTime;
+  stats::addTime(stats::HashingMicroseconds, duration);
+  IF_LOG {
+    const std::chrono::duration<double, std::milli> milliseconds = duration;
+    Logger::println("Module's LLVM bitcode hash is: %s (took %.3f ms)",
+                    str.c_str(), milliseconds.count());
+  }
 }
 
-std::string cacheLookup(llvm::StringRef cacheObjectHash) {
-  if (opts::cacheDir.empty())
-    return "";
+bool isFrontendCacheEnabled() {
+  return !opts::cacheDir.empty() && frontendCache;
+}
 
-  if (!llvm::sys::fs::exists(opts::cacheDir)) {
-    IF_LOG Logger::println("Cache directory does not exist, no object found.");
-    return "";
+bool calculateModuleSourceHash(Module *m, llvm::SmallString<32> &str) {
+  const auto startTime = std::chrono::steady_clock::now();
+  raw_hash_ostream hash_os;
+
+  // Keep these keys apart from the IR hashes.
+  hash_os << "frontend" << '\0';
+
+  hash_os << global.ldc_version << global.version.ptr << global.llvm_version
+          << ldc::built_with_Dcompiler_version;
+
+  outputFrontendRelevantCmdlineArgs(hash_os);
+  outputIR2ObjRelevantEnvironmentOpts(hash_os);
+
+  // The debug info contains the working directory.
+  llvm::SmallString<128> workingDirectory;
+  if (!llvm::sys::fs::current_path(workingDirectory))
+    hash_os << workingDirectory << '\0';
+
+  // Template instances may be emitted into any root module instantiating them.
+  for (Module *root : Module::amodules) {
+    if (root->isRoot())
+      hash_os << root->toPrettyChars() << '\0';
   }
+  hash_os << m->toPrettyChars() << '\0';
+
+  llvm::SmallPtrSet<Module *, 32> modules;
+  addImportClosure(m, modules);
+
+  if (m->members) {
+    for (Dsymbol *s : *m->members) {
+      TemplateInstance *ti = s->isTemplateInstance();
+      if (!ti || s->isTemplateMixin())
+        continue;
+
+      OutBuffer buf;
+      mangleToBuffer(ti, &buf);
+      hash_os << buf.peekString() << '\0';
+
+      // The instance may have been appended to this module for an
+      // instantiation in another root module, with arguments depending on
+      // that module's imports.
+      for (TemplateInstance *inst = ti; inst; inst = inst->tnext) {
+        for (TemplateInstance *enclosing = inst; enclosing;
+             enclosing = enclosing->tinst) {
+          if (enclosing->minst)
+            addImportClosure(enclosing->minst, modules);
+        }
+      }
+    }
+  }
+
+  std::vector<Module *> sortedModules(modules.begin(), modules.end());
+  std::sort(sortedModules.begin(), sortedModules.end(),
+            [](Module *a, Module *b) {
+              return strcmp(a->srcfile->toChars(), b->srcfile->toChars()) < 0;
+            });
+  for (Module *mod : sortedModules) {
+    hash_os << mod->toPrettyChars() << '\0';
+    if (!outputFileContentHash(hash_os, mod->srcfile->toChars()))
+      return false;
+    for (const char *file : mod->contentImportedFiles) {
+      if (!outputFileContentHash(hash_os, file))
+        return false;
+    }
+  }
+
+  for (const auto &file : opts::getSanitizerBlacklistFiles()) {
+    if (!outputFileContentHash(hash_os, file))
+      return false;
+  }
+
+  hash_os.resultAsString(str);
+  stats::addTime(stats::HashingMicroseconds,
+                 std::chrono::steady_clock::now() - startTime);
+  IF_LOG Logger::println("Module's source hash is: %s", str.c_str());
+  return true;
+}
+
+std::string cacheLookup(llvm::StringRef cacheObjectHash, bool frontend) {
+  if (opts::cacheDir.empty())
+    return "";
 
   llvm::SmallString<128> filePath;
   storeCacheFileName(cacheObjectHash, filePath);
-  if (llvm::sys::fs::exists(filePath.c_str())) {
+
+  if (llvm::sys::fs::exists(filePath.c_str()) || fetchFromRemote(filePath)) {
     IF_LOG Logger::println("Cache object found! %s", filePath.c_str());
+    stats::add(frontend ? stats::FrontendHits : stats::Hits, 1);
     return filePath.str().str();
   }
 
   IF_LOG Logger::println("Cache object not found.");
+  stats::add(frontend ? stats::FrontendMisses : stats::Misses, 1);
   return "";
 }
 
@@ -402,12 +893,17 @@ void cacheObjectFile(llvm::StringRef objectFile,
     fatal();
   }
 
-  IF_LOG Logger::println("Copy object file to temp file: %s to %s",
-                         objectFile.str().c_str(), tempFile.c_str());
-  if (llvm::sys::fs::copy_file(objectFile, tempFile.c_str())) {
-    error(Loc(), "Failed to copy object file to cache: %s to %s",
-          objectFile.str().c_str(), tempFile.c_str());
-    fatal();
+  if (isCompressionEnabled() && writeCompressedEntry(objectFile, tempFile)) {
+    IF_LOG Logger::println("Compressed object file to temp file: %s to %s",
+                           objectFile.str().c_str(), tempFile.c_str());
+  } else {
+    IF_LOG Logger::println("Copy object file to temp file: %s to %s",
+                           objectFile.str().c_str(), tempFile.c_str());
+    if (llvm::sys::fs::copy_file(objectFile, tempFile.c_str())) {
+      error(Loc(), "Failed to copy object file to cache: %s to %s",
+            objectFile.str().c_str(), tempFile.c_str());
+      fatal();
+    }
   }
   IF_LOG Logger::println("Rename temp file to cache file: %s to %s",
                          tempFile.c_str(), cacheFile.c_str());
@@ -416,6 +912,34 @@ void cacheObjectFile(llvm::StringRef objectFile,
           tempFile.c_str(), cacheFile.c_str());
     fatal();
   }
+
+  uint64_t size;
+  if (!llvm::sys::fs::file_size(cacheFile, size))
+    stats::add(stats::BytesStored, size);
+  recordInCacheIndex(cacheFile);
+
+  if (auto backend = getRemoteBackend())
+    backend->store(llvm::sys::path::filename(cacheFile), cacheFile);
+}
+
+void prefetch(const std::vector<std::string> &cacheObjectHashes) {
+  auto backend = getRemoteBackend();
+  if (!backend)
+    return;
+
+  std::vector<std::string> keys;
+  for (const auto &hash : cacheObjectHashes) {
+    llvm::SmallString<128> filePath;
+    storeCacheFileName(hash, filePath);
+    if (!llvm::sys::fs::exists(filePath))
+      keys.push_back(llvm::sys::path::filename(filePath));
+  }
+  backend->prefetch(keys);
+}
+
+void finishRemoteStores() {
+  if (remoteBackend)
+    remoteBackend->finish();
 }
 
 void recoverObjectFile(llvm::StringRef cacheObjectHash,
@@ -426,46 +950,62 @@ void recoverObjectFile(llvm::StringRef cacheObjectHash,
   // Remove the potentially pre-existing output file.
   llvm::sys::fs::remove(objectFile);
 
-  switch (cacheRecoveryMode) {
-  case RetrievalMode::Copy: {
-    IF_LOG Logger::println("Copy cached object file: %s -> %s",
+  uint64_t uncompressedSize;
+  if (isCompressedEntry(cacheFile, uncompressedSize)) {
+    IF_LOG Logger::println("Decompress cached object file: %s -> %s",
                            cacheFile.c_str(), objectFile.str().c_str());
-    if (llvm::sys::fs::copy_file(cacheFile.c_str(), objectFile)) {
-      error(Loc(), "Failed to copy the cached file: %s -> %s",
+    if (!decompressEntry(cacheFile, uncompressedSize, objectFile)) {
+      error(Loc(), "Failed to decompress the cached file: %s -> %s",
             cacheFile.c_str(), objectFile.str().c_str());
       fatal();
     }
-  } break;
-  case RetrievalMode::HardLink: {
-    IF_LOG Logger::println("HardLink output to cached object file: %s -> %s",
-                           objectFile.str().c_str(), cacheFile.c_str());
-    if (createHardLink(cacheFile.c_str(), objectFile.str().c_str())) {
-      error(Loc(), "Failed to create a hard link to the cached file: %s -> %s",
-            cacheFile.c_str(), objectFile.str().c_str());
-      fatal();
-    }
-  } break;
-  case RetrievalMode::AnyLink: {
-    IF_LOG Logger::println("Link output to cached object file: %s -> %s",
-                           objectFile.str().c_str(), cacheFile.c_str());
-    if (llvm::sys::fs::create_link(cacheFile.c_str(), objectFile)) {
-      error(Loc(), "Failed to create a link to the cached file: %s -> %s",
-            cacheFile.c_str(), objectFile.str().c_str());
-      fatal();
-    }
-  } break;
-  case RetrievalMode::SymLink: {
-    IF_LOG Logger::println("SymLink output to cached object file: %s -> %s",
-                           objectFile.str().c_str(), cacheFile.c_str());
-    if (createSymLink(cacheFile.c_str(), objectFile.str().c_str())) {
-      error(Loc(),
-            "Failed to create a symbolic link to the cached file: %s -> %s",
-            cacheFile.c_str(), objectFile.str().c_str());
-      fatal();
+  } else {
+    switch (cacheRecoveryMode) {
+    case RetrievalMode::Copy: {
+      IF_LOG Logger::println("Copy cached object file: %s -> %s",
+                             cacheFile.c_str(), objectFile.str().c_str());
+      if (llvm::sys::fs::copy_file(cacheFile.c_str(), objectFile)) {
+        error(Loc(), "Failed to copy the cached file: %s -> %s",
+              cacheFile.c_str(), objectFile.str().c_str());
+        fatal();
+      }
+    } break;
+    case RetrievalMode::HardLink: {
+      IF_LOG Logger::println("HardLink output to cached object file: %s -> %s",
+                             objectFile.str().c_str(), cacheFile.c_str());
+      if (createHardLink(cacheFile.c_str(), objectFile.str().c_str())) {
+        error(Loc(),
+              "Failed to create a hard link to the cached file: %s -> %s",
+              cacheFile.c_str(), objectFile.str().c_str());
+        fatal();
+      }
+    } break;
+    case RetrievalMode::AnyLink: {
+      IF_LOG Logger::println("Link output to cached object file: %s -> %s",
+                             objectFile.str().c_str(), cacheFile.c_str());
+      if (llvm::sys::fs::create_link(cacheFile.c_str(), objectFile)) {
+        error(Loc(), "Failed to create a link to the cached file: %s -> %s",
+              cacheFile.c_str(), objectFile.str().c_str());
+        fatal();
+      }
+    } break;
+    case RetrievalMode::SymLink: {
+      IF_LOG Logger::println("SymLink output to cached object file: %s -> %s",
+                             objectFile.str().c_str(), cacheFile.c_str());
+      if (createSymLink(cacheFile.c_str(), objectFile.str().c_str())) {
+        error(Loc(),
+              "Failed to create a symbolic link to the cached file: %s -> %s",
+              cacheFile.c_str(), objectFile.str().c_str());
+        fatal();
+      }
+    } break;
     }
-  } break;
   }
 
+  uint64_t size;
+  if (!llvm::sys::fs::file_size(objectFile, size))
+    stats::add(stats::BytesRecovered, size);
+
   // We reset the modification time to "now" such that the pruning algorithm
   // sees that the file should be kept over older files.
   // On some systems the last accessed time is not automatically updated so set
@@ -497,13 +1037,52 @@ void recoverObjectFile(llvm::StringRef cacheObjectHash,
 
     close(FD);
   }
+
+  recordInCacheIndex(cacheFile);
 }
 
 void pruneCache() {
   if (!opts::cacheDir.empty() && isPruningEnabled()) {
+    uinteger_t prunedEntries = 0, prunedBytes = 0;
     ::pruneCache(opts::cacheDir.data(), opts::cacheDir.size(), pruneInterval,
                  pruneExpiration, pruneSizeLimitInBytes,
-                 pruneSizeLimitPercentage);
+                 pruneSizeLimitPercentage, &prunedEntries, &prunedBytes);
+    stats::add(stats::EvictedEntries, prunedEntries);
+    stats::add(stats::EvictedBytes, prunedBytes);
   }
 }
+
+void writeStats() {
+  if (opts::cacheDir.empty() || (!cacheStats && cacheStatsReport.empty()))
+    return;
+
+  if (!stats::write(opts::cacheDir, cacheStatsReport)) {
+    warning(Loc(), "Failed to write the cache statistics%s%s",
+            cacheStatsReport.empty() ? "" : " to ",
+            cacheStatsReport.c_str());
+  }
+}
+
+std::string getThinLTOCachePruningPolicy() {
+  std::string policy;
+  llvm::raw_string_ostream os(policy);
+
+  if (!isPruningEnabled()) {
+    // LLVM prunes its cache files by default, and on the first link (without
+    // a timestamp file) regardless of the interval, so disable expiration and
+    // size limits too.
+    os << "prune_interval=876000h:prune_after=0s:cache_size=100%";
+    return os.str();
+  }
+
+  os << "prune_interval=" << pruneInterval << "s";
+  os << ":prune_after=" << pruneExpiration << "s";
+  os << ":cache_size=" << std::min(pruneSizeLimitPercentage.getValue(), 100u)
+     << "%";
+#if LDC_LLVM_VER >= 600
+  if (pruneSizeLimitInBytes > 0)
+    os << ":cache_size_bytes=" << pruneSizeLimitInBytes;
+#endif
+  return os.str();
+}
 } // namespace cache
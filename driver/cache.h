@@ -10,6 +10,9 @@
 #pragma once
 
 #include <string>
+#include <vector>
+
+class Module;
 
 namespace llvm {
 class Module;
@@ -20,12 +23,39 @@ template <unsigned> class SmallString;
 namespace cache {
 
 void calculateModuleHash(llvm::Module *m, llvm::SmallString<32> &str);
-std::string cacheLookup(llvm::StringRef cacheObjectHash);
+
+/// Returns whether object files are to be looked up in the cache before
+/// generating the IR (-cache-frontend).
+bool isFrontendCacheEnabled();
+/// Calculates the front-end cache key of root module `m` from the contents of
+/// its source file, of the files in its transitive import closure, its string
+/// imports, the template instances emitted into it and the cmdline options.
+/// Returns false if a file couldn't be read.
+bool calculateModuleSourceHash(Module *m, llvm::SmallString<32> &str);
+
+/// Returns the path of the cache entry for `cacheObjectHash`, or an empty
+/// string on a miss. Counted as a lookup of the front-end cache if `frontend`.
+std::string cacheLookup(llvm::StringRef cacheObjectHash,
+                        bool frontend = false);
 void cacheObjectFile(llvm::StringRef objectFile,
                      llvm::StringRef cacheObjectHash);
 void recoverObjectFile(llvm::StringRef cacheObjectHash,
                        llvm::StringRef objectFile);
 
+/// Starts fetching the entries for the given hashes from the -cache-remote
+/// backend concurrently, unless present in the local cache already.
+void prefetch(const std::vector<std::string> &cacheObjectHashes);
+/// Waits for pending uploads to the -cache-remote backend.
+void finishRemoteStores();
+
 /// Prune the cache to avoid filling up disk space.
 void pruneCache();
+
+/// Updates the statistics in the cache directory and writes the report, if
+/// enabled (-cache-stats, -cache-stats-report).
+void writeStats();
+
+/// Returns the cache pruning policy in LLVM's CachePruningPolicy format, to be
+/// used for the linker's ThinLTO cache in the -cache directory.
+std::string getThinLTOCachePruningPolicy();
 }
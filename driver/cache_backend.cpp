@@ -0,0 +1,550 @@
+//===-- cache_backend.cpp -------------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The HTTP backend implements just enough of HTTP/1.1 for the cache
+// protocol: one request per connection (`Connection: close`), bodies delimited
+// by Content-Length (or chunked transfer encoding for responses), and no TLS.
+// All network operations are non-blocking and bounded by a deadline.
+//
+//===----------------------------------------------------------------------===//
+
+#include "driver/cache_backend.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <future>
+
+#if _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+//////////////////////////////////////////////////////////////////////////////
+// Sockets
+
+#if _WIN32
+using socket_t = SOCKET;
+const socket_t invalidSocket = INVALID_SOCKET;
+const int sendFlags = 0;
+void closeSocket(socket_t s) { closesocket(s); }
+int pollSockets(pollfd *fds, unsigned count, int timeoutMilliseconds) {
+  return WSAPoll(fds, count, timeoutMilliseconds);
+}
+bool setNonBlocking(socket_t s) {
+  u_long mode = 1;
+  return ioctlsocket(s, FIONBIO, &mode) == 0;
+}
+bool wouldBlock() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+bool interrupted() { return WSAGetLastError() == WSAEINTR; }
+bool initSockets() {
+  static const bool initialized = [] {
+    WSADATA data;
+    return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+  }();
+  return initialized;
+}
+#else
+using socket_t = int;
+const socket_t invalidSocket = -1;
+#ifdef MSG_NOSIGNAL
+const int sendFlags = MSG_NOSIGNAL;
+#else
+const int sendFlags = 0;
+#endif
+void closeSocket(socket_t s) { close(s); }
+int pollSockets(pollfd *fds, unsigned count, int timeoutMilliseconds) {
+  return poll(fds, count, timeoutMilliseconds);
+}
+bool setNonBlocking(socket_t s) {
+#ifdef SO_NOSIGPIPE
+  int one = 1;
+  setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+  const int flags = fcntl(s, F_GETFL, 0);
+  return flags != -1 && fcntl(s, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+bool wouldBlock() {
+  return errno == EINPROGRESS || errno == EAGAIN || errno == EWOULDBLOCK;
+}
+bool interrupted() { return errno == EINTR; }
+bool initSockets() { return true; }
+#endif
+
+class Socket {
+  socket_t fd = invalidSocket;
+
+public:
+  Socket() = default;
+  explicit Socket(socket_t fd) : fd(fd) {}
+  Socket(Socket &&other) : fd(other.fd) { other.fd = invalidSocket; }
+  Socket &operator=(Socket &&other) {
+    std::swap(fd, other.fd);
+    return *this;
+  }
+  ~Socket() {
+    if (fd != invalidSocket)
+      closeSocket(fd);
+  }
+
+  socket_t get() const { return fd; }
+  bool valid() const { return fd != invalidSocket; }
+
+  // Waits for `events` (POLLIN/POLLOUT). Returns false on timeout or error.
+  bool wait(short events, Clock::time_point deadline) {
+    for (;;) {
+      const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                 deadline - Clock::now())
+                                 .count();
+      if (remaining <= 0)
+        return false;
+
+      pollfd p;
+      p.fd = fd;
+      p.events = events;
+      p.revents = 0;
+      const int result = pollSockets(&p, 1, static_cast<int>(remaining));
+      if (result > 0)
+        return true;
+      if (result < 0 && !interrupted())
+        return false;
+    }
+  }
+
+  bool sendAll(llvm::StringRef data, Clock::time_point deadline) {
+    while (!data.empty()) {
+      if (!wait(POLLOUT, deadline))
+        return false;
+      const int chunkSize = static_cast<int>(
+          std::min<size_t>(data.size(), static_cast<size_t>(1) << 20));
+      const auto sent = send(fd, data.data(), chunkSize, sendFlags);
+      if (sent < 0) {
+        if (wouldBlock() || interrupted())
+          continue;
+        return false;
+      }
+      data = data.drop_front(static_cast<size_t>(sent));
+    }
+    return true;
+  }
+
+  // Returns the number of received bytes, 0 at the end of the stream and -1
+  // on timeout or error.
+  long receive(char *buffer, size_t size, Clock::time_point deadline) {
+    for (;;) {
+      if (!wait(POLLIN, deadline))
+        return -1;
+      const auto received = recv(fd, buffer, static_cast<int>(size), 0);
+      if (received < 0 && (wouldBlock() || interrupted()))
+        continue;
+      return static_cast<long>(received);
+    }
+  }
+};
+
+Socket connectTo(const std::string &host, const std::string &port,
+                 Clock::time_point deadline) {
+  if (!initSockets())
+    return Socket();
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *addresses = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+    return Socket();
+
+  Socket connected;
+  for (addrinfo *ai = addresses; ai; ai = ai->ai_next) {
+    Socket s(socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol));
+    if (!s.valid() || !setNonBlocking(s.get()))
+      continue;
+
+    if (connect(s.get(), ai->ai_addr, static_cast<int>(ai->ai_addrlen)) != 0) {
+      if (!wouldBlock() || !s.wait(POLLOUT, deadline))
+        continue;
+      int error = 0;
+      socklen_t length = sizeof(error);
+      if (getsockopt(s.get(), SOL_SOCKET, SO_ERROR,
+                     reinterpret_cast<char *>(&error), &length) != 0 ||
+          error != 0)
+        continue;
+    }
+
+    connected = std::move(s);
+    break;
+  }
+
+  freeaddrinfo(addresses);
+  return connected;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// HTTP messages
+
+struct URL {
+  std::string host;
+  std::string port;
+  std::string pathPrefix; // without trailing slash
+};
+
+bool parseURL(llvm::StringRef url, URL &result, std::string &errorMsg) {
+  if (!url.startswith("http://")) {
+    errorMsg = url.startswith("https://") ? "HTTPS is not supported"
+                                          : "expected an http:// URL";
+    return false;
+  }
+
+  llvm::StringRef rest = url.drop_front(7);
+  const size_t slash = rest.find('/');
+  llvm::StringRef hostAndPort = rest.substr(0, slash);
+  const llvm::StringRef path =
+      slash == llvm::StringRef::npos ? "" : rest.substr(slash).rtrim('/');
+
+  llvm::StringRef host = hostAndPort;
+  llvm::StringRef port = "80";
+  if (hostAndPort.startswith("[")) { // IPv6 literal
+    const size_t close = hostAndPort.find(']');
+    if (close == llvm::StringRef::npos) {
+      errorMsg = "invalid IPv6 address";
+      return false;
+    }
+    host = hostAndPort.slice(1, close);
+    const llvm::StringRef suffix = hostAndPort.substr(close + 1);
+    if (suffix.startswith(":"))
+      port = suffix.drop_front();
+  } else {
+    const size_t colon = hostAndPort.rfind(':');
+    if (colon != llvm::StringRef::npos) {
+      host = hostAndPort.substr(0, colon);
+      port = hostAndPort.substr(colon + 1);
+    }
+  }
+
+  unsigned portNumber;
+  if (host.empty() || port.getAsInteger(10, portNumber) || portNumber == 0 ||
+      portNumber > 65535) {
+    errorMsg = "invalid host or port";
+    return false;
+  }
+
+  result.host = host;
+  result.port = port;
+  result.pathPrefix = path;
+  return true;
+}
+
+// Splits off the header of an HTTP message in `data`, returning the header
+// lines (without the start line). Returns false if the header is incomplete.
+bool splitHeader(llvm::StringRef data, llvm::StringRef &startLine,
+                 llvm::SmallVectorImpl<llvm::StringRef> &headerLines,
+                 size_t &bodyOffset) {
+  const size_t end = data.find("\r\n\r\n");
+  if (end == llvm::StringRef::npos)
+    return false;
+
+  data.substr(0, end).split(headerLines, "\r\n");
+  startLine = headerLines.front();
+  headerLines.erase(headerLines.begin());
+  bodyOffset = end + 4;
+  return true;
+}
+
+// Returns the value of header `name`, or an empty string.
+llvm::StringRef getHeader(llvm::ArrayRef<llvm::StringRef> headerLines,
+                          llvm::StringRef name) {
+  for (llvm::StringRef line : headerLines) {
+    const auto pair = line.split(':');
+    if (pair.first.trim().equals_lower(name))
+      return pair.second.trim();
+  }
+  return "";
+}
+
+bool decodeChunked(llvm::StringRef data, std::string &body) {
+  for (;;) {
+    const size_t lineEnd = data.find("\r\n");
+    if (lineEnd == llvm::StringRef::npos)
+      return false;
+    uint64_t size;
+    if (data.substr(0, lineEnd).split(';').first.trim().getAsInteger(16, size))
+      return false;
+    data = data.drop_front(lineEnd + 2);
+    if (size == 0)
+      return true;
+    if (data.size() < size + 2)
+      return false;
+    body.append(data.data(), size);
+    data = data.drop_front(size + 2);
+  }
+}
+
+struct Response {
+  unsigned status = 0;
+  std::string body;
+};
+
+// Sends a request for `<url>/<key>` and receives the response. Returns false
+// if the server couldn't be reached or the response was incomplete or its
+// body had neither a Content-Length nor chunked encoding.
+bool performRequest(const URL &url, llvm::StringRef method, llvm::StringRef key,
+                    llvm::StringRef body, Clock::time_point deadline,
+                    Response &response) {
+  Socket socket = connectTo(url.host, url.port, deadline);
+  if (!socket.valid())
+    return false;
+
+  std::string request;
+  llvm::raw_string_ostream os(request);
+  os << method << ' ' << url.pathPrefix << '/' << key << " HTTP/1.1\r\n"
+     << "Host: " << url.host << ':' << url.port << "\r\n"
+     << "Connection: close\r\n";
+  if (method == "PUT") {
+    os << "Content-Type: application/octet-stream\r\n"
+       << "Content-Length: " << body.size() << "\r\n";
+  }
+  os << "\r\n";
+  os.flush();
+
+  if (!socket.sendAll(request, deadline) || !socket.sendAll(body, deadline))
+    return false;
+
+  std::string data;
+  llvm::StringRef startLine;
+  llvm::SmallVector<llvm::StringRef, 16> headerLines;
+  size_t bodyOffset = 0;
+  bool haveHeader = false;
+  uint64_t contentLength = ~0ull;
+  char buffer[16 * 1024];
+  for (;;) {
+    const long received = socket.receive(buffer, sizeof(buffer), deadline);
+    if (received < 0)
+      return false;
+    if (received == 0)
+      break;
+    data.append(buffer, static_cast<size_t>(received));
+
+    if (!haveHeader) {
+      haveHeader = splitHeader(data, startLine, headerLines, bodyOffset);
+      if (haveHeader &&
+          getHeader(headerLines, "Content-Length").getAsInteger(10, contentLength))
+        contentLength = ~0ull;
+    }
+    // Don't wait for the server to close the connection if not needed.
+    if (haveHeader && contentLength != ~0ull &&
+        data.size() - bodyOffset >= contentLength)
+      break;
+  }
+
+  if (!haveHeader &&
+      !splitHeader(data, startLine, headerLines, bodyOffset))
+    return false;
+
+  // "HTTP/1.1 200 OK"
+  if (!startLine.startswith("HTTP/") ||
+      startLine.split(' ').second.substr(0, 3).getAsInteger(10,
+                                                            response.status))
+    return false;
+
+  const llvm::StringRef rawBody = llvm::StringRef(data).drop_front(bodyOffset);
+  if (getHeader(headerLines, "Transfer-Encoding").equals_lower("chunked"))
+    return decodeChunked(rawBody, response.body);
+  if (contentLength == ~0ull) {
+    // The end of such a body can't be told apart from a dropped connection,
+    // don't take it for a cache entry.
+    return rawBody.empty() && response.status != 200;
+  }
+  if (rawBody.size() < contentLength)
+    return false;
+  response.body = rawBody.substr(0, contentLength);
+  return true;
+}
+
+// Writes `contents` to `path` atomically (via a temporary file).
+bool writeFileAtomically(llvm::StringRef path, llvm::StringRef contents) {
+  int fd;
+  llvm::SmallString<128> tempFile;
+  if (llvm::sys::fs::createUniqueFile(llvm::Twine(path) + ".tmp%%%%%%%", fd,
+                                      tempFile))
+    return false;
+
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+    os << contents;
+    os.close();
+    if (os.has_error()) {
+      os.clear_error();
+      llvm::sys::fs::remove(tempFile);
+      return false;
+    }
+  }
+
+  if (llvm::sys::fs::rename(tempFile, path)) {
+    llvm::sys::fs::remove(tempFile);
+    return false;
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Backends
+
+class DirectoryBackend : public cache::CacheBackend {
+  std::string directory;
+
+public:
+  explicit DirectoryBackend(llvm::StringRef directory) : directory(directory) {}
+
+  std::string describe() const override { return "directory " + directory; }
+
+  bool fetch(llvm::StringRef key, llvm::StringRef destination) override {
+    llvm::SmallString<128> path(directory);
+    llvm::sys::path::append(path, key);
+    return !llvm::sys::fs::copy_file(path, destination);
+  }
+
+  void store(llvm::StringRef key, llvm::StringRef source) override {
+    if (llvm::sys::fs::create_directories(directory))
+      return;
+    llvm::SmallString<128> path(directory);
+    llvm::sys::path::append(path, key);
+    llvm::SmallString<128> tempFile;
+    if (llvm::sys::fs::createUniqueFile(llvm::Twine(path) + ".tmp%%%%%%%",
+                                        tempFile))
+      return;
+    if (llvm::sys::fs::copy_file(source, tempFile) ||
+        llvm::sys::fs::rename(tempFile, path)) {
+      llvm::sys::fs::remove(tempFile);
+    }
+  }
+};
+
+class HTTPBackend : public cache::CacheBackend {
+  const URL url;
+  const std::string location;
+  const std::chrono::milliseconds timeout;
+
+  struct PendingFetch {
+    std::shared_future<void> done;
+    bool found = false;
+    std::string contents;
+  };
+  // Only accessed by the compiler's main thread; each request task only writes
+  // to its own PendingFetch.
+  llvm::StringMap<std::unique_ptr<PendingFetch>> pendingFetches;
+
+  // Fetches and stores run concurrently on these threads. Declared last, so
+  // that it is destructed (waiting for all tasks) first.
+  llvm::ThreadPool pool;
+
+  bool get(llvm::StringRef key, std::string &contents) const {
+    Response response;
+    if (!performRequest(url, "GET", key, "", Clock::now() + timeout,
+                        response) ||
+        response.status != 200)
+      return false;
+    contents = std::move(response.body);
+    return true;
+  }
+
+public:
+  HTTPBackend(URL url, llvm::StringRef location, unsigned timeoutMilliseconds)
+      : url(std::move(url)), location(location), timeout(timeoutMilliseconds),
+        pool(8) {}
+
+  std::string describe() const override { return "HTTP server " + location; }
+
+  void prefetch(llvm::ArrayRef<std::string> keys) override {
+    for (const auto &key : keys) {
+      if (pendingFetches.count(key))
+        continue;
+      auto pending = llvm::make_unique<PendingFetch>();
+      PendingFetch *p = pending.get();
+      p->done = pool.async([this, p, key] { p->found = get(key, p->contents); });
+      pendingFetches[key] = std::move(pending);
+    }
+  }
+
+  bool fetch(llvm::StringRef key, llvm::StringRef destination) override {
+    std::string contents;
+    bool found;
+    auto it = pendingFetches.find(key);
+    if (it != pendingFetches.end()) {
+      // Bounded by the request timeout.
+      it->second->done.wait();
+      found = it->second->found;
+      contents = std::move(it->second->contents);
+      pendingFetches.erase(it);
+    } else {
+      found = get(key, contents);
+    }
+
+    return found && writeFileAtomically(destination, contents);
+  }
+
+  void store(llvm::StringRef key, llvm::StringRef source) override {
+    const std::string k = key;
+    const std::string file = source;
+    pool.async([this, k, file] {
+      auto buffer = llvm::MemoryBuffer::getFile(file);
+      if (!buffer)
+        return;
+      Response response;
+      performRequest(url, "PUT", k, (*buffer)->getBuffer(),
+                     Clock::now() + timeout, response);
+    });
+  }
+
+  void finish() override { pool.wait(); }
+};
+
+} // anonymous namespace
+
+namespace cache {
+
+std::unique_ptr<CacheBackend> createCacheBackend(llvm::StringRef location,
+                                                 unsigned timeoutMilliseconds,
+                                                 std::string &errorMsg) {
+  if (location.find("://") == llvm::StringRef::npos)
+    return llvm::make_unique<DirectoryBackend>(location);
+
+  URL url;
+  if (!parseURL(location, url, errorMsg))
+    return nullptr;
+  return llvm::make_unique<HTTPBackend>(std::move(url), location,
+                                        timeoutMilliseconds);
+}
+}
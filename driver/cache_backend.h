@@ -0,0 +1,55 @@
+//===-- driver/cache_backend.h - Shared cache storage -----------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Storage backends for the cache, in addition to the local cache directory:
+// a (shared) directory or a content-addressed HTTP cache server speaking a
+// simple GET/PUT protocol (`<url>/<entry name>`, like bazel-remote or sccache).
+// Entries are addressed by their file name in the local cache directory.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include <memory>
+#include <string>
+
+namespace cache {
+
+class CacheBackend {
+public:
+  virtual ~CacheBackend() = default;
+
+  /// Returns a description for log messages.
+  virtual std::string describe() const = 0;
+
+  /// Retrieves entry `key` into file `destination`. Returns false on a miss or
+  /// any error, in which case the entry is simply compiled locally.
+  virtual bool fetch(llvm::StringRef key, llvm::StringRef destination) = 0;
+
+  /// Adds file `source` as entry `key`. This may happen asynchronously (see
+  /// finish()); errors are ignored.
+  virtual void store(llvm::StringRef key, llvm::StringRef source) = 0;
+
+  /// Starts fetching the given entries concurrently, so that subsequent
+  /// fetch() calls for them don't have to wait for a full round trip.
+  virtual void prefetch(llvm::ArrayRef<std::string> keys) {}
+
+  /// Waits for all pending stores.
+  virtual void finish() {}
+};
+
+/// Creates the backend for `location`, either an `http://` URL or a directory.
+/// Requests to an HTTP server time out after `timeoutMilliseconds`. Returns
+/// null and sets `errorMsg` for invalid locations.
+std::unique_ptr<CacheBackend> createCacheBackend(llvm::StringRef location,
+                                                 unsigned timeoutMilliseconds,
+                                                 std::string &errorMsg);
+}
@@ -11,6 +11,9 @@
 
 #include "dmd/globals.h"
 
+// Stores the number and total size of the removed cache files in
+// `prunedEntries` and `prunedBytes`.
 void pruneCache(const char *cacheDirectoryPtr, d_size_t cacheDirectoryLen,
                 uint32_t pruneIntervalSeconds, uint32_t expireIntervalSeconds,
-                uinteger_t sizeLimitBytes, uint32_t sizeLimitPercentage);
+                uinteger_t sizeLimitBytes, uint32_t sizeLimitPercentage,
+                uinteger_t *prunedEntries, uinteger_t *prunedBytes);
@@ -0,0 +1,209 @@
+//===-- cache_stats.cpp ---------------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The persistent counters are stored as `<name> <value>` lines in
+// `ircache_stats.txt` in the cache directory, updated under a lock file so
+// that concurrent compiler invocations don't lose updates.
+//
+//===----------------------------------------------------------------------===//
+
+#include "driver/cache_stats.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LockFileManager.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace {
+
+// Indexed by cache::stats::Counter.
+const char *const counterNames[cache::stats::NumCounters] = {
+    "invocations",
+    "hits",
+    "misses",
+    "remote_fetches",
+    "bytes_stored",
+    "bytes_recovered",
+    "hashing_us",
+    "compile_us",
+    "evicted_entries",
+    "evicted_bytes",
+    "compression_input_bytes",
+    "compression_output_bytes",
+    "compress_us",
+    "decompress_us",
+    "frontend_hits",
+    "frontend_misses"};
+
+uint64_t counters[cache::stats::NumCounters];
+
+using Counters = uint64_t[cache::stats::NumCounters];
+
+void parseCounters(llvm::StringRef contents, Counters &result) {
+  llvm::SmallVector<llvm::StringRef, 16> lines;
+  contents.split(lines, '\n', -1, /*KeepEmpty=*/false);
+  for (llvm::StringRef line : lines) {
+    const auto pair = line.trim().split(' ');
+    uint64_t value;
+    if (pair.second.getAsInteger(10, value))
+      continue;
+    // Unknown names (from other compiler versions) are dropped.
+    for (unsigned i = 0; i < cache::stats::NumCounters; ++i) {
+      if (pair.first == counterNames[i])
+        result[i] = value;
+    }
+  }
+}
+
+bool writeCounters(llvm::StringRef path, const Counters &values) {
+  llvm::SmallString<128> tempFile;
+  int fd;
+  if (llvm::sys::fs::createUniqueFile(llvm::Twine(path) + ".tmp%%%%%%%", fd,
+                                      tempFile))
+    return false;
+
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+    for (unsigned i = 0; i < cache::stats::NumCounters; ++i)
+      os << counterNames[i] << ' ' << values[i] << '\n';
+    os.close();
+    if (os.has_error()) {
+      os.clear_error();
+      llvm::sys::fs::remove(tempFile);
+      return false;
+    }
+  }
+
+  if (llvm::sys::fs::rename(tempFile, path)) {
+    llvm::sys::fs::remove(tempFile);
+    return false;
+  }
+  return true;
+}
+
+// Adds this invocation's counters to the persistent ones and stores the sums
+// in `totals`.
+bool updatePersistentCounters(llvm::StringRef cacheDir, Counters &totals) {
+  llvm::SmallString<128> path(cacheDir);
+  llvm::sys::path::append(path, "ircache_stats.txt");
+
+  // Retry a few times if another process holds the lock for too long.
+  for (unsigned attempt = 0; attempt < 3; ++attempt) {
+    llvm::LockFileManager lock(path);
+    switch (lock) {
+    case llvm::LockFileManager::LFS_Error:
+      return false;
+    case llvm::LockFileManager::LFS_Shared:
+      lock.waitForUnlock();
+      continue;
+    case llvm::LockFileManager::LFS_Owned:
+      break;
+    }
+
+    for (auto &total : totals)
+      total = 0;
+    if (auto buffer = llvm::MemoryBuffer::getFile(path))
+      parseCounters((*buffer)->getBuffer(), totals);
+    for (unsigned i = 0; i < cache::stats::NumCounters; ++i)
+      totals[i] += counters[i];
+    return writeCounters(path, totals);
+  }
+  return false;
+}
+
+void writeJSONString(llvm::raw_ostream &os, llvm::StringRef str) {
+  os << '"';
+  for (char c : str) {
+    if (c == '"' || c == '\\')
+      os << '\\' << c;
+    else if (static_cast<unsigned char>(c) < 0x20)
+      os << ' ';
+    else
+      os << c;
+  }
+  os << '"';
+}
+
+void writeJSONCounters(llvm::raw_ostream &os, const Counters &values) {
+  os << "{";
+  for (unsigned i = 0; i < cache::stats::NumCounters; ++i) {
+    os << (i ? ",\n    " : "\n    ");
+    writeJSONString(os, counterNames[i]);
+    os << ": " << values[i];
+  }
+  // Compressed size / uncompressed size of the compressed entries.
+  if (const auto input = values[cache::stats::CompressionInputBytes]) {
+    os << ",\n    \"compression_ratio\": "
+       << llvm::format("%.4f",
+                       static_cast<double>(
+                           values[cache::stats::CompressionOutputBytes]) /
+                           input);
+  }
+  os << "\n  }";
+}
+
+void writeReport(llvm::raw_ostream &os, llvm::StringRef cacheDir,
+                 const Counters *totals) {
+  os << "{\n  \"cache_dir\": ";
+  writeJSONString(os, cacheDir);
+  os << ",\n  \"invocation\": ";
+  writeJSONCounters(os, counters);
+  if (totals) {
+    os << ",\n  \"total\": ";
+    writeJSONCounters(os, *totals);
+  }
+  os << "\n}\n";
+}
+
+} // anonymous namespace
+
+namespace cache {
+namespace stats {
+
+void add(Counter counter, uint64_t value) { counters[counter] += value; }
+
+void addTime(Counter counter, std::chrono::steady_clock::duration duration) {
+  add(counter,
+      std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+}
+
+bool write(llvm::StringRef cacheDir, llvm::StringRef reportFile) {
+  add(Invocations, 1);
+
+  Counters totals;
+  const bool updated = !llvm::sys::fs::create_directories(cacheDir) &&
+                       updatePersistentCounters(cacheDir, totals);
+
+  if (reportFile.empty())
+    return updated;
+
+  if (reportFile == "-") {
+    writeReport(llvm::outs(), cacheDir, updated ? &totals : nullptr);
+    llvm::outs().flush();
+    return updated;
+  }
+
+  std::error_code ec;
+  llvm::raw_fd_ostream os(reportFile, ec, llvm::sys::fs::F_Text);
+  if (ec)
+    return false;
+  writeReport(os, cacheDir, updated ? &totals : nullptr);
+  os.close();
+  if (os.has_error()) {
+    os.clear_error();
+    return false;
+  }
+  return updated;
+}
+}
+}
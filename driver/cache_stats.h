@@ -0,0 +1,56 @@
+//===-- driver/cache_stats.h - Cache statistics -----------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Counters for the effectiveness of the cache (-cache-stats). The counters of
+// an invocation are accumulated in a file in the cache directory and can be
+// written to a JSON report.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "llvm/ADT/StringRef.h"
+#include <chrono>
+#include <cstdint>
+
+namespace cache {
+namespace stats {
+
+enum Counter {
+  Invocations,
+  Hits,
+  Misses,
+  RemoteFetches,
+  BytesStored,
+  BytesRecovered,
+  HashingMicroseconds,
+  CompileMicroseconds,
+  EvictedEntries,
+  EvictedBytes,
+  CompressionInputBytes,
+  CompressionOutputBytes,
+  CompressMicroseconds,
+  DecompressMicroseconds,
+  // Lookups of the front-end cache (-cache-frontend), its misses are then
+  // looked up in the IR-to-object cache (Hits/Misses).
+  FrontendHits,
+  FrontendMisses,
+  NumCounters
+};
+
+/// Adds `value` to a counter of this invocation. Main thread only.
+void add(Counter counter, uint64_t value);
+void addTime(Counter counter, std::chrono::steady_clock::duration duration);
+
+/// Adds the counters of this invocation to the persistent ones in `cacheDir`
+/// and writes both to the JSON file `reportFile` (stdout for "-") unless
+/// empty. Returns false on I/O errors.
+bool write(llvm::StringRef cacheDir, llvm::StringRef reportFile);
+}
+}
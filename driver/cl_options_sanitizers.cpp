@@ -197,6 +197,11 @@ void outputSanitizerSettings(llvm::raw_ostream &hash_os) {
 #endif
 }
 
+std::vector<std::string> getSanitizerBlacklistFiles() {
+  return std::vector<std::string>(fSanitizeBlacklist.begin(),
+                                  fSanitizeBlacklist.end());
+}
+
 bool functionIsInSanitizerBlacklist(FuncDeclaration *funcDecl) {
   if (!sanitizerBlacklist)
     return false;
@@ -15,6 +15,8 @@
 
 #include "gen/cl_helpers.h"
 #include "llvm/Transforms/Instrumentation.h"
+#include <string>
+#include <vector>
 
 #if LDC_LLVM_VER >= 400
 // Enable coverage sanitizer options from LLVM 4.0 to simplify our code: earlier
@@ -54,6 +56,8 @@ llvm::SanitizerCoverageOptions getSanitizerCoverageOptions();
 
 void outputSanitizerSettings(llvm::raw_ostream &hash_os);
 
+std::vector<std::string> getSanitizerBlacklistFiles();
+
 bool functionIsInSanitizerBlacklist(FuncDeclaration *funcDecl);
 
 } // namespace opts
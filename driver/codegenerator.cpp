@@ -10,10 +10,12 @@
 #include "driver/codegenerator.h"
 
 #include "dmd/compiler.h"
+#include "dmd/errors.h"
 #include "dmd/id.h"
 #include "dmd/mars.h"
 #include "dmd/module.h"
 #include "dmd/scope.h"
+#include "driver/cache.h"
 #include "driver/cl_options.h"
 #include "driver/cl_options_instrumentation.h"
 #include "driver/linker.h"
@@ -21,6 +23,7 @@
 #include "gen/dynamiccompile.h"
 #include "gen/logger.h"
 #include "gen/modules.h"
+#include "gen/optimizer.h"
 #include "gen/runtime.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Path.h"
@@ -77,6 +80,36 @@ createAndSetDiagnosticsOutputFile(IRState &irs, llvm::LLVMContext &ctx,
   return diagnosticsOutputFile;
 }
 
+// The front-end cache skips IR generation for a module, so it can only be used
+// if the object file is the only output and only depends on the module's
+// sources.
+bool canUseFrontendCache(bool singleObj) {
+  if (singleObj || !cache::isFrontendCacheEnabled())
+    return false;
+
+  if (!global.params.output_o || global.params.output_ll ||
+      global.params.output_bc || global.params.output_s)
+    return false;
+
+  // Bitcode files are linked into the first emitted module, and cross-module
+  // inlining may add members to other modules during codegen.
+  if (global.params.bitcodeFiles.dim != 0 || willCrossModuleInline())
+    return false;
+
+  // The contents of the profile data aren't part of the hash.
+  if (opts::isUsingPGOProfile())
+    return false;
+
+#if LDC_LLVM_VER >= 400
+  if (opts::saveOptimizationRecord.getNumOccurrences() > 0)
+    return false;
+#endif
+
+  return true;
+}
+
+size_t membersCount(Module *m) { return m->members ? m->members->dim : 0; }
+
 } // anonymous namespace
 
 namespace {
@@ -171,14 +204,31 @@ void emitLLVMUsedArray(IRState &irs) {
 
 namespace ldc {
 CodeGenerator::CodeGenerator(llvm::LLVMContext &context, bool singleObj)
-    : context_(context), moduleCount_(0), singleObj_(singleObj), ir_(nullptr) {
+    : context_(context), moduleCount_(0), singleObj_(singleObj), ir_(nullptr),
+      useFrontendCache_(canUseFrontendCache(singleObj)) {
   // Set the context to discard value names when not generating textual IR.
   if (!global.params.output_ll) {
     context_.setDiscardValueNames(true);
   }
+
+  if (!singleObj_) {
+    const unsigned numThreads = ParallelModuleWriter::numThreads();
+    if (numThreads > 1) {
+      parallelWriter_ = llvm::make_unique<ParallelModuleWriter>(numThreads);
+    }
+  }
 }
 
 CodeGenerator::~CodeGenerator() {
+  if (parallelWriter_) {
+    parallelWriter_->finish();
+  }
+
+  // All object files have been written now.
+  for (const auto &miss : frontendCacheMisses_) {
+    cache::cacheObjectFile(miss.first, miss.second);
+  }
+
   if (singleObj_) {
     // For singleObj builds, the first object file name is the one for the first
     // source file (e.g., `b.o` for `ldc2 a.o b.d c.d`).
@@ -192,6 +242,57 @@ CodeGenerator::~CodeGenerator() {
   }
 }
 
+// Looks up the object file for `m` in the cache, keyed on the module's
+// sources, and restores it on a hit.
+bool CodeGenerator::recoverFromFrontendCache(Module *m) {
+  IF_LOG Logger::println("Use front-end cache in %s", opts::cacheDir.c_str());
+  LOG_SCOPE
+
+  // Reuse the hash of the prefetch unless members were added to the module
+  // since (see canUseFrontendCache).
+  llvm::SmallString<32> sourceHash;
+  auto it = prefetchedHashes_.find(m);
+  if (it != prefetchedHashes_.end() &&
+      it->second.first == membersCount(m)) {
+    sourceHash = it->second.second;
+  } else if (!cache::calculateModuleSourceHash(m, sourceHash)) {
+    return false;
+  }
+
+  const char *filename = m->objfile->name.toChars();
+  if (cache::cacheLookup(sourceHash, /*frontend=*/true).empty()) {
+    frontendCacheMisses_.emplace_back(filename, sourceHash.str().str());
+    return false;
+  }
+
+  const auto directory = llvm::sys::path::parent_path(filename);
+  if (!directory.empty()) {
+    if (auto ec = llvm::sys::fs::create_directories(directory)) {
+      error(Loc(), "failed to create output directory: %s\n%s",
+            directory.str().c_str(), ec.message().c_str());
+      fatal();
+    }
+  }
+
+  cache::recoverObjectFile(sourceHash, filename);
+  return true;
+}
+
+void CodeGenerator::prefetchFromCache(Modules &modules) {
+  if (!useFrontendCache_)
+    return;
+
+  std::vector<std::string> hashes;
+  for (Module *m : modules) {
+    llvm::SmallString<32> sourceHash;
+    if (!m->isHdrFile && cache::calculateModuleSourceHash(m, sourceHash)) {
+      hashes.push_back(sourceHash.str());
+      prefetchedHashes_[m] = {membersCount(m), sourceHash.str().str()};
+    }
+  }
+  cache::prefetch(hashes);
+}
+
 void CodeGenerator::prepareLLModule(Module *m) {
   ++moduleCount_;
 
@@ -253,7 +354,13 @@ void CodeGenerator::writeAndFreeLLModule(const char *filename) {
   std::unique_ptr<llvm::ToolOutputFile> diagnosticsOutputFile =
       createAndSetDiagnosticsOutputFile(*ir_, context_, filename);
 
-  writeModule(&ir_->module, filename);
+  if (singleObj_) {
+    writeSingleObjModule(&ir_->module, filename);
+  } else if (parallelWriter_) {
+    parallelWriter_->submit(&ir_->module, filename);
+  } else {
+    writeModule(&ir_->module, filename);
+  }
 
   if (diagnosticsOutputFile)
     diagnosticsOutputFile->keep();
@@ -282,6 +389,10 @@ void emitSymbolAddrGlobal(llvm::Module &lm, const char *symbolName,
 void CodeGenerator::emit(Module *m) {
   bool const loggerWasEnabled = Logger::enabled();
   if (m->llvmForceLogging && !loggerWasEnabled) {
+    // Don't let the log interleave with codegen threads' output.
+    if (parallelWriter_) {
+      parallelWriter_->finish();
+    }
     Logger::enable();
   }
 
@@ -297,6 +408,13 @@ void CodeGenerator::emit(Module *m) {
     fatal();
   }
 
+  if (useFrontendCache_ && recoverFromFrontendCache(m)) {
+    if (m->llvmForceLogging && !loggerWasEnabled) {
+      Logger::disable();
+    }
+    return;
+  }
+
   prepareLLModule(m);
 
   codegenModule(ir_, m);
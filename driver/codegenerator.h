@@ -20,6 +20,13 @@
 #pragma once
 
 #include "gen/irstate.h"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class ParallelModuleWriter;
 
 namespace ldc {
 
@@ -28,15 +35,29 @@ public:
   CodeGenerator(llvm::LLVMContext &context, bool singleObj);
   ~CodeGenerator();
   void emit(Module *m);
+  /// Starts fetching the object files of `modules` from the remote cache
+  /// concurrently (with -cache-frontend and -cache-remote).
+  void prefetchFromCache(Modules &modules);
 
 private:
   void prepareLLModule(Module *m);
   void finishLLModule(Module *m);
   void writeAndFreeLLModule(const char *filename);
+  bool recoverFromFrontendCache(Module *m);
 
   llvm::LLVMContext &context_;
   int moduleCount_;
   bool const singleObj_;
   IRState *ir_;
+  // Set if separately compiled modules are emitted by codegen worker threads.
+  std::unique_ptr<ParallelModuleWriter> parallelWriter_;
+  // Set if object files are looked up in the cache before IR generation.
+  bool const useFrontendCache_;
+  // Object files to add to the cache when done, with their source hashes.
+  std::vector<std::pair<std::string, std::string>> frontendCacheMisses_;
+  // Source hashes calculated by prefetchFromCache, with the number of members
+  // of the module at that time.
+  std::unordered_map<Module *, std::pair<size_t, std::string>>
+      prefetchedHashes_;
 };
 }
@@ -8,6 +8,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "dmd/errors.h"
+#include "driver/cache.h"
 #include "driver/cl_options.h"
 #include "driver/cl_options_instrumentation.h"
 #include "driver/cl_options_sanitizers.h"
@@ -70,6 +71,7 @@ private:
   virtual void addTargetFlags();
 
   void addLTOGoldPluginFlags();
+  virtual void addThinLTOCacheFlags();
   void addDarwinLTOFlags();
   void addLTOLinkFlags();
 
@@ -144,6 +146,21 @@ void ArgsBuilder::addLTOGoldPluginFlags() {
   if (TO.DataSections)
     addLdFlag("-plugin-opt=-data-sections");
 #endif
+
+  if (opts::isUsingThinLTO() && !opts::cacheDir.empty())
+    addThinLTOCacheFlags();
+}
+
+// Lets the linker cache the ThinLTO backend objects in the -cache directory,
+// so that relinks only re-run the backend for modules whose imports changed.
+// The linker's cache files (`llvmcache-*`) are pruned by the linker itself,
+// using LDC's pruning settings.
+void ArgsBuilder::addThinLTOCacheFlags() {
+#if LDC_LLVM_VER >= 500
+  addLdFlag(llvm::Twine("-plugin-opt=cache-dir=") + opts::cacheDir);
+  addLdFlag(llvm::Twine("-plugin-opt=cache-policy=") +
+            cache::getThinLTOCachePruningPolicy());
+#endif
 }
 
 // Returns an empty string when libLTO.dylib was not specified nor found.
@@ -675,6 +692,16 @@ class LdArgsBuilder : public ArgsBuilder {
 
   void addTargetFlags() override {}
 
+  void addThinLTOCacheFlags() override {
+#if LDC_LLVM_VER >= 500
+    // LLD's own switches (the gold plugin ones aren't supported by all LLD
+    // versions).
+    args.push_back("--thinlto-cache-dir=" + opts::cacheDir);
+    args.push_back("--thinlto-cache-policy=" +
+                   cache::getThinLTOCachePruningPolicy());
+#endif
+  }
+
   void addLdFlag(const llvm::Twine &flag) override {
     args.push_back(flag.str());
   }
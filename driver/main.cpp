@@ -1031,6 +1031,7 @@ void codegenModules(Modules &modules) {
     ldc::CodeGenerator cg(getGlobalContext(), global.params.oneobj);
     DComputeCodeGenManager dccg(getGlobalContext());
     std::vector<Module *> computeModules;
+    cg.prefetchFromCache(modules);
     // When inlining is enabled, we are calling semantic3 on function
     // declarations, which may _add_ members to the first module in the modules
     // array. These added functions must be codegenned, because these functions
@@ -1081,7 +1082,9 @@ void codegenModules(Modules &modules) {
       global.params.link = false;
   }
 
+  cache::finishRemoteStores();
   cache::pruneCache();
+  cache::writeStats();
 
   freeRuntime();
   llvm::llvm_shutdown();
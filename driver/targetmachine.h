@@ -64,6 +64,15 @@ createTargetMachine(std::string targetTriple, std::string arch, std::string cpu,
                     llvm::CodeGenOpt::Level codeGenOptLevel,
                     bool noLinkerStripDead);
 
+/**
+ * Creates a new LLVM TargetMachine with the same target, CPU, features and
+ * options as the given one.
+ *
+ * TargetMachines aren't thread-safe, so this is used to give each codegen
+ * worker thread its own instance.
+ */
+llvm::TargetMachine *cloneTargetMachine(const llvm::TargetMachine &tm);
+
 /**
  * Returns the Mips ABI which is used for code generation.
  *
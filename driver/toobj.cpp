@@ -9,8 +9,10 @@
 
 #include "driver/toobj.h"
 
+#include "dmd/root/rmem.h"
 #include "driver/cl_options.h"
 #include "driver/cache.h"
+#include "driver/cache_stats.h"
 #include "driver/targetmachine.h"
 #include "driver/tool.h"
 #include "gen/irstate.h"
@@ -21,6 +23,7 @@
 #include "llvm/Analysis/ModuleSummaryAnalysis.h"
 #if LDC_LLVM_VER >= 400
 #include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
 #else
 #include "llvm/Bitcode/ReaderWriter.h"
@@ -29,8 +32,10 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Program.h"
 #include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Analysis/TargetTransformInfo.h"
 #if LDC_LLVM_VER >= 600
@@ -39,9 +44,14 @@
 #include "llvm/Target/TargetSubtargetInfo.h"
 #endif
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
 #include "llvm/IR/Module.h"
+#include <chrono>
 #include <cstddef>
+#include <deque>
 #include <fstream>
+#include <future>
+#include <thread>
 
 #ifdef LDC_LLVM_SUPPORTED_TARGET_SPIRV
 namespace llvm {
@@ -58,7 +68,7 @@ namespace {
 
 // based on llc code, University of Illinois Open Source License
 void codegenModule(llvm::TargetMachine &Target, llvm::Module &m,
-                   llvm::raw_fd_ostream &out,
+                   llvm::raw_pwrite_stream &out,
                    llvm::TargetMachine::CodeGenFileType fileType) {
   using namespace llvm;
 
@@ -106,7 +116,7 @@ void codegenModule(llvm::TargetMachine &Target, llvm::Module &m,
 }
 
 void cloneAndCodegenModule(llvm::TargetMachine &Target, llvm::Module &m,
-                           llvm::raw_fd_ostream &out,
+                           llvm::raw_pwrite_stream &out,
                            llvm::TargetMachine::CodeGenFileType fileType) {
   auto newModule = llvm::CloneModule(
 #if LDC_LLVM_VER >= 700
@@ -266,23 +276,6 @@ public:
   }
 };
 
-void writeObjectFile(llvm::Module *m, const char *filename) {
-  IF_LOG Logger::println("Writing object file to: %s", filename);
-  std::error_code errinfo;
-  {
-    llvm::raw_fd_ostream out(filename, errinfo, llvm::sys::fs::F_None);
-    if (!errinfo)
-    {
-      codegenModule(*gTargetMachine, *m, out,
-                    llvm::TargetMachine::CGFT_ObjectFile);
-    } else {
-      error(Loc(), "cannot write object file '%s': %s", filename,
-            errinfo.message().c_str());
-      fatal();
-    }
-  }
-}
-
 bool shouldAssembleExternally() {
   // There is no integrated assembler on AIX because XCOFF is not supported.
   // Starting with LLVM 3.5 the integrated assembler can be used with MinGW.
@@ -305,39 +298,61 @@ bool shouldDoLTO(llvm::Module *m) {
 #endif
   return opts::isUsingLTO();
 }
-} // end of anonymous namespace
 
-void writeModule(llvm::Module *m, const char *filename) {
-  const bool doLTO = shouldDoLTO(m);
-  const bool outputObj = shouldOutputObjectFile();
-  const bool assembleExternally = shouldAssembleExternally();
+/// Opens the output files of a module. The default implementation writes them
+/// directly to disk; MemoryOutputFiles buffers them for codegen worker threads.
+class OutputFiles {
+public:
+  virtual ~OutputFiles() = default;
 
-  // Use cached object code if possible.
-  // TODO: combine LDC's cache and LTO (the advantage is skipping the IR
-  // optimization).
-  const bool useIR2ObjCache = !opts::cacheDir.empty() && outputObj && !doLTO;
-  llvm::SmallString<32> moduleHash;
-  if (useIR2ObjCache) {
-    llvm::SmallString<128> cacheDir(opts::cacheDir.c_str());
-    llvm::sys::fs::make_absolute(cacheDir);
-    opts::cacheDir = cacheDir.c_str();
-
-    IF_LOG Logger::println("Use IR-to-Object cache in %s",
-                           opts::cacheDir.c_str());
-    LOG_SCOPE
-
-    cache::calculateModuleHash(m, moduleHash);
-    std::string cacheFile = cache::cacheLookup(moduleHash);
-    if (!cacheFile.empty()) {
-      cache::recoverObjectFile(moduleHash, filename);
-      return;
+  /// Returns the stream to write the output file `path` (of the given kind,
+  /// used for diagnostics) to. The file is complete when the stream is
+  /// destroyed.
+  virtual std::unique_ptr<llvm::raw_pwrite_stream> open(const std::string &path,
+                                                        const char *kind) {
+    std::error_code errinfo;
+    auto os = llvm::make_unique<llvm::raw_fd_ostream>(path, errinfo,
+                                                      llvm::sys::fs::F_None);
+    if (errinfo) {
+      error(Loc(), "cannot write %s '%s': %s", kind, path.c_str(),
+            errinfo.message().c_str());
+      fatal();
     }
+    return std::move(os);
   }
+};
 
-  // run optimizer
-  ldc_optimize_module(m);
+/// Collects the output files in memory; they are written to disk later on the
+/// main thread via flush().
+class MemoryOutputFiles : public OutputFiles {
+  struct File {
+    std::string path;
+    const char *kind;
+    llvm::SmallVector<char, 0> contents;
+  };
+  // std::deque to keep the buffers in place while new files are added.
+  std::deque<File> files;
 
-  // make sure the output directory exists
+public:
+  std::unique_ptr<llvm::raw_pwrite_stream> open(const std::string &path,
+                                                const char *kind) override {
+    files.push_back({path, kind, {}});
+    return llvm::make_unique<llvm::raw_svector_ostream>(files.back().contents);
+  }
+
+  void flush() {
+    OutputFiles disk;
+    for (auto &file : files) {
+      IF_LOG Logger::println("Writing %s to: %s", file.kind,
+                             file.path.c_str());
+      auto os = disk.open(file.path, file.kind);
+      os->write(file.contents.data(), file.contents.size());
+    }
+    files.clear();
+  }
+};
+
+void createOutputDirectory(const char *filename) {
   const auto directory = llvm::sys::path::parent_path(filename);
   if (!directory.empty()) {
     if (auto ec = llvm::sys::fs::create_directories(directory)) {
@@ -346,6 +361,14 @@ void writeModule(llvm::Module *m, const char *filename) {
       fatal();
     }
   }
+}
+
+// Emits all requested output files for the (optimized) module `m`.
+void emitModule(llvm::Module *m, const char *filename,
+                llvm::TargetMachine &targetMachine, OutputFiles &outputFiles) {
+  const bool doLTO = shouldDoLTO(m);
+  const bool outputObj = shouldOutputObjectFile();
+  const bool assembleExternally = shouldAssembleExternally();
 
   const auto outputFlags = {global.params.output_o, global.params.output_bc,
                             global.params.output_ll, global.params.output_s};
@@ -369,13 +392,7 @@ void writeModule(llvm::Module *m, const char *filename) {
                              ? filename
                              : replaceExtensionWith(global.bc_ext);
     Logger::println("Writing LLVM bitcode to: %s\n", bcpath.c_str());
-    std::error_code errinfo;
-    llvm::raw_fd_ostream bos(bcpath.c_str(), errinfo, llvm::sys::fs::F_None);
-    if (bos.has_error()) {
-      error(Loc(), "cannot write LLVM bitcode file '%s': %s", bcpath.c_str(),
-            errinfo.message().c_str());
-      fatal();
-    }
+    auto bos = outputFiles.open(bcpath, "LLVM bitcode file");
 
 #if LDC_LLVM_VER >= 700
     auto &M = *m;
@@ -400,10 +417,10 @@ void writeModule(llvm::Module *m, const char *filename) {
           *m, /* function freq callback */ nullptr, &PSI);
 #endif
 
-      llvm::WriteBitcodeToFile(M, bos, true, &moduleSummaryIndex,
+      llvm::WriteBitcodeToFile(M, *bos, true, &moduleSummaryIndex,
                                /* generate ThinLTO hash */ true);
     } else {
-      llvm::WriteBitcodeToFile(M, bos);
+      llvm::WriteBitcodeToFile(M, *bos);
     }
   }
 
@@ -411,15 +428,9 @@ void writeModule(llvm::Module *m, const char *filename) {
   if (global.params.output_ll) {
     const auto llpath = replaceExtensionWith(global.ll_ext);
     Logger::println("Writing LLVM IR to: %s\n", llpath.c_str());
-    std::error_code errinfo;
-    llvm::raw_fd_ostream aos(llpath.c_str(), errinfo, llvm::sys::fs::F_None);
-    if (aos.has_error()) {
-      error(Loc(), "cannot write LLVM IR file '%s': %s", llpath.c_str(),
-            errinfo.message().c_str());
-      fatal();
-    }
+    auto aos = outputFiles.open(llpath, "LLVM IR file");
     AssemblyAnnotator annotator(m->getDataLayout());
-    m->print(aos, &annotator);
+    m->print(*aos, &annotator);
   }
 
   const bool writeObj = outputObj && !emitBitcodeAsObjectFile;
@@ -435,23 +446,16 @@ void writeModule(llvm::Module *m, const char *filename) {
     }
 
     Logger::println("Writing asm to: %s\n", spath.c_str());
-    std::error_code errinfo;
     {
-      llvm::raw_fd_ostream out(spath.c_str(), errinfo, llvm::sys::fs::F_None);
-      if (!errinfo)
-      {
-        if (writeObj) {
-          // Clone module if we have both output-o and output-s flags
-          // to avoid running 'addPassesToEmitFile' passes twice on same module
-          cloneAndCodegenModule(*gTargetMachine, *m, out,
-                                llvm::TargetMachine::CGFT_AssemblyFile);
-        } else {
-          codegenModule(*gTargetMachine, *m, out,
-                        llvm::TargetMachine::CGFT_AssemblyFile);
-        }
+      auto out = outputFiles.open(spath, "asm file");
+      if (writeObj) {
+        // Clone module if we have both output-o and output-s flags
+        // to avoid running 'addPassesToEmitFile' passes twice on same module
+        cloneAndCodegenModule(targetMachine, *m, *out,
+                              llvm::TargetMachine::CGFT_AssemblyFile);
       } else {
-        error(Loc(), "cannot write asm: %s", errinfo.message().c_str());
-        fatal();
+        codegenModule(targetMachine, *m, *out,
+                      llvm::TargetMachine::CGFT_AssemblyFile);
       }
     }
 
@@ -465,9 +469,329 @@ void writeModule(llvm::Module *m, const char *filename) {
   }
 
   if (writeObj) {
-    writeObjectFile(m, filename);
-    if (useIR2ObjCache) {
-      cache::cacheObjectFile(filename, moduleHash);
+    IF_LOG Logger::println("Writing object file to: %s", filename);
+    auto out = outputFiles.open(filename, "object file");
+    codegenModule(targetMachine, *m, *out,
+                  llvm::TargetMachine::CGFT_ObjectFile);
+  }
+}
+
+// Returns whether the object file for `m` will be looked up in/added to the
+// IR-to-object cache.
+// With LTO, the object file is the optimized (and for ThinLTO, summary-bearing)
+// bitcode, so a cache hit skips the pre-link optimization and the summary
+// computation.
+bool useIR2ObjCache(llvm::Module *m) {
+  return !opts::cacheDir.empty() && shouldOutputObjectFile();
+}
+
+// Looks up the object file for `m` in the IR-to-object cache and stores the
+// module hash in `moduleHash`. Returns true on a cache hit.
+bool lookupIR2ObjCache(llvm::Module *m, llvm::SmallString<32> &moduleHash) {
+  llvm::SmallString<128> cacheDir(opts::cacheDir.c_str());
+  llvm::sys::fs::make_absolute(cacheDir);
+  opts::cacheDir = cacheDir.c_str();
+
+  IF_LOG Logger::println("Use IR-to-Object cache in %s%s",
+                         opts::cacheDir.c_str(),
+                         shouldDoLTO(m) ? " (for LTO bitcode)" : "");
+  LOG_SCOPE
+
+  cache::calculateModuleHash(m, moduleHash);
+  return !cache::cacheLookup(moduleHash).empty();
+}
+} // end of anonymous namespace
+
+void writeModule(llvm::Module *m, const char *filename) {
+  // Use cached object code if possible.
+  const bool useCache = useIR2ObjCache(m);
+  llvm::SmallString<32> moduleHash;
+  if (useCache && lookupIR2ObjCache(m, moduleHash)) {
+    cache::recoverObjectFile(moduleHash, filename);
+    return;
+  }
+
+  const auto startTime = std::chrono::steady_clock::now();
+
+  // run optimizer
+  ldc_optimize_module(m);
+
+  // make sure the output directory exists
+  createOutputDirectory(filename);
+
+  OutputFiles outputFiles;
+  emitModule(m, filename, *gTargetMachine, outputFiles);
+
+  if (useCache) {
+    cache::stats::addTime(cache::stats::CompileMicroseconds,
+                          std::chrono::steady_clock::now() - startTime);
+    cache::cacheObjectFile(filename, moduleHash);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static llvm::cl::opt<unsigned> codegenPartitions(
+    "codegen-partitions", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Split the optimized -singleobj module into <N> partitions "
+                   "for parallel machine codegen, emitting <N> object files"),
+    llvm::cl::value_desc("N"), llvm::cl::init(1));
+
+// The additional object files emitted for -codegen-partitions.
+static std::vector<std::string> partitionObjectFiles;
+
+void writeSingleObjModule(llvm::Module *m, const char *filename) {
+  // Only plain object file output is partitioned; bitcode, textual IR and asm
+  // output are about the whole module. The IR-to-object cache takes precedence,
+  // as a hit skips optimization and codegen entirely.
+  // The partitions are only passed on to the linker/archiver; with -c, the
+  // requested object file has to contain the whole module.
+  const bool partition =
+      codegenPartitions > 1 && ParallelModuleWriter::isSupported() &&
+      (global.params.link || global.params.lib) &&
+      shouldOutputObjectFile() && !shouldDoLTO(m) && !useIR2ObjCache(m) &&
+      !global.params.output_bc && !global.params.output_ll &&
+      !global.params.output_s;
+  if (!partition) {
+    writeModule(m, filename);
+    return;
+  }
+
+  // Optimize the whole module, then split it for machine codegen only.
+  ldc_optimize_module(m);
+  createOutputDirectory(filename);
+
+  ParallelModuleWriter writer(codegenPartitions);
+  unsigned partitionIndex = 0;
+  const auto emitPartition = [&](std::unique_ptr<llvm::Module> part) {
+    // The first partition is emitted to the regular object file.
+    std::string partFilename = filename;
+    if (partitionIndex > 0) {
+      llvm::SmallString<128> buffer(filename);
+      llvm::sys::path::replace_extension(
+          buffer, llvm::Twine("part") + llvm::Twine(partitionIndex) + "." +
+                      global.obj_ext);
+      partFilename = buffer.str();
+      partitionObjectFiles.push_back(partFilename);
+      global.params.objfiles.push(mem.xstrdup(partFilename.c_str()));
     }
+    ++partitionIndex;
+    writer.submitOptimized(part.get(), partFilename.c_str());
+  };
+
+  // SplitModule() consumes the module, so split a clone. Preserve local
+  // symbols (by keeping them in the same partition as their users), so that
+  // no internal symbols are exported from the object files.
+  llvm::SplitModule(llvm::CloneModule(
+#if LDC_LLVM_VER >= 700
+                        *m
+#else
+                        m
+#endif
+                        ),
+                    codegenPartitions, emitPartition,
+                    /*PreserveLocals=*/true);
+
+  writer.finish();
+}
+
+void deleteCodegenPartitionFiles() {
+  for (const auto &file : partitionObjectFiles) {
+    llvm::sys::fs::remove(file);
   }
 }
+
+////////////////////////////////////////////////////////////////////////////////
+
+static llvm::cl::opt<unsigned> codegenThreads(
+    "codegen-threads", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Optimize and emit separately compiled modules in parallel, "
+                   "using <N> threads (0: number of hardware threads; "
+                   "default: 1)"),
+    llvm::cl::value_desc("N"), llvm::cl::init(1));
+static llvm::cl::alias codegenThreadsShort("j",
+                                           llvm::cl::desc("Alias for "
+                                                          "-codegen-threads"),
+                                           llvm::cl::aliasopt(codegenThreads));
+
+struct ParallelModuleWriter::Job {
+  std::string filename;
+  // The bitcode of the unoptimized module, freed by the worker once parsed.
+  llvm::SmallVector<char, 0> bitcode;
+  std::unique_ptr<llvm::TargetMachine> targetMachine;
+  // False for partitions of an already optimized module.
+  bool optimize = true;
+  bool useCache = false;
+  bool cacheHit = false;
+  llvm::SmallString<32> moduleHash;
+
+  // Results, set by the worker.
+  MemoryOutputFiles outputFiles;
+  std::string errorMessage;
+  std::chrono::steady_clock::duration compileTime{};
+  std::shared_future<void> done;
+
+  void run();
+};
+
+// Runs on a worker thread. Must not touch any front-end state and must not
+// report errors directly; all results are reported by flushFrontJob() on the
+// main thread.
+void ParallelModuleWriter::Job::run() {
+  const auto startTime = std::chrono::steady_clock::now();
+
+  // Each job gets its own LLVMContext, so that jobs don't share any state.
+  llvm::LLVMContext context;
+  if (!global.params.output_ll) {
+    context.setDiscardValueNames(true);
+  }
+
+  llvm::MemoryBufferRef buffer(
+      llvm::StringRef(bitcode.data(), bitcode.size()), filename);
+  auto moduleOrErr = llvm::parseBitcodeFile(buffer, context);
+  if (!moduleOrErr) {
+#if LDC_LLVM_VER >= 400
+    errorMessage = llvm::toString(moduleOrErr.takeError());
+#else
+    errorMessage = moduleOrErr.getError().message();
+#endif
+    return;
+  }
+  std::unique_ptr<llvm::Module> m = std::move(*moduleOrErr);
+  llvm::SmallVector<char, 0>().swap(bitcode);
+
+  if (optimize) {
+    ldc_optimize_module(m.get(), *targetMachine, errorMessage);
+    if (!errorMessage.empty())
+      return;
+  }
+
+  emitModule(m.get(), filename.c_str(), *targetMachine, outputFiles);
+  compileTime = std::chrono::steady_clock::now() - startTime;
+}
+
+bool ParallelModuleWriter::isSupported() {
+  // Fall back to serial emission if the per-module output can't be buffered
+  // in memory or if the output depends on main-thread state.
+  return !Logger::enabled() && !shouldAssembleExternally()
+#if LDC_LLVM_VER >= 400
+         && opts::saveOptimizationRecord.getNumOccurrences() == 0
+#endif
+      ;
+}
+
+unsigned ParallelModuleWriter::numThreads() {
+  if (!isSupported())
+    return 1;
+
+  if (codegenThreads == 0)
+    return std::max(1u, std::thread::hardware_concurrency());
+  return codegenThreads;
+}
+
+ParallelModuleWriter::ParallelModuleWriter(unsigned numThreads)
+    : maxPendingJobs(2 * numThreads), pool(numThreads) {}
+
+ParallelModuleWriter::~ParallelModuleWriter() { finish(); }
+
+void ParallelModuleWriter::submit(llvm::Module *m, const char *filename) {
+  // The -vv log output of a module is only sensible if it isn't interleaved
+  // with other modules' output; emit it on this thread once all pending jobs
+  // are done.
+  if (Logger::enabled()) {
+    finish();
+    writeModule(m, filename);
+    return;
+  }
+
+  auto job = llvm::make_unique<Job>();
+  job->filename = filename;
+
+  // The cache lookup is done upfront, so that a hit skips the worker entirely.
+  job->useCache = useIR2ObjCache(m);
+  if (job->useCache && lookupIR2ObjCache(m, job->moduleHash)) {
+    job->cacheHit = true;
+    pendingJobs.push_back(std::move(job));
+    flushReadyJobs();
+    return;
+  }
+
+  schedule(std::move(job), m);
+}
+
+void ParallelModuleWriter::submitOptimized(llvm::Module *m,
+                                           const char *filename) {
+  auto job = llvm::make_unique<Job>();
+  job->filename = filename;
+  job->optimize = false;
+  schedule(std::move(job), m);
+}
+
+void ParallelModuleWriter::schedule(std::unique_ptr<Job> job, llvm::Module *m) {
+  // Serialize the module, so that the worker can re-materialize it in its
+  // own LLVMContext. The original module is freed by the caller.
+  // Preserve the use-list order to get the same output as serial emission.
+  llvm::raw_svector_ostream os(job->bitcode);
+#if LDC_LLVM_VER >= 700
+  llvm::WriteBitcodeToFile(*m, os, /*ShouldPreserveUseListOrder=*/true);
+#else
+  llvm::WriteBitcodeToFile(m, os, /*ShouldPreserveUseListOrder=*/true);
+#endif
+  job->targetMachine.reset(cloneTargetMachine(*gTargetMachine));
+
+  Job *jobPtr = job.get();
+  job->done = pool.async([jobPtr] { jobPtr->run(); });
+
+  pendingJobs.push_back(std::move(job));
+  flushReadyJobs();
+}
+
+void ParallelModuleWriter::flushReadyJobs() {
+  // Write out finished jobs (in submission order) and limit the number of
+  // modules kept in memory.
+  while (!pendingJobs.empty()) {
+    Job &front = *pendingJobs.front();
+    const bool isReady =
+        front.cacheHit ||
+        front.done.wait_for(std::chrono::seconds(0)) ==
+            std::future_status::ready;
+    if (!isReady && pendingJobs.size() <= maxPendingJobs)
+      break;
+    flushFrontJob();
+  }
+}
+
+void ParallelModuleWriter::finish() {
+  while (!pendingJobs.empty()) {
+    flushFrontJob();
+  }
+}
+
+void ParallelModuleWriter::flushFrontJob() {
+  std::unique_ptr<Job> job = std::move(pendingJobs.front());
+  pendingJobs.pop_front();
+
+  const char *filename = job->filename.c_str();
+  if (job->cacheHit) {
+    cache::recoverObjectFile(job->moduleHash, filename);
+    return;
+  }
+
+  job->done.wait();
+
+  if (!job->errorMessage.empty()) {
+    error(Loc(), "%s", job->errorMessage.c_str());
+    // Don't exit while the workers are still busy.
+    pool.wait();
+    fatal();
+  }
+
+  createOutputDirectory(filename);
+  job->outputFiles.flush();
+
+  if (job->useCache) {
+    cache::stats::addTime(cache::stats::CompileMicroseconds, job->compileTime);
+    cache::cacheObjectFile(filename, job->moduleHash);
+  }
+}
+
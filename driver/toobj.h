@@ -13,8 +13,64 @@
 
 #pragma once
 
+#include "llvm/Support/ThreadPool.h"
+#include <deque>
+#include <memory>
+
 namespace llvm {
 class Module;
 }
 
 void writeModule(llvm::Module *m, const char *filename);
+
+/// Emits the -singleobj module. With -codegen-partitions=<N>, the optimized
+/// module is split into N partitions, which are emitted in parallel to separate
+/// object files. The additional object files are appended to
+/// global.params.objfiles.
+void writeSingleObjModule(llvm::Module *m, const char *filename);
+
+/// Deletes the additional object files emitted for -codegen-partitions.
+void deleteCodegenPartitionFiles();
+
+/// Optimizes and emits modules on a pool of worker threads (-codegen-threads).
+///
+/// IR generation stays on the main thread. Each submitted module is serialized
+/// to bitcode and re-materialized in a private LLVMContext by a worker, which
+/// then runs the optimizer and codegen with its own TargetMachine and buffers
+/// the output files in memory. Output files are written, cache entries added
+/// and errors reported on the main thread, in submission order, so that the
+/// result is independent of the number of threads.
+class ParallelModuleWriter {
+public:
+  /// Returns false if the output can't be emitted by worker threads, e.g.,
+  /// because of -vv.
+  static bool isSupported();
+
+  /// Returns the number of codegen threads to use; 1 means that modules should
+  /// be emitted serially via writeModule().
+  static unsigned numThreads();
+
+  explicit ParallelModuleWriter(unsigned numThreads);
+  ~ParallelModuleWriter();
+
+  /// Schedules the emission of `m`. The module can be freed afterwards.
+  void submit(llvm::Module *m, const char *filename);
+
+  /// Like submit(), but for an already optimized module (e.g., a partition of
+  /// a split -singleobj module), which is neither optimized again nor cached.
+  void submitOptimized(llvm::Module *m, const char *filename);
+
+  /// Waits for all submitted modules and writes their output files.
+  void finish();
+
+private:
+  struct Job;
+
+  void schedule(std::unique_ptr<Job> job, llvm::Module *m);
+  void flushReadyJobs();
+  void flushFrontJob();
+
+  const size_t maxPendingJobs;
+  llvm::ThreadPool pool;
+  std::deque<std::unique_ptr<Job>> pendingJobs;
+};
@@ -23,6 +23,12 @@
 #include "gen/tollvm.h"
 #include "ir/irfunction.h"
 #include "ir/irmodule.h"
+#include "llvm/Support/CommandLine.h"
+
+static llvm::cl::opt<bool> aaKeyFunctions(
+    "aa-key-functions", llvm::cl::ZeroOrMore, llvm::cl::Hidden,
+    llvm::cl::desc("Pass monomorphic hash/equality functions for integral, "
+                   "pointer and string keys to the AA runtime functions"));
 
 // returns the keytype typeinfo
 static LLConstant *to_keyti(DValue *aa, LLType *targetType) {
@@ -35,6 +41,168 @@ static LLConstant *to_keyti(DValue *aa, LLType *targetType) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// The key functions are emitted as linkonce_odr functions into each module,
+// so that they can be inlined into the runtime functions with LTO. The hash
+// functions must return the same as TypeInfo.getHash() of druntime, as keys
+// are inserted by other runtime functions (e.g., for AA literals) too.
+
+static LLFunction *
+getKeyFunction(const llvm::Twine &name, LLType *returnType, unsigned numParams,
+               llvm::function_ref<LLValue *(llvm::IRBuilder<> &, LLFunction *)>
+                   buildBody) {
+  const std::string mangle = name.str();
+  if (LLFunction *fn = gIR->module.getFunction(mangle)) {
+    return fn;
+  }
+
+  std::vector<LLType *> params(numParams, getVoidPtrType());
+  auto fn = LLFunction::Create(LLFunctionType::get(returnType, params, false),
+                               LLGlobalValue::LinkOnceODRLinkage, mangle,
+                               &gIR->module);
+  setLinkage({LLGlobalValue::LinkOnceODRLinkage, supportsCOMDAT()}, fn);
+  fn->setVisibility(LLGlobalValue::HiddenVisibility);
+  fn->addFnAttr(llvm::Attribute::NoUnwind);
+  fn->addFnAttr(llvm::Attribute::ReadOnly);
+
+  llvm::IRBuilder<> builder(
+      llvm::BasicBlock::Create(gIR->context(), "", fn));
+  builder.CreateRet(buildBody(builder, fn));
+  return fn;
+}
+
+// Integral keys hash to their value (sign-extended for signed types), like
+// the TypeInfos of the basic types.
+static LLFunction *getIntegerKeyHash(unsigned bits, bool isSigned) {
+  return getKeyFunction(
+      llvm::Twine("ldc.aa.hash.") + (isSigned ? "i" : "u") + llvm::Twine(bits),
+      DtoSize_t(), 1, [&](llvm::IRBuilder<> &b, LLFunction *fn) {
+        LLType *intTy = LLType::getIntNTy(gIR->context(), bits);
+        LLValue *key = b.CreateLoad(
+            b.CreateBitCast(&*fn->arg_begin(), intTy->getPointerTo()));
+        return b.CreateIntCast(key, DtoSize_t(), isSigned);
+      });
+}
+
+// TypeInfo_Pointer.getHash(): `addr ^ (addr >> 4)`
+static LLFunction *getPointerKeyHash() {
+  return getKeyFunction(
+      "ldc.aa.hash.ptr", DtoSize_t(), 1,
+      [](llvm::IRBuilder<> &b, LLFunction *fn) {
+        LLValue *addr = b.CreateLoad(
+            b.CreateBitCast(&*fn->arg_begin(), DtoSize_t()->getPointerTo()));
+        return b.CreateXor(addr, b.CreateLShr(addr, 4));
+      });
+}
+
+static LLFunction *getIntegerKeyEquals(unsigned bits) {
+  return getKeyFunction(
+      llvm::Twine("ldc.aa.equals.i") + llvm::Twine(bits),
+      DtoType(Type::tbool), 2, [&](llvm::IRBuilder<> &b, LLFunction *fn) {
+        LLType *intPtrTy =
+            LLType::getIntNTy(gIR->context(), bits)->getPointerTo();
+        auto args = fn->arg_begin();
+        LLValue *lhs = b.CreateLoad(b.CreateBitCast(&*args, intPtrTy));
+        LLValue *rhs = b.CreateLoad(b.CreateBitCast(&*++args, intPtrTy));
+        return b.CreateZExt(b.CreateICmpEQ(lhs, rhs), DtoType(Type::tbool));
+      });
+}
+
+// Equal lengths and memcmp() of the elements.
+static LLFunction *getStringKeyEquals(unsigned elementSize) {
+  return getKeyFunction(
+      llvm::Twine("ldc.aa.equals.a") + llvm::Twine(elementSize),
+      DtoType(Type::tbool), 2, [&](llvm::IRBuilder<> &b, LLFunction *fn) {
+        LLType *voidPtrTy = getVoidPtrType();
+        LLType *sliceTy =
+            LLStructType::get(gIR->context(), {DtoSize_t(), voidPtrTy});
+        auto args = fn->arg_begin();
+        LLValue *lhs = b.CreateLoad(
+            b.CreateBitCast(&*args, sliceTy->getPointerTo()));
+        LLValue *rhs = b.CreateLoad(
+            b.CreateBitCast(&*++args, sliceTy->getPointerTo()));
+        LLValue *length = b.CreateExtractValue(lhs, 0);
+
+        llvm::BasicBlock *entrybb = b.GetInsertBlock();
+        llvm::BasicBlock *cmpbb =
+            llvm::BasicBlock::Create(gIR->context(), "cmp", fn);
+        llvm::BasicBlock *endbb =
+            llvm::BasicBlock::Create(gIR->context(), "end", fn);
+        b.CreateCondBr(
+            b.CreateICmpEQ(length, b.CreateExtractValue(rhs, 0)), cmpbb,
+            endbb);
+
+        b.SetInsertPoint(cmpbb);
+        LLFunction *memcmp = gIR->module.getFunction("memcmp");
+        if (!memcmp) {
+          LLType *params[] = {voidPtrTy, voidPtrTy, DtoSize_t()};
+          memcmp = LLFunction::Create(
+              LLFunctionType::get(LLType::getInt32Ty(gIR->context()), params,
+                                  false),
+              LLGlobalValue::ExternalLinkage, "memcmp", &gIR->module);
+        }
+        LLValue *size =
+            b.CreateMul(length, DtoConstSize_t(elementSize), "", true, true);
+        LLValue *cmp = b.CreateCall(memcmp, {b.CreateExtractValue(lhs, 1),
+                                             b.CreateExtractValue(rhs, 1),
+                                             size});
+        LLValue *same = b.CreateICmpEQ(cmp, b.getInt32(0));
+        b.CreateBr(endbb);
+
+        b.SetInsertPoint(endbb);
+        llvm::PHINode *result = b.CreatePHI(same->getType(), 2);
+        result->addIncoming(b.getFalse(), entrybb);
+        result->addIncoming(same, cmpbb);
+        return b.CreateZExt(result, DtoType(Type::tbool));
+      });
+}
+
+// Returns true if the runtime functions taking key functions are used for the
+// AA, with `hash` null for keys hashed by their TypeInfo.
+static bool getKeyFunctions(DValue *aa, LLValue *&hash, LLValue *&equals) {
+  if (!aaKeyFunctions) {
+    return false;
+  }
+
+  assert(aa->type->toBasetype()->ty == Taarray);
+  TypeAArray *aatype = static_cast<TypeAArray *>(aa->type->toBasetype());
+  Type *keyType = aatype->index->toBasetype();
+  const unsigned sizeTBits = DtoSize_t()->getBitWidth();
+
+  LLFunction *hashFn = nullptr;
+  LLFunction *equalsFn = nullptr;
+  if (keyType->ty == Tpointer) {
+    hashFn = getPointerKeyHash();
+    equalsFn = getIntegerKeyEquals(sizeTBits);
+  } else if (keyType->isintegral() && keyType->ty != Tvector) {
+    // TypeInfo_l/m fold 64-bit keys on 32-bit targets
+    const unsigned bits = keyType->size() * 8;
+    if (bits > sizeTBits) {
+      return false;
+    }
+    hashFn = getIntegerKeyHash(bits, !keyType->isunsigned());
+    equalsFn = getIntegerKeyEquals(bits);
+  } else if (keyType->ty == Tarray) {
+    // The string hash is druntime's business, only the comparison is
+    // specialized.
+    Type *elementType = keyType->nextOf()->toBasetype();
+    if (elementType->ty != Tchar && elementType->ty != Twchar &&
+        elementType->ty != Tdchar) {
+      return false;
+    }
+    equalsFn = getStringKeyEquals(elementType->size());
+  } else {
+    return false;
+  }
+
+  LLType *voidPtrTy = getVoidPtrType();
+  hash = hashFn ? DtoBitCast(hashFn, voidPtrTy)
+                : LLConstant::getNullValue(voidPtrTy);
+  equals = DtoBitCast(equalsFn, voidPtrTy);
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 DLValue *DtoAAIndex(Loc &loc, Type *type, DValue *aa, DValue *key,
                     bool lvalue) {
   // D2:
@@ -43,10 +211,16 @@ DLValue *DtoAAIndex(Loc &loc, Type *type, DValue *aa, DValue *key,
   // pkey)
   // or
   // extern(C) void* _aaInX(AA aa*, TypeInfo keyti, void* pkey)
+  // or the _aaGetYF/_aaInXF variants with additional key functions
+
+  LLValue *keyHash = nullptr;
+  LLValue *keyEquals = nullptr;
+  const bool withKeyFunctions = getKeyFunctions(aa, keyHash, keyEquals);
 
   // first get the runtime function
-  llvm::Function *func =
-      getRuntimeFunction(loc, gIR->module, lvalue ? "_aaGetY" : "_aaInX");
+  const char *funcName = lvalue ? (withKeyFunctions ? "_aaGetYF" : "_aaGetY")
+                                : (withKeyFunctions ? "_aaInXF" : "_aaInX");
+  llvm::Function *func = getRuntimeFunction(loc, gIR->module, funcName);
   LLFunctionType *funcTy = func->getFunctionType();
 
   // aa param
@@ -58,20 +232,23 @@ DLValue *DtoAAIndex(Loc &loc, Type *type, DValue *aa, DValue *key,
   pkey = DtoBitCast(pkey, funcTy->getParamType(lvalue ? 3 : 2));
 
   // call runtime
-  LLValue *ret;
+  std::vector<LLValue *> args;
   if (lvalue) {
     LLValue *rawAATI =
         DtoTypeInfoOf(aa->type->unSharedOf()->mutableOf(), /*base=*/false);
     LLValue *castedAATI = DtoBitCast(rawAATI, funcTy->getParamType(1));
     LLValue *valsize = DtoConstSize_t(getTypeAllocSize(DtoType(type)));
-    ret = gIR->CreateCallOrInvoke(func, aaval, castedAATI, valsize, pkey,
-                                  "aa.index")
-              .getInstruction();
+    args = {aaval, castedAATI, valsize, pkey};
   } else {
     LLValue *keyti = to_keyti(aa, funcTy->getParamType(1));
-    ret = gIR->CreateCallOrInvoke(func, aaval, keyti, pkey, "aa.index")
-              .getInstruction();
+    args = {aaval, keyti, pkey};
   }
+  if (withKeyFunctions) {
+    args.push_back(keyHash);
+    args.push_back(keyEquals);
+  }
+  LLValue *ret =
+      gIR->CreateCallOrInvoke(func, args, "aa.index").getInstruction();
 
   // cast return value
   LLType *targettype = DtoPtrToType(type);
@@ -111,9 +288,15 @@ DValue *DtoAAIn(Loc &loc, Type *type, DValue *aa, DValue *key) {
   // D2:
   // call:
   // extern(C) void* _aaInX(AA aa*, TypeInfo keyti, void* pkey)
+  // or _aaInXF with additional key functions
+
+  LLValue *keyHash = nullptr;
+  LLValue *keyEquals = nullptr;
+  const bool withKeyFunctions = getKeyFunctions(aa, keyHash, keyEquals);
 
   // first get the runtime function
-  llvm::Function *func = getRuntimeFunction(loc, gIR->module, "_aaInX");
+  llvm::Function *func = getRuntimeFunction(
+      loc, gIR->module, withKeyFunctions ? "_aaInXF" : "_aaInX");
   LLFunctionType *funcTy = func->getFunctionType();
 
   IF_LOG Logger::cout() << "_aaIn = " << *func << '\n';
@@ -134,8 +317,12 @@ DValue *DtoAAIn(Loc &loc, Type *type, DValue *aa, DValue *key) {
   pkey = DtoBitCast(pkey, getVoidPtrType());
 
   // call runtime
-  LLValue *ret = gIR->CreateCallOrInvoke(func, aaval, keyti, pkey, "aa.in")
-                     .getInstruction();
+  std::vector<LLValue *> args = {aaval, keyti, pkey};
+  if (withKeyFunctions) {
+    args.push_back(keyHash);
+    args.push_back(keyEquals);
+  }
+  LLValue *ret = gIR->CreateCallOrInvoke(func, args, "aa.in").getInstruction();
 
   // cast return value
   LLType *targettype = DtoType(type);
@@ -156,9 +343,15 @@ DValue *DtoAARemove(Loc &loc, DValue *aa, DValue *key) {
   // D2:
   // call:
   // extern(C) bool _aaDelX(AA aa, TypeInfo keyti, void* pkey)
+  // or _aaDelXF with additional key functions
+
+  LLValue *keyHash = nullptr;
+  LLValue *keyEquals = nullptr;
+  const bool withKeyFunctions = getKeyFunctions(aa, keyHash, keyEquals);
 
   // first get the runtime function
-  llvm::Function *func = getRuntimeFunction(loc, gIR->module, "_aaDelX");
+  llvm::Function *func = getRuntimeFunction(
+      loc, gIR->module, withKeyFunctions ? "_aaDelXF" : "_aaDelX");
   LLFunctionType *funcTy = func->getFunctionType();
 
   IF_LOG Logger::cout() << "_aaDel = " << *func << '\n';
@@ -179,7 +372,12 @@ DValue *DtoAARemove(Loc &loc, DValue *aa, DValue *key) {
   pkey = DtoBitCast(pkey, funcTy->getParamType(2));
 
   // call runtime
-  LLCallSite call = gIR->CreateCallOrInvoke(func, aaval, keyti, pkey);
+  std::vector<LLValue *> args = {aaval, keyti, pkey};
+  if (withKeyFunctions) {
+    args.push_back(keyHash);
+    args.push_back(keyEquals);
+  }
+  LLCallSite call = gIR->CreateCallOrInvoke(func, args);
 
   return new DImValue(Type::tbool, call.getInstruction());
 }
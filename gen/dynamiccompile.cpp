@@ -840,10 +840,11 @@ void defineDynamicCompiledFunction(IRState *irs, IrFunction *func) {
     auto it = irs->dynamicCompiledFunctions.find(srcFunc);
     assert(irs->dynamicCompiledFunctions.end() != it);
     auto thunkVarType = srcFunc->getFunctionType()->getPointerTo();
+    // The thunk calls the statically compiled function until the jitted code
+    // is available (e.g., during an asynchronous compilation).
     auto thunkVar = new llvm::GlobalVariable(
         irs->module, thunkVarType, false, llvm::GlobalValue::PrivateLinkage,
-        llvm::ConstantPointerNull::get(thunkVarType),
-        ".rtcompile_thunkvar_" + srcFunc->getName());
+        srcFunc, ".rtcompile_thunkvar_" + srcFunc->getName());
     auto dstFunc = it->second.thunkFunc;
     createThunkFunc(irs->module, srcFunc, dstFunc, thunkVar);
     it->second.thunkVar = thunkVar;
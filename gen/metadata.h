@@ -29,6 +29,9 @@ enum TypeDataFields {
 
   TD_Type, /// A value of the LLVM type corresponding to this D type
 
+  TD_Finalize, /// True if the GC finalizes values of this type (for dynamic
+               /// arrays: the elements).
+
   // Must be kept last:
   TD_NumFields /// The number of fields in TypeInfo metadata
 };
@@ -81,6 +81,10 @@ static cl::opt<bool> disableGCToStack(
     "disable-gc2stack", cl::ZeroOrMore,
     cl::desc("Disable promotion of GC allocations to stack memory"));
 
+static cl::opt<bool> disableGCHoisting(
+    "disable-gc-hoisting", cl::ZeroOrMore,
+    cl::desc("Disable hoisting and reuse of GC allocations of loops"));
+
 static cl::opt<cl::boolOrDefault, false, opts::FlagParser<cl::boolOrDefault>>
     enableInlining(
         "inlining", cl::ZeroOrMore,
@@ -184,6 +188,20 @@ static void addGarbageCollect2StackPass(const PassManagerBuilder &builder,
   }
 }
 
+static void addHoistGCAllocationsPass(const PassManagerBuilder &builder,
+                                     PassManagerBase &pm) {
+  if (builder.OptLevel >= 2 && builder.SizeLevel == 0) {
+    addPass(pm, createHoistGCAllocations());
+  }
+}
+
+static void addInferNoCapturePass(const PassManagerBuilder &builder,
+                                  PassManagerBase &pm) {
+  if (builder.OptLevel >= 2 && builder.SizeLevel == 0) {
+    addPass(pm, createInferNoCapture());
+  }
+}
+
 static void addAddressSanitizerPasses(const PassManagerBuilder &Builder,
                                       PassManagerBase &PM) {
   PM.add(createAddressSanitizerFunctionPass());
@@ -344,9 +362,19 @@ static void addOptimizationPasses(legacy::PassManagerBase &mpm,
     }
 
     if (!disableGCToStack) {
+      // Runs bottom-up on each SCC of the call graph before its functions are
+      // simplified, so that the callees' parameters are known by then.
+      builder.addExtension(PassManagerBuilder::EP_CGSCCOptimizerLate,
+                           addInferNoCapturePass);
       builder.addExtension(PassManagerBuilder::EP_LoopOptimizerEnd,
                            addGarbageCollect2StackPass);
     }
+
+    if (!disableGCHoisting) {
+      // After GarbageCollect2Stack, which handles the small allocations.
+      builder.addExtension(PassManagerBuilder::EP_LoopOptimizerEnd,
+                           addHoistGCAllocationsPass);
+    }
   }
 
   // EP_OptimizerLast does not exist in LLVM 3.0, add it manually below.
@@ -360,9 +388,11 @@ static void addOptimizationPasses(legacy::PassManagerBase &mpm,
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// This function runs optimization passes based on command line arguments.
+// Runs the optimization passes based on command line arguments, using the
+// given target machine for the target-specific analyses.
 // Returns true if any optimization passes were invoked.
-bool ldc_optimize_module(llvm::Module *M) {
+static bool runOptimizationPasses(llvm::Module *M,
+                                  llvm::TargetMachine &targetMachine) {
   // Create a PassManager to hold and optimize the collection of
   // per-module passes we are about to build.
   legacy::PassManager mpm;
@@ -394,14 +424,14 @@ bool ldc_optimize_module(llvm::Module *M) {
 
   // Add internal analysis passes from the target machine.
   mpm.add(createTargetTransformInfoWrapperPass(
-      gTargetMachine->getTargetIRAnalysis()));
+      targetMachine.getTargetIRAnalysis()));
 
   // Also set up a manager for the per-function passes.
   legacy::FunctionPassManager fpm(M);
 
   // Add internal analysis passes from the target machine.
   fpm.add(createTargetTransformInfoWrapperPass(
-      gTargetMachine->getTargetIRAnalysis()));
+      targetMachine.getTargetIRAnalysis()));
 
   // If the -strip-debug command line option was specified, add it before
   // anything else.
@@ -421,6 +451,15 @@ bool ldc_optimize_module(llvm::Module *M) {
   // Run per-module passes.
   mpm.run(*M);
 
+  return true;
+}
+
+// This function runs optimization passes based on command line arguments.
+// Returns true if any optimization passes were invoked.
+bool ldc_optimize_module(llvm::Module *M) {
+  if (!runOptimizationPasses(M, *gTargetMachine))
+    return false;
+
   // Verify the resulting module.
   if (!noVerify) {
     verifyModule(M);
@@ -430,6 +469,22 @@ bool ldc_optimize_module(llvm::Module *M) {
   return true;
 }
 
+bool ldc_optimize_module(llvm::Module *M, llvm::TargetMachine &targetMachine,
+                         std::string &verifyErrors) {
+  if (!runOptimizationPasses(M, targetMachine))
+    return false;
+
+  // Verify the resulting module, without reporting any errors (which isn't
+  // thread-safe).
+  if (!noVerify) {
+    raw_string_ostream OS(verifyErrors);
+    llvm::verifyModule(*M, &OS);
+    OS.flush();
+  }
+
+  return true;
+}
+
 // Verifies the module.
 void verifyModule(llvm::Module *m) {
   Logger::println("Verifying module...");
@@ -453,6 +508,7 @@ void outputOptimizationSettings(llvm::raw_ostream &hash_os) {
   hash_os << disableSimplifyDruntimeCalls;
   hash_os << disableSimplifyLibCalls;
   hash_os << disableGCToStack;
+  hash_os << disableGCHoisting;
   hash_os << unitAtATime;
   hash_os << stripDebug;
   hash_os << disableLoopUnrolling;
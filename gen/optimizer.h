@@ -18,6 +18,7 @@
 #include "llvm/Support/CodeGen.h"
 
 #include "llvm/Support/CommandLine.h"
+#include <string>
 
 namespace llvm {
 class raw_ostream;
@@ -25,10 +26,17 @@ class raw_ostream;
 
 namespace llvm {
 class Module;
+class TargetMachine;
 }
 
 bool ldc_optimize_module(llvm::Module *m);
 
+// Variant usable from codegen worker threads: uses the given (thread-private)
+// target machine instead of gTargetMachine and returns verification errors of
+// the optimized module in `verifyErrors` instead of reporting them.
+bool ldc_optimize_module(llvm::Module *m, llvm::TargetMachine &targetMachine,
+                         std::string &verifyErrors);
+
 // Returns whether the normal, full inlining pass will be run.
 bool willInline();
 
@@ -10,6 +10,21 @@
 // This file attempts to turn allocations on the garbage-collected heap into
 // stack allocations.
 //
+// With -dgc2stack-region, non-escaping allocations which are too large for
+// the stack are moved to the per-thread region allocator of druntime (see
+// ldc.region) instead:
+//
+//   void* _d_region_mark();            // returns the current region top
+//   void* _d_region_alloc(size_t size); // bump-allocates GC-scanned memory
+//   void _d_region_release(void* mark); // resets the region top to mark
+//
+// The mark is taken on function entry and released before each return and
+// each resume of an unwinding landing pad. Calls which may throw are turned
+// into invokes of a cleanup landing pad releasing the mark, so that it is
+// released when unwinding through the function too. As the memory is only
+// reclaimed when the function exits, allocations in loops (or any other cycle
+// of the CFG) are left to the GC (and to HoistGCAllocations).
+//
 //===----------------------------------------------------------------------===//
 
 #define DEBUG_TYPE "dgc2stack"
@@ -17,21 +32,25 @@
 #define LLVM_DEBUG DEBUG
 #endif
 
-#include "gen/attributes.h"
 #include "gen/metadata.h"
 #include "gen/passes/Passes.h"
-#include "gen/runtime.h"
 #include "llvm/Pass.h"
 #include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/EHPersonalities.h"
 #include "llvm/Analysis/ValueTracking.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallSet.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
@@ -41,7 +60,13 @@
 #include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 #include <algorithm>
+#include <cstring>
 
+#if LDC_LLVM_VER >= 600
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#elif LDC_LLVM_VER >= 500
+#include "llvm/Analysis/OptimizationDiagnosticInfo.h"
+#endif
 #if LDC_LLVM_VER >= 500
 #include "llvm/Support/KnownBits.h"
 #endif
@@ -51,8 +76,13 @@ using namespace llvm;
 STATISTIC(NumGcToStack, "Number of calls promoted to constant-size allocas");
 STATISTIC(NumToDynSize,
           "Number of calls promoted to dynamically-sized allocas");
+STATISTIC(NumToRegion, "Number of calls promoted to region allocations");
 STATISTIC(NumDeleted,
           "Number of GC calls deleted because the return value was unused");
+STATISTIC(NumUnsupported,
+          "Number of GC calls not promoted because of their type or size");
+STATISTIC(NumEscaping,
+          "Number of GC calls not promoted because the memory may escape");
 
 static cl::opt<unsigned>
     SizeLimit("dgc2stack-size-limit", cl::ZeroOrMore, cl::Hidden,
@@ -60,6 +90,11 @@ static cl::opt<unsigned>
               cl::desc("Require allocs to be smaller than n bytes to be "
                        "promoted, 0 to ignore."));
 
+static cl::opt<bool> RegionAlloc(
+    "dgc2stack-region", cl::ZeroOrMore, cl::Hidden,
+    cl::desc("Promote non-escaping GC allocations which can't be put on the "
+             "stack to the druntime region allocator."));
+
 namespace {
 struct Analysis {
   const DataLayout &DL;
@@ -69,6 +104,72 @@ struct Analysis {
 
   llvm::Type *getTypeFor(Value *typeinfo) const;
 };
+
+/// Reports the (missed) promotions of a function as optimization remarks,
+/// e.g. for -pass-remarks=dgc2stack.
+class Remarks {
+  Function &F;
+#if LDC_LLVM_VER >= 500
+  OptimizationRemarkEmitter ORE;
+#endif
+  unsigned NumCalls = 0;
+  unsigned NumPromoted = 0;
+
+public:
+  explicit Remarks(Function &F)
+      : F(F)
+#if LDC_LLVM_VER >= 500
+        ,
+        ORE(&F)
+#endif
+  {
+  }
+
+  void promoted(Instruction *Call, StringRef Callee, StringRef Target) {
+    ++NumCalls;
+    ++NumPromoted;
+#if LDC_LLVM_VER >= 500
+    ORE.emit(OptimizationRemark(DEBUG_TYPE, "Promoted", Call)
+             << "promoted " << Callee << " to " << Target);
+#else
+    emitOptimizationRemark(F.getContext(), DEBUG_TYPE, F, Call->getDebugLoc(),
+                           "promoted " + Callee + " to " + Target);
+#endif
+  }
+
+  void missed(Instruction *Call, StringRef Callee, StringRef Reason) {
+    ++NumCalls;
+#if LDC_LLVM_VER >= 500
+    ORE.emit(OptimizationRemarkMissed(DEBUG_TYPE, "NotPromoted", Call)
+             << Callee << " not promoted to the stack: " << Reason);
+#else
+    emitOptimizationRemarkMissed(F.getContext(), DEBUG_TYPE, F,
+                                 Call->getDebugLoc(),
+                                 Callee + " not promoted to the stack: " +
+                                     Reason);
+#endif
+  }
+
+  /// Reports the number of promoted allocations of the function.
+  void summarize() {
+    if (NumCalls == 0) {
+      return;
+    }
+    LLVM_DEBUG(errs() << "dgc2stack: promoted " << NumPromoted << " of "
+                      << NumCalls << " GC allocations in " << F.getName()
+                      << '\n');
+#if LDC_LLVM_VER >= 500
+    ORE.emit(OptimizationRemarkAnalysis(DEBUG_TYPE, "Summary", DebugLoc(),
+                                        &F.getEntryBlock())
+             << "promoted " << Twine(NumPromoted).str() << " of "
+             << Twine(NumCalls).str() << " GC allocations");
+#else
+    emitOptimizationRemarkAnalysis(F.getContext(), DEBUG_TYPE, F, DebugLoc(),
+                                   "promoted " + Twine(NumPromoted) + " of " +
+                                       Twine(NumCalls) + " GC allocations");
+#endif
+  }
+};
 }
 
 //===----------------------------------------------------------------------===//
@@ -92,6 +193,50 @@ static void EmitMemZero(IRBuilder<> &B, Value *Dst, Value *Len,
   EmitMemSet(B, Dst, ConstantInt::get(B.getInt8Ty(), 0), Len, A);
 }
 
+static Function *getRegionFunction(Module &M, const char *Name,
+                                   llvm::Type *RetTy,
+                                   ArrayRef<llvm::Type *> Params) {
+  Function *Fn = M.getFunction(Name);
+  if (!Fn) {
+    Fn = Function::Create(FunctionType::get(RetTy, Params, false),
+                          GlobalValue::ExternalLinkage, Name, &M);
+  }
+  // Only _d_region_alloc may throw (an OutOfMemoryError).
+  if (strcmp(Name, "_d_region_alloc") != 0) {
+    Fn->setDoesNotThrow();
+  }
+  return Fn;
+}
+
+static CallInst *EmitRegionCall(IRBuilder<> &B, const char *Name,
+                                llvm::Type *RetTy, ArrayRef<Value *> Args,
+                                const Analysis &A) {
+  SmallVector<llvm::Type *, 1> Params;
+  for (Value *Arg : Args) {
+    Params.push_back(Arg->getType());
+  }
+  Function *Fn = getRegionFunction(*B.GetInsertBlock()->getModule(), Name,
+                                   RetTy, Params);
+  CallInst *Call = B.CreateCall(Fn, Args);
+  if (A.CGNode) {
+    A.CGNode->addCalledFunction(Call, A.CG->getOrInsertFunction(Fn));
+  }
+  return Call;
+}
+
+/// Allocates Size bytes from the region allocator, returns an i8*.
+static Value *EmitRegionAlloc(IRBuilder<> &B, Value *Size, const Analysis &A) {
+  Size = B.CreateZExtOrTrunc(Size, A.DL.getIntPtrType(B.getContext()));
+  CallInst *Mem = EmitRegionCall(B, "_d_region_alloc", B.getInt8PtrTy(),
+                                 {Size}, A);
+#if LDC_LLVM_VER >= 500
+  Mem->addAttribute(AttributeList::ReturnIndex, Attribute::NoAlias);
+#else
+  Mem->addAttribute(AttributeSet::ReturnIndex, Attribute::NoAlias);
+#endif
+  return Mem;
+}
+
 //===----------------------------------------------------------------------===//
 // Helpers for specific types of GC calls.
 //===----------------------------------------------------------------------===//
@@ -112,8 +257,9 @@ public:
   ReturnType::Type ReturnType;
 
   // Analyze the current call, filling in some fields. Returns true if
-  // this is an allocation we can stack-allocate.
-  virtual bool analyze(CallSite CS, const Analysis &A) = 0;
+  // this is an allocation we can stack-allocate, or region-allocate if
+  // ToRegion is set (which ignores the size limit).
+  virtual bool analyze(CallSite CS, const Analysis &A, bool ToRegion) = 0;
 
   // Returns the alloca to replace this call.
   // It will always be inserted before the call.
@@ -131,6 +277,16 @@ public:
                           ".nongc_mem", Begin);
   }
 
+  // Returns the region allocation to replace this call.
+  // It will always be inserted before the call, so that each execution of
+  // the call gets its own memory.
+  virtual Value *promoteToRegion(CallSite CS, IRBuilder<> &B,
+                                 const Analysis &A) {
+    NumToRegion++;
+
+    return EmitRegionAlloc(B, B.getInt64(A.DL.getTypeAllocSize(Ty)), A);
+  }
+
   explicit FunctionInfo(ReturnType::Type returnType) : ReturnType(returnType) {}
   virtual ~FunctionInfo() = default;
 };
@@ -175,13 +331,13 @@ public:
   TypeInfoFI(ReturnType::Type returnType, unsigned tiArgNr)
       : FunctionInfo(returnType), TypeInfoArgNr(tiArgNr) {}
 
-  bool analyze(CallSite CS, const Analysis &A) override {
+  bool analyze(CallSite CS, const Analysis &A, bool ToRegion) override {
     Value *TypeInfo = CS.getArgument(TypeInfoArgNr);
     Ty = A.getTypeFor(TypeInfo);
     if (!Ty) {
       return false;
     }
-    return A.DL.getTypeAllocSize(Ty) < SizeLimit;
+    return ToRegion || A.DL.getTypeAllocSize(Ty) < SizeLimit;
   }
 };
 
@@ -196,8 +352,8 @@ public:
       : TypeInfoFI(returnType, tiArgNr), ArrSizeArgNr(arrSizeArgNr),
         Initialized(initialized) {}
 
-  bool analyze(CallSite CS, const Analysis &A) override {
-    if (!TypeInfoFI::analyze(CS, A)) {
+  bool analyze(CallSite CS, const Analysis &A, bool ToRegion) override {
+    if (!TypeInfoFI::analyze(CS, A, ToRegion)) {
       return false;
     }
 
@@ -215,7 +371,7 @@ public:
     // miscompilations for humongous arrays, but as the value "range"
     // (set bits) inference algorithm is rather limited, this is
     // useful for experimenting.
-    if (SizeLimit > 0) {
+    if (SizeLimit > 0 && !ToRegion) {
       uint64_t ElemSize = A.DL.getTypeAllocSize(Ty);
       if (!isKnownLessThan(arrSize, SizeLimit / ElemSize, A)) {
         return false;
@@ -268,12 +424,35 @@ public:
 
     return alloca;
   }
+
+  Value *promoteToRegion(CallSite CS, IRBuilder<> &B,
+                         const Analysis &A) override {
+    NumToRegion++;
+
+    Value *TypeSize =
+        ConstantInt::get(arrSize->getType(), A.DL.getTypeAllocSize(Ty));
+    Value *Size = B.CreateMul(TypeSize, arrSize);
+    Value *mem = EmitRegionAlloc(B, Size, A);
+
+    if (Initialized) {
+      EmitMemZero(B, mem, Size, A);
+    }
+
+    if (ReturnType == ReturnType::Array) {
+      Value *arrStruct = llvm::UndefValue::get(CS.getType());
+      arrStruct = B.CreateInsertValue(arrStruct, arrSize, 0);
+      arrStruct = B.CreateInsertValue(arrStruct, mem, 1);
+      return arrStruct;
+    }
+
+    return mem;
+  }
 };
 
 // FunctionInfo for _d_allocclass
 class AllocClassFI : public FunctionInfo {
 public:
-  bool analyze(CallSite CS, const Analysis &A) override {
+  bool analyze(CallSite CS, const Analysis &A, bool ToRegion) override {
     if (CS.arg_size() != 1) {
       return false;
     }
@@ -316,10 +495,10 @@ public:
 
     Ty = mdconst::dyn_extract<Constant>(node->getOperand(CD_BodyType))
              ->getType();
-    return A.DL.getTypeAllocSize(Ty) < SizeLimit;
+    return ToRegion || A.DL.getTypeAllocSize(Ty) < SizeLimit;
   }
 
-  // The default promote() should be fine.
+  // The default promote() and promoteToRegion() should be fine.
 
   AllocClassFI() : FunctionInfo(ReturnType::Pointer) {}
 };
@@ -331,7 +510,7 @@ class UntypedMemoryFI : public FunctionInfo {
   Value *SizeArg;
 
 public:
-  bool analyze(CallSite CS, const Analysis &A) override {
+  bool analyze(CallSite CS, const Analysis &A, bool ToRegion) override {
     if (CS.arg_size() < SizeArgNr + 1) {
       return false;
     }
@@ -343,7 +522,7 @@ public:
     // miscompilations for humongous allocations, but as the value
     // "range" (set bits) inference algorithm is rather limited, this
     // is useful for experimenting.
-    if (SizeLimit > 0) {
+    if (SizeLimit > 0 && !ToRegion) {
       if (!isKnownLessThan(SizeArg, SizeLimit, A)) {
         return false;
       }
@@ -379,6 +558,13 @@ public:
     return Builder.CreateBitCast(alloca, CS.getType());
   }
 
+  Value *promoteToRegion(CallSite CS, IRBuilder<> &B,
+                         const Analysis &A) override {
+    NumToRegion++;
+
+    return EmitRegionAlloc(B, SizeArg, A);
+  }
+
   explicit UntypedMemoryFI(unsigned sizeArgNr)
       : FunctionInfo(ReturnType::Pointer), SizeArgNr(sizeArgNr) {}
 };
@@ -459,10 +645,167 @@ static void RemoveCall(CallSite CS, const Analysis &A) {
 
 static bool
 isSafeToStackAllocateArray(BasicBlock::iterator Alloc, DominatorTree &DT,
-                           SmallVector<CallInst *, 4> &RemoveTailCallInsts);
+                           SmallVector<CallInst *, 4> &RemoveTailCallInsts,
+                           bool ToRegion);
 static bool
 isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V, DominatorTree &DT,
-                      SmallVector<CallInst *, 4> &RemoveTailCallInsts);
+                      SmallVector<CallInst *, 4> &RemoveTailCallInsts,
+                      bool ToRegion);
+
+/// Returns whether Call may unwind into its caller.
+static bool mayUnwind(const CallInst *Call) {
+  return !Call->doesNotThrow() && !Call->isInlineAsm() &&
+         !isa<IntrinsicInst>(Call);
+}
+
+/// Returns whether unwinding through F can be intercepted by a cleanup
+/// landing pad, i.e. whether F has (or can get) a personality function which
+/// doesn't use funclets.
+static bool canAddLandingPad(Function &F) {
+  if (F.hasPersonalityFn()) {
+    return !isFuncletEHPersonality(classifyEHPersonality(F.getPersonalityFn()));
+  }
+  return !Triple(F.getParent()->getTargetTriple()).isWindowsMSVCEnvironment();
+}
+
+/// Returns whether the region can be released on all exits of F, including
+/// unwinding.
+static bool canReleaseRegion(Function &F) {
+  bool MayUnwind = false;
+  for (auto &BB : F) {
+    for (auto &I : BB) {
+      // Nothing may be inserted between a musttail call and the return, and
+      // calls in funclets need a funclet bundle.
+      if (isa<FuncletPadInst>(I)) {
+        return false;
+      }
+      if (auto CI = dyn_cast<CallInst>(&I)) {
+        if (CI->isMustTailCall()) {
+          return false;
+        }
+        MayUnwind |= mayUnwind(CI);
+      }
+    }
+  }
+  // GC allocations may throw, so promoted ones become region allocations
+  // which may throw too.
+  return !MayUnwind || canAddLandingPad(F);
+}
+
+/// Returns whether BB may be executed again after itself, i.e. whether it is
+/// part of a cycle.
+static bool isInCycle(BasicBlock *BB) {
+  SmallVector<BasicBlock *, 16> Worklist(succ_begin(BB), succ_end(BB));
+  SmallPtrSet<BasicBlock *, 16> Visited;
+  while (!Worklist.empty()) {
+    BasicBlock *Current = Worklist.pop_back_val();
+    if (Current == BB) {
+      return true;
+    }
+    if (Visited.insert(Current).second) {
+      Worklist.append(succ_begin(Current), succ_end(Current));
+    }
+  }
+  return false;
+}
+
+/// Creates a cleanup landing pad in F which releases Mark and resumes
+/// unwinding.
+static BasicBlock *createReleasingCleanup(Function &F, Value *Mark,
+                                          const Analysis &A) {
+  LLVMContext &Ctx = F.getContext();
+  if (!F.hasPersonalityFn()) {
+    Module &M = *F.getParent();
+    Function *Personality = M.getFunction("_d_eh_personality");
+    if (!Personality) {
+      Personality = Function::Create(
+          FunctionType::get(Type::getInt32Ty(Ctx), true),
+          GlobalValue::ExternalLinkage, "_d_eh_personality", &M);
+    }
+    F.setPersonalityFn(Personality);
+  }
+
+  // Use the type of the existing landing pads, if any.
+  llvm::Type *LPadTy =
+      StructType::get(Ctx, {Type::getInt8PtrTy(Ctx), Type::getInt32Ty(Ctx)});
+  for (auto &BB : F) {
+    if (LandingPadInst *LPad = BB.getLandingPadInst()) {
+      LPadTy = LPad->getType();
+      break;
+    }
+  }
+
+  BasicBlock *Cleanup = BasicBlock::Create(Ctx, "region.cleanup", &F);
+  IRBuilder<> Builder(Cleanup);
+  LandingPadInst *LPad = Builder.CreateLandingPad(LPadTy, 0);
+  LPad->setCleanup(true);
+  EmitRegionCall(Builder, "_d_region_release", Builder.getVoidTy(), {Mark}, A);
+  Builder.CreateResume(LPad);
+  return Cleanup;
+}
+
+/// Replaces Call by an invoke unwinding to UnwindBB.
+static void changeToInvoke(CallInst *Call, BasicBlock *UnwindBB,
+                           const Analysis &A) {
+  BasicBlock *BB = Call->getParent();
+  BasicBlock *Normal =
+      BB->splitBasicBlock(Call->getIterator(), BB->getName() + ".cont");
+  BB->getTerminator()->eraseFromParent();
+
+  SmallVector<Value *, 8> Args(Call->arg_begin(), Call->arg_end());
+  SmallVector<OperandBundleDef, 1> Bundles;
+  Call->getOperandBundlesAsDefs(Bundles);
+  InvokeInst *Invoke = InvokeInst::Create(Call->getCalledValue(), Normal,
+                                          UnwindBB, Args, Bundles, "", BB);
+  Invoke->takeName(Call);
+  Invoke->setCallingConv(Call->getCallingConv());
+  Invoke->setAttributes(Call->getAttributes());
+  Invoke->setDebugLoc(Call->getDebugLoc());
+
+  if (A.CGNode) {
+    Function *Callee = Call->getCalledFunction();
+    A.CGNode->replaceCallEdge(CallSite(Call), CallSite(Invoke),
+                              Callee ? A.CG->getOrInsertFunction(Callee)
+                                     : A.CG->getCallsExternalNode());
+  }
+  Call->replaceAllUsesWith(Invoke);
+  Call->eraseFromParent();
+}
+
+/// Takes a region mark on entry of F and releases it on all exits, including
+/// unwinding.
+static void insertRegionRelease(Function &F, const Analysis &A) {
+  BasicBlock &Entry = F.getEntryBlock();
+  IRBuilder<> Builder(&Entry, Entry.getFirstInsertionPt());
+  Value *Mark = EmitRegionCall(Builder, "_d_region_mark",
+                               Builder.getInt8PtrTy(), {}, A);
+
+  SmallVector<CallInst *, 16> MayUnwind;
+  for (auto &BB : F) {
+    for (auto &I : BB) {
+      auto CI = dyn_cast<CallInst>(&I);
+      if (CI && mayUnwind(CI)) {
+        MayUnwind.push_back(CI);
+      }
+    }
+    Instruction *Term = BB.getTerminator();
+    if (isa<ReturnInst>(Term) || isa<ResumeInst>(Term)) {
+      Builder.SetInsertPoint(Term);
+      EmitRegionCall(Builder, "_d_region_release", Builder.getVoidTy(), {Mark},
+                     A);
+    }
+  }
+
+  // Invokes already unwind to a landing pad, which resumes (releasing the
+  // mark) or continues to another exit.
+  if (MayUnwind.empty()) {
+    return;
+  }
+  BasicBlock *Cleanup = createReleasingCleanup(F, Mark, A);
+  for (CallInst *CI : MayUnwind) {
+    changeToInvoke(CI, Cleanup, A);
+  }
+}
 
 /// runOnFunction - Top level algorithm.
 ///
@@ -476,6 +819,9 @@ bool GarbageCollect2Stack::runOnFunction(Function &F) {
   CallGraphNode *CGNode = CG ? (*CG)[&F] : nullptr;
 
   Analysis A = {DL, *M, CG, CGNode};
+  Remarks R(F);
+  const bool CanUseRegion = RegionAlloc && canReleaseRegion(F);
+  bool UsesRegion = false;
 
   BasicBlock &Entry = F.getEntryBlock();
 
@@ -517,19 +863,36 @@ bool GarbageCollect2Stack::runOnFunction(Function &F) {
 
       LLVM_DEBUG(errs() << "GarbageCollect2Stack inspecting: " << *Inst);
 
-      if (!info->analyze(CS, A)) {
-        continue;
+      // Allocations which can't be put on the stack may still go to the
+      // region, unless they may be executed repeatedly before the region is
+      // released.
+      auto regionAllowed = [&] { return CanUseRegion && !isInCycle(&BB); };
+      bool ToRegion = false;
+      if (!info->analyze(CS, A, false)) {
+        if (!regionAllowed() || !info->analyze(CS, A, true)) {
+          NumUnsupported++;
+          R.missed(Inst, Callee->getName(), "unsupported type or size");
+          continue;
+        }
+        ToRegion = true;
       }
 
       SmallVector<CallInst *, 4> RemoveTailCallInsts;
-      if (info->ReturnType == ReturnType::Array) {
-        if (!isSafeToStackAllocateArray(originalI, DT, RemoveTailCallInsts)) {
-          continue;
-        }
-      } else {
-        if (!isSafeToStackAllocate(originalI, Inst, DT, RemoveTailCallInsts)) {
+      auto isSafe = [&](bool toRegion) {
+        RemoveTailCallInsts.clear();
+        return info->ReturnType == ReturnType::Array
+                   ? isSafeToStackAllocateArray(originalI, DT,
+                                                RemoveTailCallInsts, toRegion)
+                   : isSafeToStackAllocate(originalI, Inst, DT,
+                                           RemoveTailCallInsts, toRegion);
+      };
+      if (!isSafe(ToRegion)) {
+        if (ToRegion || !regionAllowed() || !isSafe(true)) {
+          NumEscaping++;
+          R.missed(Inst, Callee->getName(), "the memory may escape");
           continue;
         }
+        ToRegion = true;
       }
 
       // Let's alloca this!
@@ -541,8 +904,13 @@ bool GarbageCollect2Stack::runOnFunction(Function &F) {
         i->setTailCall(false);
       }
 
+      R.promoted(Inst, Callee->getName(),
+                 ToRegion ? "the region allocator" : "the stack");
+
       IRBuilder<> Builder(&BB, originalI);
-      Value *newVal = info->promote(CS, Builder, A);
+      Value *newVal = ToRegion ? info->promoteToRegion(CS, Builder, A)
+                               : info->promote(CS, Builder, A);
+      UsesRegion |= ToRegion;
 
       LLVM_DEBUG(errs() << "Promoted to: " << *newVal);
 
@@ -557,6 +925,11 @@ bool GarbageCollect2Stack::runOnFunction(Function &F) {
     }
   }
 
+  if (UsesRegion) {
+    insertRegionRelease(F, A);
+  }
+
+  R.summarize();
   return Changed;
 }
 
@@ -738,7 +1111,7 @@ static bool mayBeUsedAfterRealloc(Instruction *Def, BasicBlock::iterator Alloc,
 /// see isSafeToStackAllocate() for details.
 bool isSafeToStackAllocateArray(
     BasicBlock::iterator Alloc, DominatorTree &DT,
-    SmallVector<CallInst *, 4> &RemoveTailCallInsts) {
+    SmallVector<CallInst *, 4> &RemoveTailCallInsts, bool ToRegion) {
   assert(Alloc->getType()->isStructTy() && "Allocated array is not a struct?");
   Value *V = &(*Alloc);
 
@@ -762,7 +1135,8 @@ bool isSafeToStackAllocateArray(
                "First array field not length?");
       } else {
         assert(idx == 1 && "Invalid array struct access.");
-        if (!isSafeToStackAllocate(Alloc, EVI, DT, RemoveTailCallInsts)) {
+        if (!isSafeToStackAllocate(Alloc, EVI, DT, RemoveTailCallInsts,
+                                   ToRegion)) {
           return false;
         }
       }
@@ -801,9 +1175,13 @@ bool isSafeToStackAllocateArray(
 /// the attribute has to be removed before promoting the memory to the
 /// stack. The affected instructions are added to RemoveTailCallInsts. If
 /// the function returns false, these entries are meaningless.
+///
+/// With ToRegion, each execution of Alloc gets its own memory, so derived
+/// pointers may be live across it.
 bool isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V,
                            DominatorTree &DT,
-                           SmallVector<CallInst *, 4> &RemoveTailCallInsts) {
+                           SmallVector<CallInst *, 4> &RemoveTailCallInsts,
+                           bool ToRegion) {
   assert(isa<PointerType>(V->getType()) && "Allocated value is not a pointer?");
 
   SmallVector<Use *, 16> Worklist;
@@ -849,7 +1227,7 @@ bool isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V,
           const unsigned paramHasAttr_firstArg = 0;
 #endif
           if (!CS.paramHasAttr(A - B + paramHasAttr_firstArg,
-                               LLAttribute::NoCapture)) {
+                               Attribute::NoCapture)) {
             // The parameter is not marked 'nocapture' - captured.
             return false;
           }
@@ -882,7 +1260,7 @@ bool isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V,
     case Instruction::Select:
       // It's not safe to stack-allocate if this derived pointer is live across
       // the original allocation.
-      if (mayBeUsedAfterRealloc(I, Alloc, DT)) {
+      if (!ToRegion && mayBeUsedAfterRealloc(I, Alloc, DT)) {
         return false;
       }
 
@@ -0,0 +1,367 @@
+//===-- HoistGCAllocations.cpp - Reuse GC allocations of loops ------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file hoists GC allocations of loop-invariant size out of loops if the
+// memory doesn't escape and isn't used after the iteration which allocated
+// it, so that all iterations reuse a single allocation. It complements
+// GarbageCollect2Stack for allocations which are too large for the stack.
+//
+// The memory of _d_newarrayT is zeroed again in each iteration, the other
+// allocation functions return uninitialized memory which the frontend
+// initializes after the call.
+//
+// Memory which the GC finalizes (class instances and structs with destructors)
+// isn't hoisted, the destructors would only run once for all iterations.
+//
+//===----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "dgchoist"
+#if LDC_LLVM_VER < 700
+#define LLVM_DEBUG DEBUG
+#endif
+
+#include "gen/metadata.h"
+#include "gen/passes/Passes.h"
+#include "llvm/Pass.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Compiler.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <iterator>
+
+#if LDC_LLVM_VER >= 600
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#elif LDC_LLVM_VER >= 500
+#include "llvm/Analysis/OptimizationDiagnosticInfo.h"
+#endif
+
+using namespace llvm;
+
+STATISTIC(NumHoisted, "Number of GC allocations hoisted out of loops");
+STATISTIC(NumReinitialized,
+          "Number of hoisted GC allocations zeroed in each iteration");
+
+namespace {
+enum class AllocKind {
+  Unknown,
+  ZeroedArray, /// _d_newarrayT(ti, length)
+  Array,       /// _d_newarrayU(ti, length)
+  Memory       /// _d_allocmemoryT, _d_allocclass, _d_allocmemory
+};
+
+AllocKind getAllocKind(const CallInst *Call) {
+  const Function *Callee = Call->getCalledFunction();
+  if (Callee == nullptr || !Callee->isDeclaration() ||
+      !Callee->hasExternalLinkage()) {
+    return AllocKind::Unknown;
+  }
+  return StringSwitch<AllocKind>(Callee->getName())
+      .Case("_d_newarrayT", AllocKind::ZeroedArray)
+      .Case("_d_newarrayU", AllocKind::Array)
+      .Cases("_d_allocmemoryT", "_d_allocclass", "_d_allocmemory",
+             AllocKind::Memory)
+      .Default(AllocKind::Unknown);
+}
+
+/// Returns the metadata node of the TypeInfo, see Analysis::getTypeFor() in
+/// GarbageCollect2Stack.
+const MDNode *getTypeData(const Module &M, Value *TypeInfo) {
+  auto TIGlobal = dyn_cast<GlobalVariable>(TypeInfo->stripPointerCasts());
+  if (!TIGlobal) {
+    return nullptr;
+  }
+  const NamedMDNode *Meta =
+      M.getNamedMetadata((TD_PREFIX + TIGlobal->getName()).str());
+  if (!Meta || Meta->getNumOperands() == 0) {
+    return nullptr;
+  }
+  const MDNode *Node = Meta->getOperand(0);
+  if (!Node || Node->getNumOperands() != TD_NumFields) {
+    return nullptr;
+  }
+  return Node;
+}
+
+/// Returns the LLVM type of the elements of the array TypeInfo.
+llvm::Type *getElementType(const Module &M, Value *TypeInfo) {
+  const MDNode *Node = getTypeData(M, TypeInfo);
+  if (!Node) {
+    return nullptr;
+  }
+  auto MD = dyn_cast<ValueAsMetadata>(Node->getOperand(TD_Type).get());
+  auto ArrTy = MD ? dyn_cast<StructType>(MD->getType()) : nullptr;
+  if (!ArrTy || ArrTy->getNumElements() != 2) {
+    return nullptr;
+  }
+  return cast<PointerType>(ArrTy->getElementType(1))->getElementType();
+}
+
+/// Returns whether the GC may finalize the memory allocated by Call (or
+/// whether that's unknown). Reusing it would run the destructors only once
+/// instead of once per iteration.
+bool mayBeFinalized(const Module &M, CallInst *Call) {
+  const StringRef Callee = Call->getCalledFunction()->getName();
+  if (Callee == "_d_allocmemory") {
+    return false;
+  }
+
+  const MDNode *Node = nullptr;
+  unsigned Field = 0;
+  if (Callee == "_d_allocclass") {
+    // See AllocClassFI::analyze() in GarbageCollect2Stack.
+    auto ClassInfo =
+        dyn_cast<GlobalVariable>(Call->getArgOperand(0)->stripPointerCasts());
+    const NamedMDNode *Meta =
+        ClassInfo ? M.getNamedMetadata((CD_PREFIX + ClassInfo->getName()).str())
+                  : nullptr;
+    Node = Meta && Meta->getNumOperands() != 0 ? Meta->getOperand(0) : nullptr;
+    if (!Node || Node->getNumOperands() != CD_NumFields) {
+      return true;
+    }
+    auto CustomDelete =
+        mdconst::dyn_extract<Constant>(Node->getOperand(CD_CustomDelete));
+    if (!CustomDelete || !CustomDelete->isNullValue()) {
+      return true;
+    }
+    Field = CD_Finalize;
+  } else {
+    Node = getTypeData(M, Call->getArgOperand(0));
+    if (!Node) {
+      return true;
+    }
+    Field = TD_Finalize;
+  }
+
+  auto Finalize = mdconst::dyn_extract<Constant>(Node->getOperand(Field));
+  return !Finalize || !Finalize->isNullValue();
+}
+
+/// Returns whether the memory allocated by Call in loop L is only used in
+/// the iteration which allocated it.
+bool isUsedInIterationOnly(CallInst *Call, AllocKind Kind, const Loop *L) {
+  // The pointers to the memory, the slices of arrays only by extracting them.
+  SmallVector<Value *, 2> Pointers;
+  if (Kind == AllocKind::Memory) {
+    Pointers.push_back(Call);
+  } else {
+    for (User *U : Call->users()) {
+      auto EVI = dyn_cast<ExtractValueInst>(U);
+      if (!EVI || EVI->getNumIndices() != 1 || !L->contains(EVI)) {
+        return false;
+      }
+      if (EVI->getIndices()[0] == 1) {
+        Pointers.push_back(EVI);
+      }
+    }
+  }
+
+  SmallVector<Value *, 16> Worklist(Pointers.begin(), Pointers.end());
+  SmallPtrSet<Value *, 16> Visited(Pointers.begin(), Pointers.end());
+  while (!Worklist.empty()) {
+    Value *V = Worklist.pop_back_val();
+    // Not stored anywhere, so SSA values are the only way to the memory.
+    if (isa<ExtractValueInst>(V) &&
+        PointerMayBeCaptured(V, /*ReturnCaptures=*/true,
+                             /*StoreCaptures=*/true)) {
+      return false;
+    }
+    for (User *U : V->users()) {
+      auto I = cast<Instruction>(U);
+      // Values flowing into the next iteration or out of the loop.
+      if (!L->contains(I) ||
+          (isa<PHINode>(I) && I->getParent() == L->getHeader())) {
+        return false;
+      }
+      if (isa<BitCastInst>(I) || isa<GetElementPtrInst>(I) ||
+          isa<PHINode>(I) || isa<SelectInst>(I)) {
+        if (Visited.insert(I).second) {
+          Worklist.push_back(I);
+        }
+      }
+    }
+  }
+
+  return Kind != AllocKind::Memory ||
+         !PointerMayBeCaptured(Call, /*ReturnCaptures=*/true,
+                               /*StoreCaptures=*/true);
+}
+
+/// Reports hoisted and not hoisted allocations as optimization remarks.
+void emitRemark(Function &F, CallInst *Call, bool Hoisted,
+                const Twine &Msg) {
+#if LDC_LLVM_VER >= 500
+  OptimizationRemarkEmitter ORE(&F);
+  if (Hoisted) {
+    ORE.emit(OptimizationRemark(DEBUG_TYPE, "Hoisted", Call) << Msg.str());
+  } else {
+    ORE.emit(OptimizationRemarkMissed(DEBUG_TYPE, "NotHoisted", Call)
+             << Msg.str());
+  }
+#else
+  if (Hoisted) {
+    emitOptimizationRemark(F.getContext(), DEBUG_TYPE, F, Call->getDebugLoc(),
+                           Msg);
+  } else {
+    emitOptimizationRemarkMissed(F.getContext(), DEBUG_TYPE, F,
+                                 Call->getDebugLoc(), Msg);
+  }
+#endif
+}
+
+class LLVM_LIBRARY_VISIBILITY HoistGCAllocations : public FunctionPass {
+public:
+  static char ID; // Pass identification
+  HoistGCAllocations() : FunctionPass(ID) {}
+
+  bool runOnFunction(Function &F) override;
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.setPreservesCFG();
+  }
+
+private:
+  bool hoistFromLoop(Loop *L, DominatorTree &DT);
+  bool hoist(CallInst *Call, AllocKind Kind, Loop *L, DominatorTree &DT);
+};
+char HoistGCAllocations::ID = 0;
+} // end anonymous namespace.
+
+static RegisterPass<HoistGCAllocations>
+    X("dgchoist", "Hoist and reuse GC allocations of loop iterations");
+
+// Public interface to the pass.
+FunctionPass *createHoistGCAllocations() { return new HoistGCAllocations(); }
+
+bool HoistGCAllocations::runOnFunction(Function &F) {
+  LLVM_DEBUG(errs() << "\nRunning -dgchoist on function " << F.getName()
+                    << '\n');
+
+  DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+
+  bool Changed = false;
+  for (Loop *L : LI) {
+    Changed |= hoistFromLoop(L, DT);
+  }
+  return Changed;
+}
+
+/// Hoists the allocations of the inner loops first, they may then be hoisted
+/// out of L too.
+bool HoistGCAllocations::hoistFromLoop(Loop *L, DominatorTree &DT) {
+  bool Changed = false;
+  for (Loop *Inner : *L) {
+    Changed |= hoistFromLoop(Inner, DT);
+  }
+
+  if (!L->getLoopPreheader() || !L->getLoopLatch()) {
+    return Changed;
+  }
+
+  SmallVector<std::pair<CallInst *, AllocKind>, 4> Allocs;
+  for (BasicBlock *BB : L->blocks()) {
+    for (auto &I : *BB) {
+      if (auto Call = dyn_cast<CallInst>(&I)) {
+        const AllocKind Kind = getAllocKind(Call);
+        if (Kind != AllocKind::Unknown) {
+          Allocs.emplace_back(Call, Kind);
+        }
+      }
+    }
+  }
+
+  for (auto &Alloc : Allocs) {
+    Changed |= hoist(Alloc.first, Alloc.second, L, DT);
+  }
+  return Changed;
+}
+
+bool HoistGCAllocations::hoist(CallInst *Call, AllocKind Kind, Loop *L,
+                               DominatorTree &DT) {
+  Function &F = *Call->getFunction();
+  const StringRef Callee = Call->getCalledFunction()->getName();
+
+  if (!L->hasLoopInvariantOperands(Call) || Call->hasOperandBundles()) {
+    emitRemark(F, Call, false,
+               Callee + " not hoisted: the allocation isn't loop-invariant");
+    return false;
+  }
+  if (mayBeFinalized(*F.getParent(), Call)) {
+    emitRemark(F, Call, false,
+               Callee + " not hoisted: the memory may be finalized");
+    return false;
+  }
+  // Only allocate in the preheader if each iteration, including the first
+  // one, would allocate.
+  SmallVector<BasicBlock *, 4> Exiting;
+  L->getExitingBlocks(Exiting);
+  Exiting.push_back(L->getLoopLatch());
+  for (BasicBlock *BB : Exiting) {
+    if (!DT.dominates(Call->getParent(), BB)) {
+      emitRemark(F, Call, false,
+                 Callee + " not hoisted: not allocated in each iteration");
+      return false;
+    }
+  }
+  if (!isUsedInIterationOnly(Call, Kind, L)) {
+    emitRemark(F, Call, false,
+               Callee + " not hoisted: the memory outlives the iteration");
+    return false;
+  }
+
+  llvm::Type *ElemTy = nullptr;
+  if (Kind == AllocKind::ZeroedArray) {
+    ElemTy = getElementType(*F.getParent(), Call->getArgOperand(0));
+    if (!ElemTy) {
+      emitRemark(F, Call, false, Callee + " not hoisted: unknown type");
+      return false;
+    }
+  }
+
+  LLVM_DEBUG(errs() << "Hoisting: " << *Call);
+
+  const auto InsertPt = std::next(Call->getIterator());
+  Call->moveBefore(L->getLoopPreheader()->getTerminator());
+  Call->setTailCall(false);
+  ++NumHoisted;
+
+  if (ElemTy) {
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    IRBuilder<> Builder(Call->getContext());
+    Builder.SetInsertPoint(&*InsertPt);
+    Value *Length = Call->getArgOperand(1);
+    Value *Size = Builder.CreateMul(
+        ConstantInt::get(Length->getType(), DL.getTypeAllocSize(ElemTy)),
+        Length);
+    Value *Ptr = Builder.CreateExtractValue(Call, 1);
+    Builder.CreateMemSet(Builder.CreateBitCast(Ptr, Builder.getInt8PtrTy()),
+                         Builder.getInt8(0), Size, 1 /*Align*/);
+    ++NumReinitialized;
+  }
+
+  emitRemark(F, Call, true,
+             Callee + " hoisted out of the loop and reused by each iteration");
+  return true;
+}
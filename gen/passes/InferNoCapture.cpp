@@ -0,0 +1,153 @@
+//===-- InferNoCapture.cpp - Infer nocapture parameters -------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file infers the 'nocapture' attribute for pointer parameters, bottom-up
+// over the call graph, so that GarbageCollect2Stack can promote allocations
+// which are passed to helper functions that haven't been inlined.
+//
+// LLVM's FunctionAttrs does the same for exact definitions only. Here ODR
+// definitions (e.g. template instances) are considered as well: all their
+// copies are compiled from the same D code, so no copy captures a parameter
+// which the code doesn't capture.
+//
+//===----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "dnocapture"
+#if LDC_LLVM_VER < 700
+#define LLVM_DEBUG DEBUG
+#endif
+
+#include "gen/passes/Passes.h"
+#include "llvm/Pass.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/CallGraphSCCPass.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/IR/Argument.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/Compiler.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <iterator>
+
+using namespace llvm;
+
+STATISTIC(NumNoCapture, "Number of parameters inferred as nocapture");
+
+namespace {
+using ArgumentSet = SmallPtrSet<const Argument *, 16>;
+
+/// Tracks the captures of a parameter, except for passing it to parameters
+/// of the current SCC which are still assumed not to capture.
+struct SCCCaptureTracker : public CaptureTracker {
+  const ArgumentSet &Assumed;
+  bool Captured = false;
+
+  explicit SCCCaptureTracker(const ArgumentSet &assumed) : Assumed(assumed) {}
+
+  void tooManyUses() override { Captured = true; }
+
+  bool captured(const Use *U) override {
+    ImmutableCallSite CS(U->getUser());
+    if (CS && CS.isArgOperand(U)) {
+      const Function *Callee = CS.getCalledFunction();
+      const unsigned ArgNo = CS.getArgumentNo(U);
+      if (Callee && ArgNo < Callee->arg_size() &&
+          Assumed.count(&*std::next(Callee->arg_begin(), ArgNo))) {
+        return false;
+      }
+    }
+    Captured = true;
+    return true;
+  }
+};
+
+/// Returns whether the definition of F is the one executed for calls of F.
+bool isDefinitionUsed(const Function &F) {
+  return !F.isDeclaration() && !F.isInterposable() &&
+         !F.hasFnAttribute(Attribute::Naked);
+}
+
+class LLVM_LIBRARY_VISIBILITY InferNoCapture : public CallGraphSCCPass {
+public:
+  static char ID; // Pass identification
+  InferNoCapture() : CallGraphSCCPass(ID) {}
+
+  bool runOnSCC(CallGraphSCC &SCC) override;
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.setPreservesCFG();
+    CallGraphSCCPass::getAnalysisUsage(AU);
+  }
+};
+char InferNoCapture::ID = 0;
+} // end anonymous namespace.
+
+static RegisterPass<InferNoCapture>
+    X("dnocapture", "Infer nocapture parameters of D functions");
+
+// Public interface to the pass.
+llvm::Pass *createInferNoCapture() { return new InferNoCapture(); }
+
+bool InferNoCapture::runOnSCC(CallGraphSCC &SCC) {
+  // Optimistically assume that none of the parameters is captured, then drop
+  // the captured ones until the rest only depends on parameters which are
+  // still assumed not to be captured (for recursive calls).
+  SmallVector<Argument *, 16> Candidates;
+  ArgumentSet Assumed;
+  for (CallGraphNode *Node : SCC) {
+    Function *F = Node->getFunction();
+    if (F == nullptr || !isDefinitionUsed(*F)) {
+      continue;
+    }
+    for (Argument &A : F->args()) {
+      if (A.getType()->isPointerTy() && !A.hasNoCaptureAttr()) {
+        Candidates.push_back(&A);
+        Assumed.insert(&A);
+      }
+    }
+  }
+
+  bool Changed;
+  do {
+    Changed = false;
+    for (Argument *A : Candidates) {
+      if (!Assumed.count(A)) {
+        continue;
+      }
+      SCCCaptureTracker Tracker(Assumed);
+      PointerMayBeCaptured(A, &Tracker);
+      if (Tracker.Captured) {
+        Assumed.erase(A);
+        Changed = true;
+      }
+    }
+  } while (Changed);
+
+  for (Argument *A : Candidates) {
+    if (!Assumed.count(A)) {
+      continue;
+    }
+    LLVM_DEBUG(errs() << "dnocapture: parameter " << A->getArgNo() << " of "
+                      << A->getParent()->getName() << '\n');
+#if LDC_LLVM_VER >= 500
+    A->addAttr(Attribute::NoCapture);
+#else
+    AttrBuilder B;
+    B.addAttribute(Attribute::NoCapture);
+    A->addAttr(AttributeSet::get(A->getContext(), A->getArgNo() + 1, B));
+#endif
+    ++NumNoCapture;
+  }
+
+  return !Assumed.empty();
+}
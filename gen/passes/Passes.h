@@ -18,6 +18,7 @@
 namespace llvm {
 class FunctionPass;
 class ModulePass;
+class Pass;
 }
 
 // Performs simplifications on runtime calls.
@@ -25,4 +26,11 @@ llvm::FunctionPass *createSimplifyDRuntimeCalls();
 
 llvm::FunctionPass *createGarbageCollect2Stack();
 
+// Hoists non-escaping GC allocations out of loops to reuse them.
+llvm::FunctionPass *createHoistGCAllocations();
+
+// Infers nocapture parameters bottom-up over the call graph, for
+// GarbageCollect2Stack.
+llvm::Pass *createInferNoCapture();
+
 llvm::ModulePass *createStripExternalsPass();
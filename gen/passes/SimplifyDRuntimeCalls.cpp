@@ -20,12 +20,16 @@
 #endif
 
 #include "gen/passes/Passes.h"
-#include "gen/tollvm.h"
-#include "gen/runtime.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/StringMap.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
@@ -40,6 +44,9 @@ using namespace llvm;
 
 STATISTIC(NumSimplified, "Number of runtime calls simplified");
 STATISTIC(NumDeleted, "Number of runtime calls deleted");
+STATISTIC(NumAALookupsCSE, "Number of redundant AA lookups removed");
+STATISTIC(NumAALookupsFused,
+          "Number of AA 'in' lookups fused with a following insertion");
 
 //===----------------------------------------------------------------------===//
 // Optimizer Base Class
@@ -54,6 +61,7 @@ protected:
   bool *Changed;
   const DataLayout *DL;
   AliasAnalysis *AA;
+  DominatorTree *DT;
   LLVMContext *Context;
 
   /// CastToCStr - Return V if it is an i8*, otherwise cast it to i8*.
@@ -77,11 +85,12 @@ public:
                                IRBuilder<> &B) = 0;
 
   Value *OptimizeCall(CallInst *CI, bool &Changed, const DataLayout *DL,
-                      AliasAnalysis &AA, IRBuilder<> &B) {
+                      AliasAnalysis &AA, DominatorTree &DT, IRBuilder<> &B) {
     Caller = CI->getParent()->getParent();
     this->Changed = &Changed;
     this->DL = DL;
     this->AA = &AA;
+    this->DT = &DT;
     if (CI->getCalledFunction()) {
       Context = &CI->getCalledFunction()->getContext();
     }
@@ -245,12 +254,440 @@ struct LLVM_LIBRARY_VISIBILITY ArraySliceCopyOpt : public LibCallOptimization {
     // Equal length and the pointers definitely don't alias, so it's safe to
     // replace the call with memcpy
     auto Size = Sz != llvm::MemoryLocation::UnknownSize
-                    ? DtoConstSize_t(Sz)
+                    ? ConstantInt::get(DstLength->getType(), Sz)
                     : B.CreateMul(DstLength, ElemSz);
     return EmitMemCpy(CI->getOperand(0), CI->getOperand(2), Size, 1, B);
   }
 };
 
+//===---------------------------------------===//
+// '_aaInX'/'_aaGetY' Optimizations
+
+/// AALookupOpt - Remove repeated lookups of the same key in the same AA, and
+/// fuse 'k in aa' followed by 'aa[k] = v' if it isn't found into _aaGetX.
+/// The _aaInXF/_aaGetYF variants with key functions are handled alike.
+///
+/// The frontend passes the key via a pointer to a fresh temporary, so keys
+/// are compared by the value stored to that temporary (or by address for
+/// other key lvalues). The AA is compared by value (_aaInX) or by the address
+/// of the AA variable (_aaGetY, and the AA loaded for _aaInX).
+///
+/// Only keys without indirections are handled (scalars, and pointers hashed
+/// by address): the hash and equality of others (class references, slices,
+/// structs) depend on memory the key refers to, which isn't watched.
+struct LLVM_LIBRARY_VISIBILITY AALookupOpt : public LibCallOptimization {
+  /// The AA and key of a lookup.
+  struct Lookup {
+    CallInst *Call = nullptr;
+    bool IsGet = false;           // _aaGetY, i.e. inserting
+    Value *AAPtr = nullptr;       // the address of the AA variable
+    Value *AAVal = nullptr;       // the AA value, for _aaInX
+    Instruction *Start = nullptr; // the first instruction reading the AA
+    Value *Key = nullptr;         // the key value, or the key address
+    bool KeyByAddress = false;
+  };
+
+  static bool isAAIn(const Function *F) {
+    return F && (F->getName() == "_aaInX" || F->getName() == "_aaInXF");
+  }
+
+  static bool isAAGet(const Function *F) {
+    return F && (F->getName() == "_aaGetY" || F->getName() == "_aaGetYF");
+  }
+
+  static bool isAALookup(const Function *F) { return isAAIn(F) || isAAGet(F); }
+
+  /// Returns the index of the key pointer argument.
+  static unsigned getKeyArgNo(const Function *F) { return isAAGet(F) ? 3 : 2; }
+
+  /// Returns whether V is a temporary only written once, which is only used
+  /// to pass a key to the AA runtime functions.
+  static bool isKeyTemporary(Value *V, StoreInst *&Store) {
+    for (User *U : V->users()) {
+      if (isa<BitCastInst>(U)) {
+        if (!isKeyTemporary(U, Store)) {
+          return false;
+        }
+        continue;
+      }
+      if (auto SI = dyn_cast<StoreInst>(U)) {
+        if (SI->getPointerOperand() != V || Store || !SI->isSimple()) {
+          return false;
+        }
+        Store = SI;
+        continue;
+      }
+      if (isa<LoadInst>(U) || isa<DbgInfoIntrinsic>(U)) {
+        continue;
+      }
+      if (auto II = dyn_cast<IntrinsicInst>(U)) {
+        if (II->getIntrinsicID() == Intrinsic::lifetime_start ||
+            II->getIntrinsicID() == Intrinsic::lifetime_end) {
+          continue;
+        }
+        return false;
+      }
+      auto CI = dyn_cast<CallInst>(U);
+      Function *F = CI ? CI->getCalledFunction() : nullptr;
+      if (!F ||
+          !(isAALookup(F) || F->getName() == "_aaDelX" ||
+            F->getName() == "_aaDelXF") ||
+          CI->getNumArgOperands() <= getKeyArgNo(F) ||
+          CI->getArgOperand(getKeyArgNo(F)) != V) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  Lookup analyze(CallInst *CI) const {
+    Lookup L;
+    L.Call = CI;
+    L.IsGet = isAAGet(CI->getCalledFunction());
+    L.Start = CI;
+
+    Value *AAArg = CI->getArgOperand(0)->stripPointerCasts();
+    if (L.IsGet) {
+      L.AAPtr = AAArg;
+    } else {
+      L.AAVal = AAArg;
+      auto Load = dyn_cast<LoadInst>(AAArg);
+      if (Load && Load->isSimple()) {
+        L.AAPtr = Load->getPointerOperand()->stripPointerCasts();
+        L.Start = Load;
+      }
+    }
+
+    Value *PKey = CI->getArgOperand(getKeyArgNo(CI->getCalledFunction()))
+                      ->stripPointerCasts();
+    StoreInst *Store = nullptr;
+    if (isa<AllocaInst>(PKey) && isKeyTemporary(PKey, Store) && Store &&
+        DT->dominates(Store, CI)) {
+      L.Key = Store->getValueOperand();
+    } else {
+      L.Key = PKey;
+      L.KeyByAddress = true;
+    }
+    return L;
+  }
+
+  /// Returns whether TI is the TypeInfo of a pointer type, e.g.
+  /// _D12TypeInfo_Pi6__initZ.
+  static bool isPointerTypeInfo(const GlobalValue *TI) {
+    StringRef Name = TI->getName();
+    if (!Name.startswith("_D")) {
+      return false;
+    }
+    return Name.drop_front(2).ltrim("0123456789").startswith("TypeInfo_P");
+  }
+
+  /// Returns whether the key of L is compared by its value only, i.e. a
+  /// scalar or a pointer hashed by its address.
+  static bool hasPlainKey(const Lookup &L) {
+    Type *Ty = L.Key->getType();
+    if (L.KeyByAddress) {
+      if (!Ty->isPointerTy()) {
+        return false;
+      }
+      Ty = Ty->getPointerElementType();
+    }
+    if (Ty->isIntegerTy() || Ty->isFloatingPointTy()) {
+      return true;
+    }
+    if (!Ty->isPointerTy()) {
+      return false;
+    }
+
+    // Pointers and class references look the same, tell them apart by the
+    // hash function or TypeInfo.
+    Function *F = L.Call->getCalledFunction();
+    const unsigned KeyArgNo = getKeyArgNo(F);
+    if (F->getName().endswith("F")) {
+      if (L.Call->getNumArgOperands() <= KeyArgNo + 1) {
+        return false;
+      }
+      auto Hash = dyn_cast<Function>(
+          L.Call->getArgOperand(KeyArgNo + 1)->stripPointerCasts());
+      return Hash && Hash->getName() == "ldc.aa.hash.ptr";
+    }
+    if (isAAIn(F)) {
+      auto TI = dyn_cast<GlobalValue>(
+          L.Call->getArgOperand(1)->stripPointerCasts());
+      return TI && isPointerTypeInfo(TI);
+    }
+    return false;
+  }
+
+  /// Returns whether SI stores a scalar to the value of an AA entry, which
+  /// doesn't change any AA variable.
+  bool isScalarStoreToEntry(StoreInst *SI) const {
+    Type *Ty = SI->getValueOperand()->getType();
+    if (!Ty->isIntegerTy() && !Ty->isFloatingPointTy()) {
+      return false;
+    }
+    auto CI = dyn_cast<CallInst>(
+        GetUnderlyingObject(SI->getPointerOperand(), *DL));
+    Function *F = CI ? CI->getCalledFunction() : nullptr;
+    return F && (isAALookup(F) || F->getName() == "_aaGetX");
+  }
+
+  /// Returns whether I may change the result of a lookup, or what it reads
+  /// (the AA variable or key address in Watched). If Observing, reading the
+  /// AA counts as well.
+  bool mayChangeLookup(Instruction &I, ArrayRef<Value *> Watched,
+                       bool Observing) const {
+    auto aliasesWatched = [&](Value *Ptr) {
+      for (Value *W : Watched) {
+        if (AA->alias(Ptr, MemoryLocation::UnknownSize, W,
+                      MemoryLocation::UnknownSize)) {
+          return true;
+        }
+      }
+      return false;
+    };
+
+    if (isa<DbgInfoIntrinsic>(I)) {
+      return false;
+    }
+    if (auto II = dyn_cast<IntrinsicInst>(&I)) {
+      if (II->getIntrinsicID() == Intrinsic::lifetime_start ||
+          II->getIntrinsicID() == Intrinsic::lifetime_end) {
+        return false;
+      }
+      if (auto MI = dyn_cast<MemIntrinsic>(II)) {
+        return aliasesWatched(MI->getRawDest());
+      }
+    }
+    if (auto CS = CallSite(&I)) {
+      if (Observing) {
+        return true;
+      }
+      // Lookups and the length don't change an AA, other readonly calls
+      // can't either.
+      Function *F = CS.getCalledFunction();
+      if (F && F->getName() == "_aaLen") {
+        return false;
+      }
+      return !CS.onlyReadsMemory() && !isAAIn(F);
+    }
+    if (auto SI = dyn_cast<StoreInst>(&I)) {
+      return !isScalarStoreToEntry(SI) &&
+             aliasesWatched(SI->getPointerOperand());
+    }
+    if (auto LI = dyn_cast<LoadInst>(&I)) {
+      return Observing && aliasesWatched(LI->getPointerOperand());
+    }
+    return I.mayWriteToMemory();
+  }
+
+  /// Returns whether any instruction on the paths from From (dominating To)
+  /// to To, excluding both, may change the lookup or is KeyDef.
+  bool mayChangeOnPaths(Instruction *From, Instruction *To,
+                        ArrayRef<Value *> Watched, Value *KeyDef,
+                        bool Observing) const {
+    auto scan = [&](BasicBlock::iterator It, BasicBlock::iterator End) {
+      for (; It != End; ++It) {
+        if (&*It == KeyDef || mayChangeLookup(*It, Watched, Observing)) {
+          return true;
+        }
+      }
+      return false;
+    };
+
+    BasicBlock *FromBB = From->getParent();
+    BasicBlock *ToBB = To->getParent();
+    if (FromBB == ToBB) {
+      return scan(std::next(From->getIterator()), To->getIterator());
+    }
+    if (scan(std::next(From->getIterator()), FromBB->end()) ||
+        scan(ToBB->begin(), To->getIterator())) {
+      return true;
+    }
+
+    const unsigned MaxBlocks = 32;
+    SmallPtrSet<BasicBlock *, 16> Visited;
+    Visited.insert(FromBB);
+    SmallVector<BasicBlock *, 16> Worklist(pred_begin(ToBB), pred_end(ToBB));
+    while (!Worklist.empty()) {
+      BasicBlock *BB = Worklist.pop_back_val();
+      if (!Visited.insert(BB).second) {
+        continue;
+      }
+      if (Visited.size() > MaxBlocks || scan(BB->begin(), BB->end())) {
+        return true;
+      }
+      Worklist.append(pred_begin(BB), pred_end(BB));
+    }
+    return false;
+  }
+
+  /// Returns the instruction from which on Earlier and Later look up the same
+  /// key in the same AA, collecting the memory to watch from there on.
+  Instruction *getCommonStart(const Lookup &Earlier, const Lookup &Later,
+                              SmallVectorImpl<Value *> &Watched) const {
+    if (Earlier.Key != Later.Key ||
+        Earlier.KeyByAddress != Later.KeyByAddress || !hasPlainKey(Earlier) ||
+        !hasPlainKey(Later)) {
+      return nullptr;
+    }
+    if (Earlier.KeyByAddress) {
+      Watched.push_back(Earlier.Key);
+    }
+
+    if (Earlier.AAVal && Earlier.AAVal == Later.AAVal) {
+      return Earlier.Call;
+    }
+    if (!Earlier.AAPtr || Earlier.AAPtr != Later.AAPtr) {
+      return nullptr;
+    }
+    // The AA variable must not change from the earlier read of it on, up to
+    // the later one.
+    Watched.push_back(Earlier.AAPtr);
+    if (Later.Start != Later.Call &&
+        !DT->dominates(Earlier.Start, Later.Start)) {
+      return nullptr;
+    }
+    return Earlier.Start;
+  }
+
+  /// Replaces the 'in' lookup Earlier and the insertion Later, executed if the
+  /// key isn't found, by a single _aaGetX call. Returns its result.
+  Value *fuse(const Lookup &Earlier, const Lookup &Later) {
+    CallInst *In = Earlier.Call;
+    CallInst *Get = Later.Call;
+    if (Get->getCalledFunction()->getName() != "_aaGetY" ||
+        !isa<Constant>(Get->getArgOperand(1)) ||
+        !isa<Constant>(Get->getArgOperand(2))) {
+      return nullptr;
+    }
+
+    // Later must be executed iff Earlier returns null.
+    auto Br = dyn_cast<BranchInst>(In->getParent()->getTerminator());
+    auto Cmp = Br && Br->isConditional()
+                   ? dyn_cast<ICmpInst>(Br->getCondition())
+                   : nullptr;
+    if (!Cmp || !Cmp->isEquality() ||
+        !isa<ConstantPointerNull>(Cmp->getOperand(1)) ||
+        Cmp->getOperand(0)->stripPointerCasts() != In) {
+      return nullptr;
+    }
+    BasicBlock *NotFound =
+        Br->getSuccessor(Cmp->getPredicate() == ICmpInst::ICMP_EQ ? 0 : 1);
+    if (Get->getParent() != NotFound ||
+        NotFound->getSinglePredecessor() != In->getParent()) {
+      return nullptr;
+    }
+
+    // Nothing in between may observe the earlier insertion.
+    SmallVector<Value *, 2> Watched;
+    Instruction *Start = getCommonStart(Earlier, Later, Watched);
+    if (!Start || mayChangeOnPaths(Start, In, Watched, Earlier.Key, true) ||
+        mayChangeOnPaths(In, Get, Watched, Earlier.Key, true)) {
+      return nullptr;
+    }
+
+    Module *M = Caller->getParent();
+    Function *GetX = M->getFunction("_aaGetX");
+    if (!GetX) {
+      FunctionType *GetYTy = Get->getCalledFunction()->getFunctionType();
+      SmallVector<Type *, 5> Params(GetYTy->param_begin(),
+                                    GetYTy->param_end());
+      Params.push_back(PointerType::getUnqual(Type::getInt8Ty(*Context)));
+      GetX = Function::Create(
+          FunctionType::get(GetYTy->getReturnType(), Params, false),
+          GlobalValue::ExternalLinkage, "_aaGetX", M);
+    }
+    FunctionType *GetXTy = GetX->getFunctionType();
+    if (GetXTy->getNumParams() != 5 ||
+        GetXTy->getReturnType() != Get->getType()) {
+      return nullptr;
+    }
+
+    // void* _aaGetX(AA* aa, const TypeInfo_AssociativeArray ti,
+    //               in size_t valuesize, in void* pkey, out bool found)
+    BasicBlock &Entry = Caller->getEntryBlock();
+    IRBuilder<> EntryBuilder(&Entry, Entry.begin());
+    Value *FoundAddr = EntryBuilder.CreateAlloca(
+        GetXTy->getParamType(4)->getPointerElementType(), nullptr,
+        "aa.found");
+
+    IRBuilder<> B(In);
+    Value *Args[] = {
+        B.CreateBitCast(Earlier.AAPtr, GetXTy->getParamType(0)),
+        Get->getArgOperand(1), Get->getArgOperand(2),
+        B.CreateBitCast(In->getArgOperand(2), GetXTy->getParamType(3)),
+        FoundAddr};
+    CallInst *Slot = B.CreateCall(GetX, Args, "aa.slot");
+    Value *Found = B.CreateIsNotNull(B.CreateLoad(FoundAddr));
+    Value *InResult = B.CreateSelect(
+        Found, B.CreateBitCast(Slot, In->getType()),
+        ConstantPointerNull::get(cast<PointerType>(In->getType())));
+    In->replaceAllUsesWith(InResult);
+    InResult->takeName(In);
+    In->eraseFromParent();
+
+    ++NumAALookupsFused;
+    return Slot;
+  }
+
+  Value *CallOptimizer(Function *Callee, CallInst *CI,
+                       IRBuilder<> &B) override {
+    // Verify we have a reasonable prototype for _aaInX/_aaGetY, with two
+    // additional key functions for _aaInXF/_aaGetYF
+    const FunctionType *FT = Callee->getFunctionType();
+    const bool IsGet = isAAGet(Callee);
+    const bool WithKeyFunctions = Callee->getName().endswith("F");
+    if (Callee->arg_size() !=
+            (IsGet ? 4u : 3u) + (WithKeyFunctions ? 2u : 0u) ||
+        !isa<PointerType>(FT->getReturnType()) ||
+        !isa<PointerType>(FT->getParamType(0))) {
+      return nullptr;
+    }
+
+    const Lookup Later = analyze(CI);
+
+    SmallVector<CallInst *, 8> Candidates;
+    for (const char *Name : {"_aaInX", "_aaGetY", "_aaInXF", "_aaGetYF"}) {
+      Function *F = Caller->getParent()->getFunction(Name);
+      if (!F) {
+        continue;
+      }
+      for (User *U : F->users()) {
+        auto Earlier = dyn_cast<CallInst>(U);
+        if (Earlier && Earlier != CI && Earlier->getCalledFunction() == F &&
+            Earlier->getFunction() == Caller &&
+            Earlier->getNumArgOperands() > getKeyArgNo(F) &&
+            Earlier->getType() == CI->getType() &&
+            DT->dominates(Earlier, CI)) {
+          Candidates.push_back(Earlier);
+        }
+      }
+    }
+
+    for (CallInst *C : Candidates) {
+      const Lookup Earlier = analyze(C);
+
+      // 'k in aa' followed by 'aa[k] = v' if not found.
+      if (IsGet && !Earlier.IsGet) {
+        if (Value *Slot = fuse(Earlier, Later)) {
+          return Slot;
+        }
+        continue;
+      }
+
+      // Repeated lookups (or a lookup after an insertion) yield the same
+      // slot unless the AA has been changed in between.
+      SmallVector<Value *, 2> Watched;
+      Instruction *Start = getCommonStart(Earlier, Later, Watched);
+      if (Start && !mayChangeOnPaths(Start, CI, Watched, Later.Key, false)) {
+        ++NumAALookupsCSE;
+        return C;
+      }
+    }
+    return nullptr;
+  }
+};
+
 // TODO: More optimizations! :)
 
 } // end anonymous namespace.
@@ -272,6 +709,9 @@ class LLVM_LIBRARY_VISIBILITY SimplifyDRuntimeCalls : public FunctionPass {
   // GC allocations
   AllocationOpt Allocation;
 
+  // Associative arrays
+  AALookupOpt AALookup;
+
 public:
   static char ID; // Pass identification
   SimplifyDRuntimeCalls() : FunctionPass(ID) {}
@@ -279,10 +719,13 @@ public:
   void InitOptimizations();
   bool runOnFunction(Function &F) override;
 
-  bool runOnce(Function &F, const DataLayout *DL, AAResultsWrapperPass &AA);
+  bool runOnce(Function &F, const DataLayout *DL, AAResultsWrapperPass &AA,
+               DominatorTree &DT);
 
   void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.addRequired<AAResultsWrapperPass>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.setPreservesCFG();
   }
 };
 char SimplifyDRuntimeCalls::ID = 0;
@@ -304,6 +747,13 @@ void SimplifyDRuntimeCalls::InitOptimizations() {
   Optimizations["_d_arraysetlengthiT"] = &ArraySetLength;
   Optimizations["_d_array_slice_copy"] = &ArraySliceCopy;
 
+  // Lookups of associative arrays. _aaDelX and other calls writing memory
+  // separate them, _aaLen doesn't.
+  Optimizations["_aaInX"] = &AALookup;
+  Optimizations["_aaGetY"] = &AALookup;
+  Optimizations["_aaInXF"] = &AALookup;
+  Optimizations["_aaGetYF"] = &AALookup;
+
   /* Delete calls to runtime functions which aren't needed if their result is
    * unused. That comes down to functions that don't do anything but
    * GC-allocate and initialize some memory.
@@ -333,6 +783,7 @@ bool SimplifyDRuntimeCalls::runOnFunction(Function &F) {
 
   const DataLayout *DL = &F.getParent()->getDataLayout();
   AAResultsWrapperPass &AA = getAnalysis<AAResultsWrapperPass>();
+  DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
 
   // Iterate to catch opportunities opened up by other optimizations,
   // such as calls that are only used as arguments to unused calls:
@@ -342,7 +793,7 @@ bool SimplifyDRuntimeCalls::runOnFunction(Function &F) {
   bool EverChanged = false;
   bool Changed;
   do {
-    Changed = runOnce(F, DL, AA);
+    Changed = runOnce(F, DL, AA, DT);
     EverChanged |= Changed;
   } while (Changed);
 
@@ -350,7 +801,8 @@ bool SimplifyDRuntimeCalls::runOnFunction(Function &F) {
 }
 
 bool SimplifyDRuntimeCalls::runOnce(Function &F, const DataLayout *DL,
-                                    AAResultsWrapperPass &AAP) {
+                                    AAResultsWrapperPass &AAP,
+                                    DominatorTree &DT) {
   IRBuilder<> Builder(F.getContext());
 
   bool Changed = false;
@@ -385,7 +837,8 @@ bool SimplifyDRuntimeCalls::runOnce(Function &F, const DataLayout *DL,
 
       AliasAnalysis &AA = AAP.getAAResults();
       // Try to optimize this call.
-      Value *Result = OMI->second->OptimizeCall(CI, Changed, DL, AA, Builder);
+      Value *Result =
+          OMI->second->OptimizeCall(CI, Changed, DL, AA, DT, Builder);
       if (Result == nullptr) {
         continue;
       }
@@ -63,7 +63,9 @@ static void checkForImplicitGCCall(const Loc &loc, const char *name) {
   if (nogc) {
     static const std::string GCNAMES[] = {
         "_aaDelX",
+        "_aaDelXF",
         "_aaGetY",
+        "_aaGetYF",
         "_aaKeys",
         "_aaRehash",
         "_aaValues",
@@ -749,6 +751,32 @@ static void buildRuntimeModule() {
   createFwdDecl(LINKc, boolTy, {"_aaDelX"}, {aaTy, typeInfoTy, voidPtrTy},
                 {0, STCin, STCin}, Attr_1_3_NoCapture);
 
+  // Variants taking monomorphic key functions instead of calling the TypeInfo
+  // methods for each probe:
+  // alias AAKeyHash = size_t function(in void* pkey) nothrow;
+  // alias AAKeyEquals = bool function(in void* pkey1, in void* pkey2) nothrow;
+  // A null hash function falls back to keyti.getHash().
+
+  // void* _aaGetYF(AA* aa, const TypeInfo aati, in size_t valuesize,
+  //                in void* pkey, AAKeyHash hash, AAKeyEquals equals)
+  createFwdDecl(LINKc, voidPtrTy, {"_aaGetYF"},
+                {aaTy->pointerTo(), aaTypeInfoTy, sizeTy, voidPtrTy, voidPtrTy,
+                 voidPtrTy},
+                {0, STCconst, STCin, STCin, 0, 0}, Attr_1_4_NoCapture);
+
+  // inout(void)* _aaInXF(inout AA aa, in TypeInfo keyti, in void* pkey,
+  //                      AAKeyHash hash, AAKeyEquals equals)
+  createFwdDecl(LINKc, voidPtrTy, {"_aaInXF"},
+                {aaTy, typeInfoTy, voidPtrTy, voidPtrTy, voidPtrTy},
+                {STCin | STCout, STCin, STCin, 0, 0},
+                Attr_ReadOnly_1_3_NoCapture);
+
+  // bool _aaDelXF(AA aa, in TypeInfo keyti, in void* pkey, AAKeyHash hash,
+  //               AAKeyEquals equals)
+  createFwdDecl(LINKc, boolTy, {"_aaDelXF"},
+                {aaTy, typeInfoTy, voidPtrTy, voidPtrTy, voidPtrTy},
+                {0, STCin, STCin, 0, 0}, Attr_1_3_NoCapture);
+
   // int _aaEqual(in TypeInfo tiRaw, in AA e1, in AA e2)
   createFwdDecl(LINKc, intTy, {"_aaEqual"}, {typeInfoTy, aaTy, aaTy},
                 {STCin, STCin, STCin}, Attr_1_2_NoCapture);
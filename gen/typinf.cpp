@@ -102,6 +102,10 @@ static void emitTypeMetadata(TypeInfoDeclaration *tid) {
       mdVals[TD_TypeInfo] = llvm::ValueAsMetadata::get(getIrGlobal(tid)->value);
       mdVals[TD_Type] = llvm::ConstantAsMetadata::get(
           llvm::UndefValue::get(DtoType(tid->tinfo)));
+      Type *finalized = t->ty == Tarray ? t->nextOf() : t;
+      mdVals[TD_Finalize] = llvm::ConstantAsMetadata::get(
+          LLConstantInt::get(LLType::getInt1Ty(gIR->context()),
+                             finalized->needsDestruction()));
 
       // Construct the metadata and insert it into the module.
       llvm::NamedMDNode *node = gIR->module.getOrInsertNamedMetadata(metaname);
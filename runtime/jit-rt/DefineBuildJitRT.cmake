@@ -6,6 +6,12 @@ if(LDC_DYNAMIC_COMPILE)
     file(GLOB LDC_JITRT_H ${JITRT_DIR}/cpp/*.h)
     file(GLOB LDC_JITRT_SO_CXX ${JITRT_DIR}/cpp-so/*.cpp)
     file(GLOB LDC_JITRT_SO_H ${JITRT_DIR}/cpp-so/*.h)
+    # The D specific optimization passes of the compiler
+    list(APPEND LDC_JITRT_SO_CXX
+        ${JITRT_DIR}/../../gen/passes/GarbageCollect2Stack.cpp
+        ${JITRT_DIR}/../../gen/passes/HoistGCAllocations.cpp
+        ${JITRT_DIR}/../../gen/passes/InferNoCapture.cpp
+        ${JITRT_DIR}/../../gen/passes/SimplifyDRuntimeCalls.cpp)
 
     # Set compiler-dependent flags
     if(MSVC)
@@ -45,7 +51,7 @@ if(LDC_DYNAMIC_COMPILE)
         # to do find_package(LLVM CONFIG) for it so here is a hackish way to get it
         include("${LLVM_CMAKEDIR}/LLVMConfig.cmake")
         include("${LLVM_CMAKEDIR}/LLVM-Config.cmake")
-        llvm_map_components_to_libnames(JITRT_LLVM_LIBS core support irreader executionengine passes nativecodegen orcjit target
+        llvm_map_components_to_libnames(JITRT_LLVM_LIBS core support irreader bitwriter executionengine passes nativecodegen orcjit target
             "${LLVM_NATIVE_ARCH}disassembler" "${LLVM_NATIVE_ARCH}asmprinter")
 
         foreach(libname ${JITRT_LLVM_LIBS})
@@ -70,6 +76,7 @@ if(LDC_DYNAMIC_COMPILE)
         )
         set_target_properties(ldc-jit-rt-so${target_suffix} PROPERTIES LINKER_LANGUAGE CXX)
 
+        target_include_directories(ldc-jit-rt-so${target_suffix} PRIVATE ${JITRT_DIR}/../..)
         target_link_libraries(ldc-jit-rt-so${target_suffix} ${JITRT_LLVM_LIBS})
 
         set(jitrt_d_o "")
@@ -0,0 +1,87 @@
+//===-- bind_cache.cpp ----------------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bind_cache.h"
+
+#include <algorithm>
+#include <cassert>
+
+const UnitInputs *BindCache::getInputs(const void *handle) const {
+  auto it = handles.find(handle);
+  return handles.end() != it ? &it->second.inputs : nullptr;
+}
+
+const void *BindCache::acquire(const void *handle, const std::string &key,
+                               UnitInputs inputs, std::string &symbol) {
+  assert(nullptr != handle);
+  auto it = entries.find(key);
+  if (entries.end() == it) {
+    return nullptr;
+  }
+  release(handle);
+  auto &entry = it->second;
+  entry.handles.insert(handle);
+  entry.lastUse = ++useCounter;
+  handles[handle] = {key, std::move(inputs)};
+  ++stats.hits;
+  symbol = entry.symbol;
+  return entry.unit.get();
+}
+
+const void *BindCache::insert(const void *handle, const std::string &key,
+                              UnitInputs inputs, std::string symbol) {
+  assert(nullptr != handle);
+  assert(0 == entries.count(key));
+  release(handle);
+  auto &entry = entries[key];
+  entry.unit = std::make_shared<const char>();
+  entry.symbol = std::move(symbol);
+  entry.handles.insert(handle);
+  entry.lastUse = ++useCounter;
+  handles[handle] = {key, std::move(inputs)};
+  ++stats.misses;
+  return entry.unit.get();
+}
+
+void BindCache::release(const void *handle) {
+  auto it = handles.find(handle);
+  if (handles.end() == it) {
+    return;
+  }
+  auto entry = entries.find(it->second.key);
+  assert(entries.end() != entry);
+  entry->second.handles.erase(handle);
+  handles.erase(it);
+}
+
+void BindCache::evict(JITContext &jit, std::size_t capacity) {
+  std::vector<std::pair<uint64_t, const std::string *>> unused;
+  for (auto &&entry : entries) {
+    if (entry.second.handles.empty()) {
+      unused.push_back({entry.second.lastUse, &entry.first});
+    }
+  }
+  if (unused.size() <= capacity) {
+    return;
+  }
+  std::sort(unused.begin(), unused.end());
+  unused.resize(unused.size() - capacity);
+  for (auto &&victim : unused) {
+    auto it = entries.find(*victim.second);
+    jit.removeUnit(it->second.unit.get());
+    entries.erase(it);
+    ++stats.evictions;
+  }
+}
+
+BindCacheStats BindCache::getStats() const {
+  auto ret = stats;
+  ret.entries = entries.size();
+  return ret;
+}
@@ -0,0 +1,83 @@
+//===-- bind_cache.h - jit support ------------------------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Jit runtime - memoization of the compiled bind specializations, bind
+// handles with equal payloads share the code.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "jit_context.h"
+
+// Must be synchronized with D source
+struct BindCacheStats final {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  uint64_t entries = 0;
+};
+
+/// Specializations are keyed on the generated IR (the original function with
+/// the parsed bound parameters) and reference counted by the bind handles
+/// using them. Unused ones are kept for reuse up to a capacity and evicted in
+/// least recently used order. The cache is a value type so that the state
+/// before a compilation can be restored if the compilation is discarded.
+class BindCache final {
+  struct Entry final {
+    // The address of the token is the id of the unit
+    std::shared_ptr<const char> unit;
+    std::string symbol;
+    std::unordered_set<const void *> handles;
+    uint64_t lastUse = 0;
+  };
+  std::unordered_map<std::string, Entry> entries;
+
+  struct Handle final {
+    std::string key;
+    UnitInputs inputs;
+  };
+  std::unordered_map<const void *, Handle> handles;
+
+  uint64_t useCounter = 0;
+  BindCacheStats stats;
+
+public:
+  /// Returns the inputs `handle` was compiled from or null.
+  const UnitInputs *getInputs(const void *handle) const;
+
+  /// Makes `handle` use the specialization for `key`. Returns the unit id of
+  /// the specialization and sets `symbol` to the name of the bind function,
+  /// or returns null if there is no such specialization.
+  const void *acquire(const void *handle, const std::string &key,
+                      UnitInputs inputs, std::string &symbol);
+
+  /// Adds a new specialization for `key` used by `handle` and returns the
+  /// unit id for its code.
+  const void *insert(const void *handle, const std::string &key,
+                     UnitInputs inputs, std::string symbol);
+
+  /// Detaches `handle` from its specialization, which becomes evictable if
+  /// no other handle uses it.
+  void release(const void *handle);
+
+  /// Removes the units of the least recently used unused specializations
+  /// until at most `capacity` of them are left. Their code is retired, as
+  /// other threads may still run it through the previous bind handle values.
+  void evict(JITContext &jit, std::size_t capacity);
+
+  BindCacheStats getStats() const;
+};
@@ -13,27 +13,38 @@
 //===----------------------------------------------------------------------===//
 
 #include <cassert>
+#include <cstring>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "bind.h"
+#include "bind_cache.h"
 #include "callback_ostream.h"
+#include "compile_stats.h"
 #include "context.h"
 #include "jit_context.h"
+#include "object_cache.h"
 #include "optimizer.h"
+#include "parallel_compile.h"
+#include "profile.h"
 #include "utils.h"
 
 #include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/Linker/Linker.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 
 namespace {
@@ -106,23 +117,18 @@ private:
     llvm::StringRef name;
     void **thunkVar;
     void *originalFunc;
+    const RtCompileModuleList *module;
   };
   std::vector<Func> funcs;
   mutable std::unordered_map<const void *, const Func *> funcsMap;
 
-  struct BindHandle final {
-    std::string name;
-    void *handle = nullptr;
-  };
-  std::vector<BindHandle> bindHandles;
-
 public:
   JitModuleInfo(const Context &context,
                 const RtCompileModuleList *modlist_head) {
     enumModules(modlist_head, context, [&](const RtCompileModuleList &current) {
       for (auto &&fun : toArray(current.funcList, static_cast<std::size_t>(
                                                       current.funcListSize))) {
-        funcs.push_back({fun.name, fun.func, fun.originalFunc});
+        funcs.push_back({fun.name, fun.func, fun.originalFunc, &current});
       }
     });
   }
@@ -147,17 +153,6 @@ public:
     }
     return nullptr;
   }
-
-  const std::vector<BindHandle> &getBindHandles() const { return bindHandles; }
-
-  void addBindHandle(llvm::StringRef name, void *handle) {
-    assert(!name.empty());
-    assert(handle != nullptr);
-    BindHandle h;
-    h.name = name.str();
-    h.handle = handle;
-    bindHandles.emplace_back(std::move(h));
-  }
 };
 
 void *resolveSymbol(llvm::JITSymbol &symbol) {
@@ -170,104 +165,100 @@ void *resolveSymbol(llvm::JITSymbol &symbol) {
   }
 }
 
-void generateBind(const Context &context, JITContext &jitContext,
-                  JitModuleInfo &moduleInfo, llvm::Module &module) {
-  auto getIrFunc = [&](const void *ptr) -> llvm::Function * {
-    assert(ptr != nullptr);
-    auto funcDesc = moduleInfo.getFunc(ptr);
-    if (funcDesc == nullptr) {
-      return nullptr;
-    }
-    return module.getFunction(funcDesc->name);
-  };
+JITContext &getJit() {
+  static JITContext jit;
+  return jit;
+}
 
-  std::unordered_map<const void *, llvm::Function *> bindFuncs;
-  bindFuncs.reserve(jitContext.getBindInstances().size() * 2);
-
-  auto genBind = [&](void *bindPtr, void *originalFunc, void *exampleFunc,
-                     const llvm::ArrayRef<ParamSlice> &params) {
-    assert(bindPtr != nullptr);
-    assert(bindFuncs.end() == bindFuncs.find(bindPtr));
-    auto funcToInline = getIrFunc(originalFunc);
-    if (funcToInline != nullptr) {
-      auto exampleIrFunc = getIrFunc(exampleFunc);
-      assert(exampleIrFunc != nullptr);
-      auto errhandler = [&](const std::string &str) { fatal(context, str); };
-      auto overrideHandler = [&](llvm::Type &type, const void *data,
-                                 size_t size) -> llvm::Constant * {
-        if (type.isPointerTy()) {
-          auto getBindFunc = [&]() {
-            auto handle = *static_cast<void *const *>(data);
-            return handle != nullptr && jitContext.hasBindFunction(handle)
-                       ? handle
-                       : nullptr;
-          };
-
-          auto ptype = llvm::cast<llvm::PointerType>(&type);
-          auto elemType = ptype->getElementType();
-          if (elemType->isFunctionTy()) {
-            (void)size;
-            assert(size == sizeof(void *));
-            auto val = *reinterpret_cast<void *const *>(data);
-            if (val != nullptr) {
-              auto ret = getIrFunc(val);
-              if (ret != nullptr && ret->getType() != &type) {
-                return llvm::ConstantExpr::getBitCast(ret, &type);
-              }
-              return ret;
-            }
-          } else if (auto handle = getBindFunc()) {
-            auto it = bindFuncs.find(handle);
-            assert(bindFuncs.end() != it);
-            auto bindIrFunc = it->second;
-            auto funcPtrType = bindIrFunc->getType();
-            auto globalVar1 = new llvm::GlobalVariable(
-                module, funcPtrType, true, llvm::GlobalValue::PrivateLinkage,
-                bindIrFunc, ".jit_bind_handle");
-            return llvm::ConstantExpr::getBitCast(globalVar1, &type);
-          }
-        }
-        return nullptr;
-      };
-      auto func =
-          bindParamsToFunc(module, *funcToInline, *exampleIrFunc, params,
-                           errhandler, BindOverride(overrideHandler));
-      moduleInfo.addBindHandle(func->getName(), bindPtr);
-      bindFuncs.insert({bindPtr, func});
-    } else {
-      fatal(context, "Bind: function body not available");
+// Serializes compilations (which may run in a background thread or, in lazy
+// mode, in any thread calling a function for the first time) and bind
+// registrations. Only taken through JitLock.
+std::mutex &getJitMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+// Set while this thread holds the jit mutex, e.g. in the handlers of a
+// compilation. A lazy function called there must not wait for the mutex.
+thread_local bool holdsJitMutex = false;
+
+// Holds the jit mutex. Lazy functions called while the jit was busy get new
+// stubs when it is released (see deferLazyFunction).
+class JitLock final {
+public:
+  JitLock() : owns(true) {
+    getJitMutex().lock();
+    holdsJitMutex = true;
+  }
+  explicit JitLock(std::try_to_lock_t) : owns(getJitMutex().try_lock()) {
+    if (owns) {
+      holdsJitMutex = true;
     }
+  }
+  ~JitLock();
+
+  JitLock(const JitLock &) = delete;
+  JitLock &operator=(const JitLock &) = delete;
+
+  bool ownsLock() const { return owns; }
+
+private:
+  bool owns;
+};
+
+// The initial thunk values, i.e. the statically compiled functions, recorded
+// when a function is seen for the first time.
+std::unordered_map<void **, void *> &getStaticFunctions() {
+  static std::unordered_map<void **, void *> functions;
+  return functions;
+}
+
+// Store sizes of the dynamicCompileConst variables of each jit module, known
+// after the module was parsed for the first time.
+std::unordered_map<const RtCompileModuleList *, std::vector<std::size_t>> &
+getVarSizes() {
+  static std::unordered_map<const RtCompileModuleList *,
+                            std::vector<std::size_t>>
+      sizes;
+  return sizes;
+}
+
+std::string getInputsSnapshot(const JITContext &jit,
+                              const OptimizerSettings &settings,
+                              const UnitInputs &inputs) {
+  std::string ret;
+  auto append = [&](const void *data, std::size_t size) {
+    ret.append(static_cast<const char *>(data), size);
   };
-  for (auto &&bind : jitContext.getBindInstances()) {
-    auto bindPtr = bind.first;
-    auto &bindDesc = bind.second;
-    assert(bindDesc.originalFunc != nullptr);
-    genBind(bindPtr, bindDesc.originalFunc, bindDesc.exampleFunc,
-            bindDesc.params);
-  }
-}
-
-void applyBind(const Context &context, JITContext &jitContext,
-               const JitModuleInfo &moduleInfo) {
-  auto &layout = jitContext.getDataLayout();
-  for (auto &elem : moduleInfo.getBindHandles()) {
-    auto decorated = decorate(elem.name, layout);
-    auto symbol = jitContext.findSymbol(decorated);
-    auto addr = resolveSymbol(symbol);
-    if (nullptr == addr) {
-      std::string desc = std::string("Symbol not found in jitted code: \"") +
-                         elem.name + "\" (\"" + decorated + "\")";
-      fatal(context, desc);
-    } else {
-      auto handle = static_cast<void **>(elem.handle);
-      *handle = addr;
+  ret += getSettingsKey(settings);
+  auto &varSizes = getVarSizes();
+  for (auto mod : inputs.modules) {
+    auto current = static_cast<const RtCompileModuleList *>(mod);
+    auto it = varSizes.find(current);
+    assert(varSizes.end() != it);
+    auto vars = toArray(current->varList,
+                        static_cast<std::size_t>(current->varListSize));
+    assert(vars.size() == it->second.size());
+    for (std::size_t i = 0; i < vars.size(); ++i) {
+      append(vars[i].init, it->second[i]);
     }
   }
+  for (auto bind : inputs.binds) {
+    const auto serial = jit.getBindSerial(bind);
+    append(&serial, sizeof(serial));
+  }
+  return ret;
 }
 
-JITContext &getJit() {
-  static JITContext jit;
-  return jit;
+bool isUpToDate(const JITContext &jit, const OptimizerSettings &settings,
+                const UnitInputs *inputs) {
+  return nullptr != inputs &&
+         getInputsSnapshot(jit, settings, *inputs) == inputs->snapshot;
+}
+
+BindCache &getBindCache() {
+  static BindCache cache;
+  return cache;
 }
 
 void setRtCompileVars(const Context &context, llvm::Module &module,
@@ -289,14 +280,25 @@ void dumpModule(const Context &context, const llvm::Module &module,
   }
 }
 
-void setFunctionsTarget(llvm::Module &module, const llvm::TargetMachine &TM) {
-  // Set function target cpu to host if it wasn't set explicitly
+void setFunctionsTarget(llvm::Module &module, const llvm::TargetMachine &TM,
+                        const OptimizerSettings &settings) {
+  // Set function target cpu to host if it wasn't set explicitly, the cpu and
+  // features from the settings override everything
+  const bool overrideCpu = !settings.targetCpu.empty();
+  const bool overrideFeatures = !settings.targetFeatures.empty();
   for (auto &&func : module.functions()) {
-    if (!func.hasFnAttribute("target-cpu")) {
+    if (overrideCpu) {
+      func.addFnAttr("target-cpu", settings.targetCpu);
+    } else if (!func.hasFnAttribute("target-cpu")) {
       func.addFnAttr("target-cpu", TM.getTargetCPU());
     }
 
-    if (!func.hasFnAttribute("target-features")) {
+    if (overrideFeatures) {
+      func.addFnAttr("target-features", settings.targetFeatures);
+    } else if (overrideCpu) {
+      // The host features may not be supported by the requested cpu
+      func.removeFnAttr("target-features");
+    } else if (!func.hasFnAttribute("target-features")) {
       auto featStr = TM.getTargetFeatureString();
       if (!featStr.empty()) {
         func.addFnAttr("target-features", featStr);
@@ -305,133 +307,1017 @@ void setFunctionsTarget(llvm::Module &module, const llvm::TargetMachine &TM) {
   }
 }
 
-struct JitFinaliser final {
+std::unique_ptr<llvm::Module> cloneModule(const llvm::Module &module) {
+#if LDC_LLVM_VER >= 700
+  return llvm::CloneModule(module);
+#else
+  return llvm::CloneModule(&module);
+#endif
+}
+
+// Prepares jit modules for compilation on demand, the prepared modules are
+// cloned into the units. The parsed modules are kept by the jit context, so
+// that later calls only redo the work depending on the settings and the
+// dynamicCompileConst values.
+class ModuleLoader final {
+  const Context &context;
   JITContext &jit;
-  bool finalized = false;
-  explicit JitFinaliser(JITContext &j) : jit(j) {}
-  ~JitFinaliser() {
-    if (!finalized) {
-      jit.reset();
+  const OptimizerSettings &settings;
+  CompileStats &stats;
+  std::unordered_map<const RtCompileModuleList *,
+                     std::unique_ptr<llvm::Module>>
+      modules;
+
+public:
+  ModuleLoader(const Context &c, JITContext &j, const OptimizerSettings &s,
+               CompileStats &st)
+      : context(c), jit(j), settings(s), stats(st) {}
+
+  const llvm::Module &get(const RtCompileModuleList &current) {
+    auto &ret = modules[&current];
+    if (nullptr == ret) {
+      ret = load(current);
     }
+    return *ret;
   }
 
-  void finalze() { finalized = true; }
-};
+private:
+  std::unique_ptr<llvm::Module> load(const RtCompileModuleList &current) {
+    const llvm::StringRef irData(current.irData,
+                                 static_cast<std::size_t>(current.irDataSize));
+    auto parsed = jit.getParsedModule(&current, irData);
+    if (nullptr == parsed) {
+      parsed = parse(current, irData);
+      if (nullptr == parsed) {
+        return nullptr;
+      }
+    } else {
+      interruptPoint(context, "Reuse parsed module",
+                     parsed->getName().data());
+    }
+    dumpModule(context, *parsed, DumpStage::OriginalModule);
 
-void rtCompileProcessImplSoInternal(const RtCompileModuleList *modlist_head,
-                                    const Context &context) {
-  if (nullptr == modlist_head) {
-    // No jit modules to compile
-    return;
+    std::unique_ptr<llvm::Module> module;
+    {
+      ScopedStage stage(stats, "Clone module", parsed->getName());
+      module = cloneModule(*parsed);
+    }
+    const auto name = module->getName();
+    setFunctionsTarget(*module, jit.getTargetMachine(), settings);
+
+    interruptPoint(context, "setRtCompileVars", name.data());
+    auto vars = toArray(current.varList,
+                        static_cast<std::size_t>(current.varListSize));
+    {
+      ScopedStage stage(stats, "setRtCompileVars", name);
+      setRtCompileVars(context, *module, vars);
+    }
+    return module;
   }
-  interruptPoint(context, "Init");
-  JITContext &myJit = getJit();
 
-  JitModuleInfo moduleInfo(context, modlist_head);
-  std::unique_ptr<llvm::Module> finalModule;
-  myJit.clearSymMap();
-  auto &layout = myJit.getDataLayout();
-  OptimizerSettings settings;
-  settings.optLevel = context.optLevel;
-  settings.sizeLevel = context.sizeLevel;
-  enumModules(modlist_head, context, [&](const RtCompileModuleList &current) {
+  // Parses and verifies a jit module, adds it to the jit context and returns
+  // it.
+  const llvm::Module *parse(const RtCompileModuleList &current,
+                            llvm::StringRef irData) {
     interruptPoint(context, "load IR");
-    auto buff = llvm::MemoryBuffer::getMemBuffer(
-        llvm::StringRef(current.irData,
-                        static_cast<std::size_t>(current.irDataSize)),
-        "", false);
+    auto buff = llvm::MemoryBuffer::getMemBuffer(irData, "", false);
     interruptPoint(context, "parse IR");
-    auto mod = llvm::parseBitcodeFile(*buff, myJit.getContext());
+    auto mod = [&]() {
+      ScopedStage stage(stats, "Parse IR");
+      return llvm::parseBitcodeFile(*buff, jit.getContext());
+    }();
     if (!mod) {
       fatal(context, "Unable to parse IR: " + llvm::toString(mod.takeError()));
-    } else {
-      llvm::Module &module = **mod;
-      const auto name = module.getName();
-      interruptPoint(context, "Verify module", name.data());
+      return nullptr;
+    }
+    llvm::Module &module = **mod;
+    const auto name = module.getName();
+    interruptPoint(context, "Verify module", name.data());
+    {
+      ScopedStage stage(stats, "Verify module", name);
       verifyModule(context, module);
+    }
 
-      dumpModule(context, module, DumpStage::OriginalModule);
-      setFunctionsTarget(module, myJit.getTargetMachine());
+    module.setDataLayout(jit.getTargetMachine().createDataLayout());
 
-      module.setDataLayout(myJit.getTargetMachine().createDataLayout());
+    auto vars = toArray(current.varList,
+                        static_cast<std::size_t>(current.varListSize));
+    auto &sizes = getVarSizes()[&current];
+    sizes.clear();
+    for (auto &&var : vars) {
+      auto gvar = module.getGlobalVariable(var.name, true);
+      sizes.push_back(nullptr == gvar ? 0
+                                      : module.getDataLayout().getTypeStoreSize(
+                                            gvar->getValueType()));
+    }
+    return &jit.addParsedModule(&current, irData, std::move(*mod));
+  }
+};
 
-      interruptPoint(context, "setRtCompileVars", name.data());
-      setRtCompileVars(context, module,
-                       toArray(current.varList,
-                               static_cast<std::size_t>(current.varListSize)));
+// Gives internal linkage to all functions defined in the unit except
+// `exported`, so that their code is private to the unit. Available externally
+// copies of the functions of other units are left alone.
+void internalizeFunctions(llvm::Module &module,
+                          llvm::function_ref<bool(llvm::Function &)> exported) {
+  for (auto &&func : module.functions()) {
+    if (func.isDeclaration() || func.hasLocalLinkage() ||
+        func.hasAvailableExternallyLinkage() || exported(func)) {
+      continue;
+    }
+    func.setComdat(nullptr);
+    func.setDLLStorageClass(llvm::GlobalValue::DefaultStorageClass);
+    func.setLinkage(llvm::GlobalValue::InternalLinkage);
+  }
+}
 
-      if (nullptr == finalModule) {
-        finalModule = std::move(*mod);
-      } else {
-        if (llvm::Linker::linkModules(*finalModule, std::move(*mod))) {
-          fatal(context, "Can't merge module");
+// Links available externally copies of the functions of other jit modules
+// called by the unit of jit module `current`, so that the optimizer can
+// inline them. Calls which aren't inlined still go through the thunks of the
+// callees. The unit must be recompiled along with the modules it inlines, they
+// are added to `inputs`.
+void linkCalleeModules(const Context &context, ModuleLoader &loader,
+                       const JitModuleInfo &moduleInfo, CompileStats &stats,
+                       const RtCompileModuleList &current, llvm::Module &module,
+                       UnitInputs &inputs) {
+  std::vector<const RtCompileModuleList *> callees;
+  for (auto &&fun : moduleInfo.functions()) {
+    if (fun.module == &current || fun.thunkVar == nullptr ||
+        llvm::find(callees, fun.module) != callees.end()) {
+      continue;
+    }
+    auto decl = module.getFunction(fun.name);
+    if (nullptr != decl && decl->isDeclaration()) {
+      callees.push_back(fun.module);
+    }
+  }
+
+  for (auto callee : callees) {
+    auto &source = loader.get(*callee);
+    ScopedStage stage(stats, "Link callee module", source.getName());
+    auto clone = cloneModule(source);
+    for (auto &&fun : moduleInfo.functions()) {
+      if (fun.module != callee || fun.thunkVar == nullptr) {
+        continue;
+      }
+      if (auto func = clone->getFunction(fun.name)) {
+        if (!func->isDeclaration()) {
+          func->setComdat(nullptr);
+          func->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
         }
       }
+    }
+    if (llvm::Linker::linkModules(module, std::move(clone),
+                                  llvm::Linker::Flags::LinkOnlyNeeded)) {
+      fatal(context, "Can't link callee module");
+      return;
+    }
+    inputs.modules.push_back(callee);
+  }
+}
+
+template <typename F>
+void withAsmListener(const Context &context, F &&fun) {
+  if (nullptr != context.dumpHandler) {
+    auto callback = [&](const char *str, size_t len) {
+      context.dumpHandler(context.dumpHandlerData, DumpStage::FinalAsm, str,
+                          len);
+    };
+
+    CallbackOstream os(callback);
+    fun(&os);
+  } else {
+    fun(nullptr);
+  }
+}
+
+void compileUnit(const Context &context, JITContext &jit,
+                 const OptimizerSettings &settings, CompileStats &stats,
+                 const void *id, UnitInputs inputs,
+                 std::unique_ptr<llvm::Module> module,
+                 const std::string &cacheKey) {
+  const auto name = module->getName().str();
+  interruptPoint(context, "Optimize module", name.c_str());
+  {
+    ScopedStage stage(stats, "Optimize", name);
+    optimizeModule(context, jit.getTargetMachine(), settings, *module);
+
+    interruptPoint(context, "Verify optimized module", name.c_str());
+    verifyModule(context, *module);
+  }
+
+  dumpModule(context, *module, DumpStage::OptimizedModule);
 
-      for (auto &&sym : toArray(current.symList, static_cast<std::size_t>(
-                                                     current.symListSize))) {
-        myJit.addSymbol(decorate(sym.name, layout), sym.sym);
+  interruptPoint(context, "Codegen module", name.c_str());
+  std::string object;
+  const bool copyObject = !cacheKey.empty() || stats.codeSizesEnabled();
+  {
+    ScopedStage stage(stats, "Codegen", name);
+    withAsmListener(context, [&](llvm::raw_ostream *os) {
+      if (auto err = jit.addUnit(id, std::move(inputs), std::move(module), os,
+                                 copyObject ? &object : nullptr)) {
+        fatal(context,
+              "Can't codegen module: " + llvm::toString(std::move(err)));
       }
+    });
+  }
+  stats.addCodeSizes(object);
+
+  if (!cacheKey.empty() && !object.empty()) {
+    interruptPoint(context, "Store cached object", cacheKey.c_str());
+    storeCachedObject(context.cacheDir, cacheKey, object);
+  }
+}
+
+void addUnitObject(const Context &context, JITContext &jit,
+                   CompileStats &stats, const void *id, UnitInputs inputs,
+                   std::unique_ptr<llvm::MemoryBuffer> object) {
+  stats.addCodeSizes(object->getBuffer());
+  ScopedStage stage(stats, "Load object", object->getBufferIdentifier());
+  withAsmListener(context, [&](llvm::raw_ostream *os) {
+    if (auto err =
+            jit.addUnitObject(id, std::move(inputs), std::move(object), os)) {
+      fatal(context, "Can't load object: " + llvm::toString(std::move(err)));
     }
   });
+}
 
-  assert(nullptr != finalModule);
+void *resolveUnitSymbol(const Context &context, JITContext &jit,
+                        const void *unitId, llvm::StringRef name) {
+  auto decorated = decorate(name.str(), jit.getDataLayout());
+  auto symbol = jit.findSymbol(unitId, decorated);
+  auto addr = resolveSymbol(symbol);
+  if (nullptr == addr) {
+    std::string desc = std::string("Symbol not found in jitted code: \"") +
+                       name.str() + "\" (\"" + decorated + "\")";
+    fatal(context, desc);
+  }
+  return addr;
+}
 
-  interruptPoint(context, "Generate bind functions");
-  generateBind(context, myJit, moduleInfo, *finalModule);
-  dumpModule(context, *finalModule, DumpStage::MergedModule);
-  interruptPoint(context, "Optimize final module");
-  optimizeModule(context, myJit.getTargetMachine(), settings, *finalModule);
+// New values of the thunk variables and bind handles, they are only updated
+// once all units have been compiled.
+using PointerUpdates = std::vector<std::pair<void **, void *>>;
 
-  interruptPoint(context, "Verify final module");
-  verifyModule(context, *finalModule);
+// Compiles the units of a compilation. Units are compiled immediately unless
+// context.compileThreads is greater than 1, then they are optimized and
+// compiled on that many threads in finish(). The symbols of the units are
+// resolved once all of them have been compiled.
+class UnitCompiler final {
+  const Context &context;
+  JITContext &jit;
+  const OptimizerSettings &settings;
+  CompileStats &stats;
 
-  dumpModule(context, *finalModule, DumpStage::OptimizedModule);
+  struct Job final {
+    const void *id;
+    UnitInputs inputs;
+    std::string name;
+    std::string cacheKey;
+  };
+  std::vector<Job> jobs;
+  std::vector<CodegenJob> codegenJobs;
 
-  interruptPoint(context, "Codegen final module");
-  if (nullptr != context.dumpHandler) {
-    auto callback = [&](const char *str, size_t len) {
-      context.dumpHandler(context.dumpHandlerData, DumpStage::FinalAsm, str,
-                          len);
-    };
+  struct Symbol final {
+    void **ptr;
+    const void *unitId;
+    std::string name;
+    bool report;
+  };
+  std::vector<Symbol> symbols;
 
-    CallbackOstream os(callback);
-    if (auto err = myJit.addModule(std::move(finalModule), &os)) {
-      fatal(context, "Can't codegen module: " + llvm::toString(std::move(err)));
+public:
+  UnitCompiler(const Context &c, JITContext &j, const OptimizerSettings &s,
+               CompileStats &st)
+      : context(c), jit(j), settings(s), stats(st) {}
+
+  /// Compiles `module` as unit `id`. Code which must not be reused by other
+  /// processes (e.g. referring to addresses of this one) isn't `cacheable`.
+  void add(const void *id, UnitInputs inputs,
+           std::unique_ptr<llvm::Module> module, bool cacheable = true) {
+    assert(nullptr != module);
+    inputs.snapshot = getInputsSnapshot(jit, settings, inputs);
+    dumpModule(context, *module, DumpStage::MergedModule);
+
+    std::string cacheKey;
+    if (cacheable && nullptr != context.cacheDir) {
+      interruptPoint(context, "Lookup cached object",
+                     module->getName().data());
+      std::unique_ptr<llvm::MemoryBuffer> object;
+      {
+        ScopedStage stage(stats, "Lookup cached object", module->getName());
+        cacheKey =
+            calculateObjectKey(jit.getTargetMachine(), settings, *module);
+        object = loadCachedObject(context.cacheDir, cacheKey);
+      }
+      if (nullptr != object) {
+        interruptPoint(context, "Load cached object", cacheKey.c_str());
+        addUnitObject(context, jit, stats, id, std::move(inputs),
+                      std::move(object));
+        return;
+      }
     }
-  } else {
-    if (auto err = myJit.addModule(std::move(finalModule), nullptr)) {
-      fatal(context, "Can't codegen module: " + llvm::toString(std::move(err)));
+
+    if (context.compileThreads <= 1) {
+      compileUnit(context, jit, settings, stats, id, std::move(inputs),
+                  std::move(module), cacheKey);
+      return;
+    }
+
+    interruptPoint(context, "Queue module", module->getName().data());
+    CodegenJob codegenJob;
+    {
+      ScopedStage stage(stats, "Write bitcode", module->getName());
+      llvm::raw_string_ostream os(codegenJob.bitcode);
+#if LDC_LLVM_VER >= 700
+      llvm::WriteBitcodeToFile(*module, os);
+#else
+      llvm::WriteBitcodeToFile(module.get(), os);
+#endif
+    }
+    codegenJob.printOptimized = nullptr != context.dumpHandler;
+    codegenJobs.push_back(std::move(codegenJob));
+    jobs.push_back({id, std::move(inputs), module->getName().str(),
+                    std::move(cacheKey)});
+  }
+
+  /// Sets `ptr` to symbol `name` of unit `unitId` in finish().
+  void resolve(void **ptr, const void *unitId, llvm::StringRef name,
+               bool report) {
+    symbols.push_back({ptr, unitId, name.str(), report});
+  }
+
+  void finish(PointerUpdates &updates) {
+    if (!jobs.empty()) {
+      interruptPoint(context, "Optimize and codegen modules in parallel");
+      runCodegenJobs(settings, codegenJobs, context.compileThreads,
+                     stats.enabled(), stats.getOrigin());
+      for (std::size_t i = 0; i < jobs.size(); ++i) {
+        auto &job = jobs[i];
+        auto &codegenJob = codegenJobs[i];
+        for (auto &&record : codegenJob.stages) {
+          stats.addStage(std::move(record));
+        }
+        if (!codegenJob.error.empty()) {
+          fatal(context, codegenJob.error);
+          return;
+        }
+        if (nullptr != context.dumpHandler) {
+          context.dumpHandler(context.dumpHandlerData,
+                              DumpStage::OptimizedModule,
+                              codegenJob.optimizedIR.data(),
+                              codegenJob.optimizedIR.size());
+        }
+        interruptPoint(context, "Load object", job.name.c_str());
+        addUnitObject(
+            context, jit, stats, job.id, std::move(job.inputs),
+            llvm::MemoryBuffer::getMemBufferCopy(codegenJob.object, job.name));
+        if (!job.cacheKey.empty()) {
+          interruptPoint(context, "Store cached object", job.cacheKey.c_str());
+          storeCachedObject(context.cacheDir, job.cacheKey, codegenJob.object);
+        }
+      }
+      jobs.clear();
+      codegenJobs.clear();
+    }
+
+    interruptPoint(context, "Resolve functions");
+    ScopedStage stage(stats, "Resolve symbols");
+    for (auto &&sym : symbols) {
+      auto addr = resolveUnitSymbol(context, jit, sym.unitId, sym.name);
+      updates.push_back({sym.ptr, addr});
+
+      if (sym.report && nullptr != context.interruptPointHandler) {
+        std::stringstream ss;
+        ss << sym.name << " to " << addr;
+        auto str = ss.str();
+        interruptPoint(context, "Resolved", str.c_str());
+      }
+    }
+    symbols.clear();
+  }
+};
+
+// A jit module in lazy mode, its functions are compiled into units of their
+// own when they are called for the first time.
+struct LazyModule final {
+  // Prepared with the dynamicCompileConst values of the compileDynamicCode
+  // call, null if the module is no longer lazy.
+  std::unique_ptr<llvm::Module> module;
+  UnitInputs inputs;
+  OptimizerSettings settings;
+  std::string cacheDir;
+  std::vector<const void *> functionUnits;
+};
+
+std::unordered_map<const RtCompileModuleList *, LazyModule> &getLazyModules() {
+  static std::unordered_map<const RtCompileModuleList *, LazyModule> modules;
+  return modules;
+}
+
+// Changes of the lazy modules, applied once all units have been compiled.
+using LazyModuleUpdates =
+    std::vector<std::pair<const RtCompileModuleList *, LazyModule>>;
+
+void removeUnusedFunctions(llvm::Module &module) {
+  llvm::legacy::PassManager mpm;
+  mpm.add(llvm::createGlobalDCEPass());
+  mpm.run(module);
+}
+
+// A function in lazy mode as seen by its stub.
+struct LazyFunction final {
+  const RtCompileModuleList *module;
+  std::string name;
+  void **thunkVar;
+  void *staticFunc;
+  void *stub;
+};
+
+// Lazy functions which were called while the jit was busy, they run their
+// statically compiled version until they get new stubs.
+std::vector<std::shared_ptr<LazyFunction>> &getDeferredFunctions() {
+  static std::vector<std::shared_ptr<LazyFunction>> functions;
+  return functions;
+}
+
+std::mutex &getDeferredMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+void *compileLazyFunction(const std::shared_ptr<LazyFunction> &fun);
+
+llvm::Expected<void *> createLazyStub(JITContext &jit,
+                                      const RtCompileModuleList *module,
+                                      const std::string &name, void **thunkVar,
+                                      void *staticFunc) {
+  auto fun = std::make_shared<LazyFunction>(
+      LazyFunction{module, name, thunkVar, staticFunc, nullptr});
+  auto stub = jit.createLazyCallback([fun]() {
+    return compileLazyFunction(fun);
+  });
+  if (stub) {
+    // Published after this, so the stub sees it
+    fun->stub = *stub;
+  }
+  return stub;
+}
+
+// Called instead of compiling a lazy function while the jit is busy (another
+// compilation is running or the function is called from one of its handlers).
+// Points the thunk to the statically compiled function, the function gets a
+// new stub when the jit is released.
+void *deferLazyFunction(const std::shared_ptr<LazyFunction> &fun) {
+  // Fails if the thunk was changed meanwhile, e.g. by a compilation which
+  // replaced the stub
+  if (replacePointer(fun->thunkVar, fun->stub, fun->staticFunc)) {
+    {
+      std::lock_guard<std::mutex> lock(getDeferredMutex());
+      getDeferredFunctions().push_back(fun);
+    }
+    if (!holdsJitMutex) {
+      // The jit may have been released before the function was queued, its
+      // release creates the new stubs then
+      JitLock lock(std::try_to_lock);
     }
   }
+  return fun->staticFunc;
+}
 
-  JitFinaliser jitFinalizer(myJit);
-  interruptPoint(context, "Resolve functions");
+// Creates new stubs for the deferred functions which are still lazy.
+void rearmDeferredFunctions() {
+  JITContext &jit = getJit();
+  auto &lazyModules = getLazyModules();
+  for (auto &&fun : getDeferredFunctions()) {
+    if (loadPointer(fun->thunkVar) != fun->staticFunc) {
+      continue;
+    }
+    auto it = lazyModules.find(fun->module);
+    if (lazyModules.end() == it ||
+        llvm::find(it->second.functionUnits, fun->thunkVar) !=
+            it->second.functionUnits.end()) {
+      continue;
+    }
+    auto stub = createLazyStub(jit, fun->module, fun->name, fun->thunkVar,
+                               fun->staticFunc);
+    if (!stub) {
+      // Keeps running the statically compiled function
+      consumeError(stub.takeError());
+      continue;
+    }
+    publishPointer(fun->thunkVar, *stub);
+  }
+  getDeferredFunctions().clear();
+}
+
+JitLock::~JitLock() {
+  if (!owns) {
+    return;
+  }
+  // deferLazyFunction queues a function before it tries to lock the jit, so
+  // holding the deferred mutex until the jit is unlocked misses none of them.
+  std::lock_guard<std::mutex> lock(getDeferredMutex());
+  rearmDeferredFunctions();
+  holdsJitMutex = false;
+  getJitMutex().unlock();
+}
+
+// Called from the stub of a function in lazy mode, compiles the function and
+// everything it needs from its module and returns its address. The handlers
+// of the compileDynamicCode call are gone at this point, errors are fatal.
+// Doesn't wait for the jit if it is busy, see deferLazyFunction.
+void *compileLazyFunction(const std::shared_ptr<LazyFunction> &fun) {
+  if (holdsJitMutex) {
+    return deferLazyFunction(fun);
+  }
+  JitLock lock(std::try_to_lock);
+  if (!lock.ownsLock()) {
+    return deferLazyFunction(fun);
+  }
+  void **thunkVar = fun->thunkVar;
+  JITContext &jit = getJit();
+  auto &lazyModules = getLazyModules();
+  auto it = lazyModules.find(fun->module);
+  if (lazyModules.end() == it ||
+      llvm::find(it->second.functionUnits, thunkVar) !=
+          it->second.functionUnits.end()) {
+    // Compiled eagerly or by another call of the stub in the meantime
+    return loadPointer(thunkVar);
+  }
+  auto &lazy = it->second;
+
+  Context context;
+  context.optLevel = lazy.settings.optLevel;
+  context.sizeLevel = lazy.settings.sizeLevel;
+  context.cacheDir = lazy.cacheDir.empty() ? nullptr : lazy.cacheDir.c_str();
+
+  auto module = cloneModule(*lazy.module);
+  internalizeFunctions(*module, [&](llvm::Function &func) {
+    return func.getName() == fun->name;
+  });
+  removeUnusedFunctions(*module);
+  CompileStats stats(context);
+  UnitCompiler compiler(context, jit, lazy.settings, stats);
+  compiler.add(thunkVar, lazy.inputs, std::move(module));
+
+  auto addr = resolveUnitSymbol(context, jit, thunkVar, fun->name);
+  publishPointer(thunkVar, addr);
+  jit.commitUnits();
+  lazy.functionUnits.push_back(thunkVar);
+  return addr;
+}
+
+// Prepares a jit module for lazy compilation unless it is up to date and
+// records stubs as the new thunk values.
+void updateLazyModule(const Context &context, JITContext &jit,
+                      ModuleLoader &loader, const JitModuleInfo &moduleInfo,
+                      const OptimizerSettings &settings, CompileStats &stats,
+                      const RtCompileModuleList &current,
+                      PointerUpdates &updates, LazyModuleUpdates &lazyUpdates) {
+  auto &lazyModules = getLazyModules();
+  auto it = lazyModules.find(&current);
+  if (lazyModules.end() != it &&
+      getInputsSnapshot(jit, settings, it->second.inputs) ==
+          it->second.inputs.snapshot) {
+    interruptPoint(context, "Module is up to date");
+    return;
+  }
+
+  LazyModule lazy;
+  lazy.module = cloneModule(loader.get(current));
+  lazy.inputs.modules.push_back(&current);
+  linkCalleeModules(context, loader, moduleInfo, stats, current, *lazy.module,
+                    lazy.inputs);
+  lazy.inputs.snapshot = getInputsSnapshot(jit, settings, lazy.inputs);
+  lazy.settings = settings;
+  if (nullptr != context.cacheDir) {
+    lazy.cacheDir = context.cacheDir;
+  }
+
+  interruptPoint(context, "Create stubs");
   for (auto &&fun : moduleInfo.functions()) {
-    if (fun.thunkVar == nullptr) {
+    if (fun.module != &current || fun.thunkVar == nullptr) {
       continue;
     }
-    auto decorated = decorate(fun.name, layout);
-    auto symbol = myJit.findSymbol(decorated);
-    auto addr = resolveSymbol(symbol);
-    if (nullptr == addr) {
-      std::string desc = std::string("Symbol not found in jitted code: \"") +
-                         fun.name.data() + "\" (\"" + decorated + "\")";
-      fatal(context, desc);
+    auto stub = createLazyStub(jit, &current, fun.name.str(), fun.thunkVar,
+                               getStaticFunctions().at(fun.thunkVar));
+    if (!stub) {
+      fatal(context, "Can't create lazy compilation stub: " +
+                         llvm::toString(stub.takeError()));
+      return;
+    }
+    updates.push_back({fun.thunkVar, *stub});
+    interruptPoint(context, "Created stub", fun.name.data());
+  }
+  lazyUpdates.push_back({&current, std::move(lazy)});
+}
+
+void applyLazyModuleUpdates(JITContext &jit, LazyModuleUpdates &lazyUpdates) {
+  auto &lazyModules = getLazyModules();
+  for (auto &&update : lazyUpdates) {
+    auto it = lazyModules.find(update.first);
+    if (lazyModules.end() != it) {
+      for (auto id : it->second.functionUnits) {
+        jit.removeUnit(id);
+      }
+      lazyModules.erase(it);
+    }
+    if (nullptr != update.second.module) {
+      // Replaces the code compiled eagerly by a previous call
+      jit.removeUnit(update.first);
+      lazyModules.insert({update.first, std::move(update.second)});
+    }
+  }
+}
+
+std::unordered_map<const RtCompileModuleList *, ModuleProfile> &
+getModuleProfiles() {
+  static std::unordered_map<const RtCompileModuleList *, ModuleProfile>
+      profiles;
+  return profiles;
+}
+
+// Instruments the functions of a module in tiered mode, functions which got
+// hot since are compiled with their profile instead.
+void prepareTieredModule(const Context &context,
+                         const JitModuleInfo &moduleInfo,
+                         const RtCompileModuleList &current,
+                         ModuleProfile &profile, llvm::Module &module) {
+  // Indirect call targets are known by the addresses of the AOT thunks and
+  // symbols
+  std::unordered_map<const void *, std::string> targets;
+  for (auto &&sym : toArray(current.symList,
+                            static_cast<std::size_t>(current.symListSize))) {
+    targets.insert({sym.sym, sym.name});
+  }
+  for (auto &&fun : moduleInfo.functions()) {
+    if (fun.module == &current) {
+      targets[fun.originalFunc] = fun.name.str();
+    }
+  }
+  auto resolveTarget = [&](const void *addr) -> llvm::Function * {
+    auto it = targets.find(addr);
+    return targets.end() != it ? module.getFunction(it->second) : nullptr;
+  };
+  auto onHot = [&](llvm::Function &func) {
+    interruptPoint(context, "Hot function", func.getName().data());
+  };
+
+  interruptPoint(context, "Instrument module", module.getName().data());
+  profile.prepareModule(module, context.tieredThreshold, resolveTarget, onHot);
+}
+
+// Compiles the functions of a jit module unless the unit is up to date and
+// records the new thunk values.
+void updateModuleUnit(const Context &context, JITContext &jit,
+                      ModuleLoader &loader, const JitModuleInfo &moduleInfo,
+                      const OptimizerSettings &settings, CompileStats &stats,
+                      const RtCompileModuleList &current,
+                      UnitCompiler &compiler, LazyModuleUpdates &lazyUpdates) {
+  const bool wasLazy = getLazyModules().count(&current) != 0;
+  const bool tiered = 0 != context.tieredThreshold;
+  std::string tiers;
+  if (tiered) {
+    tiers = getModuleProfiles()[&current].getTiers(context.tieredThreshold);
+  }
+  auto unitInputs = jit.getUnitInputs(&current);
+  if (!wasLazy && isUpToDate(jit, settings, unitInputs) &&
+      unitInputs->tiers == tiers) {
+    interruptPoint(context, "Module is up to date");
+    return;
+  }
+  if (wasLazy) {
+    // Retire the code of the lazy mode once the thunks have been updated
+    lazyUpdates.push_back({&current, LazyModule()});
+  }
+
+  auto module = cloneModule(loader.get(current));
+  UnitInputs inputs;
+  inputs.modules.push_back(&current);
+  if (tiered) {
+    auto &profile = getModuleProfiles()[&current];
+    ScopedStage stage(stats, "Instrument module", module->getName());
+    prepareTieredModule(context, moduleInfo, current, profile, *module);
+    inputs.tiers = profile.getTiers(context.tieredThreshold);
+  }
+  // After the instrumentation, the profiles are per module
+  linkCalleeModules(context, loader, moduleInfo, stats, current, *module,
+                    inputs);
+
+  std::unordered_set<std::string> exported;
+  for (auto &&fun : moduleInfo.functions()) {
+    if (fun.module == &current && fun.thunkVar != nullptr) {
+      exported.insert(fun.name.str());
+    }
+  }
+  internalizeFunctions(*module, [&](llvm::Function &func) {
+    return exported.count(func.getName().str()) != 0;
+  });
+  // Instrumented code refers to the counters of this process
+  compiler.add(&current, std::move(inputs), std::move(module), !tiered);
+
+  for (auto &&fun : moduleInfo.functions()) {
+    if (fun.module == &current && fun.thunkVar != nullptr) {
+      compiler.resolve(fun.thunkVar, &current, fun.name, true);
+    }
+  }
+}
+
+// Generates a bind specialization (and the nested binds it calls) into a
+// module of its own, linked from the jit modules providing the functions.
+class BindGenerator final {
+  const Context &context;
+  JITContext &jit;
+  ModuleLoader &loader;
+  const JitModuleInfo &moduleInfo;
+  CompileStats &stats;
+  std::unique_ptr<llvm::Module> module;
+  UnitInputs inputs;
+  std::unordered_map<const void *, llvm::Function *> bindFuncs;
+
+public:
+  BindGenerator(const Context &c, JITContext &j, ModuleLoader &l,
+                const JitModuleInfo &m, CompileStats &s)
+      : context(c), jit(j), loader(l), moduleInfo(m), stats(s) {}
+
+  llvm::Function *generate(void *bindPtr) {
+    // Link all modules the bind may refer to first, linking replaces
+    // declarations and would invalidate the functions being generated.
+    collectInputs(bindPtr);
+    for (auto mod : inputs.modules) {
+      auto current = static_cast<const RtCompileModuleList *>(mod);
+      auto &source = loader.get(*current);
+      ScopedStage stage(stats, "Link module", source.getName());
+      auto clone = cloneModule(source);
+      if (nullptr == module) {
+        module = std::move(clone);
+      } else if (llvm::Linker::linkModules(*module, std::move(clone))) {
+        fatal(context, "Can't merge module");
+      }
+    }
+    ScopedStage stage(stats, "Generate bind");
+    return genBind(bindPtr);
+  }
+
+  std::unique_ptr<llvm::Module> takeModule() { return std::move(module); }
+  UnitInputs takeInputs() { return std::move(inputs); }
+
+private:
+  void addModule(const void *func) {
+    auto funcDesc = moduleInfo.getFunc(func);
+    if (funcDesc != nullptr &&
+        llvm::find(inputs.modules, funcDesc->module) == inputs.modules.end()) {
+      inputs.modules.push_back(funcDesc->module);
+    }
+  }
+
+  // Conservatively treats any pointer-sized value in the bound parameters as
+  // a function or a nested bind handle.
+  void collectInputs(void *bindPtr) {
+    if (llvm::find(inputs.binds, bindPtr) != inputs.binds.end()) {
+      return;
+    }
+    inputs.binds.push_back(bindPtr);
+    auto &bindDesc = jit.getBindInstances().find(bindPtr)->second;
+    addModule(bindDesc.originalFunc);
+    addModule(bindDesc.exampleFunc);
+    for (auto &&param : bindDesc.params) {
+      if (param.data == nullptr) {
+        continue;
+      }
+      for (std::size_t offset = 0; offset + sizeof(void *) <= param.size;
+           offset += sizeof(void *)) {
+        void *val;
+        std::memcpy(&val, static_cast<const char *>(param.data) + offset,
+                    sizeof(val));
+        if (val == nullptr) {
+          continue;
+        }
+        addModule(val);
+        if (jit.hasBindFunction(val)) {
+          collectInputs(val);
+        }
+      }
+    }
+  }
+
+  llvm::Function *getIrFunc(const void *ptr) {
+    assert(ptr != nullptr);
+    auto funcDesc = moduleInfo.getFunc(ptr);
+    if (funcDesc == nullptr) {
+      return nullptr;
+    }
+    assert(llvm::find(inputs.modules, funcDesc->module) !=
+           inputs.modules.end());
+    return module->getFunction(funcDesc->name);
+  }
+
+  llvm::Function *genBind(void *bindPtr) {
+    auto it = bindFuncs.find(bindPtr);
+    if (bindFuncs.end() != it) {
+      return it->second;
+    }
+    auto &bindDesc = jit.getBindInstances().find(bindPtr)->second;
+    assert(bindDesc.originalFunc != nullptr);
+    auto funcToInline = getIrFunc(bindDesc.originalFunc);
+    if (funcToInline == nullptr) {
+      fatal(context, "Bind: function body not available");
+      return nullptr;
+    }
+    auto exampleIrFunc = getIrFunc(bindDesc.exampleFunc);
+    assert(exampleIrFunc != nullptr);
+    auto errhandler = [&](const std::string &str) { fatal(context, str); };
+    auto overrideHandler = [&](llvm::Type &type, const void *data,
+                               size_t size) -> llvm::Constant * {
+      if (type.isPointerTy()) {
+        auto getBindFunc = [&]() {
+          auto handle = *static_cast<void *const *>(data);
+          return handle != nullptr && jit.hasBindFunction(handle) ? handle
+                                                                  : nullptr;
+        };
+
+        auto ptype = llvm::cast<llvm::PointerType>(&type);
+        auto elemType = ptype->getElementType();
+        if (elemType->isFunctionTy()) {
+          (void)size;
+          assert(size == sizeof(void *));
+          auto val = *reinterpret_cast<void *const *>(data);
+          if (val != nullptr) {
+            auto ret = getIrFunc(val);
+            if (ret != nullptr && ret->getType() != &type) {
+              return llvm::ConstantExpr::getBitCast(ret, &type);
+            }
+            return ret;
+          }
+        } else if (auto handle = getBindFunc()) {
+          auto bindIrFunc = genBind(handle);
+          auto funcPtrType = bindIrFunc->getType();
+          auto globalVar1 = new llvm::GlobalVariable(
+              *module, funcPtrType, true, llvm::GlobalValue::PrivateLinkage,
+              bindIrFunc, ".jit_bind_handle");
+          return llvm::ConstantExpr::getBitCast(globalVar1, &type);
+        }
+      }
+      return nullptr;
+    };
+    auto func = bindParamsToFunc(*module, *funcToInline, *exampleIrFunc,
+                                 bindDesc.params, errhandler,
+                                 BindOverride(overrideHandler));
+    bindFuncs.insert({bindPtr, func});
+    return func;
+  }
+};
+
+// Updates a bind handle unless it is up to date: its specialization is
+// generated and compiled unless the bind cache already has the code for an
+// equal one. Records the new bind handle value.
+void updateBindUnit(const Context &context, JITContext &jit,
+                    ModuleLoader &loader, const JitModuleInfo &moduleInfo,
+                    const OptimizerSettings &settings, CompileStats &stats,
+                    BindCache &bindCache, void *bindPtr,
+                    UnitCompiler &compiler) {
+  if (isUpToDate(jit, settings, bindCache.getInputs(bindPtr))) {
+    interruptPoint(context, "Bind is up to date");
+    return;
+  }
+
+  BindGenerator generator(context, jit, loader, moduleInfo, stats);
+  auto func = generator.generate(bindPtr);
+  auto name = func->getName().str();
+  auto module = generator.takeModule();
+  internalizeFunctions(*module,
+                       [&](llvm::Function &f) { return &f == func; });
+
+  // The generated IR contains the parsed values of the bound parameters and
+  // of the dynamicCompileConst variables, equal IR means equal code.
+  auto key = calculateObjectKey(jit.getTargetMachine(), settings, *module);
+  auto inputs = generator.takeInputs();
+  inputs.snapshot = getInputsSnapshot(jit, settings, inputs);
+  if (auto unit = bindCache.acquire(bindPtr, key, inputs, name)) {
+    interruptPoint(context, "Bind cache hit", name.c_str());
+    compiler.resolve(static_cast<void **>(bindPtr), unit, name, false);
+    return;
+  }
+
+  interruptPoint(context, "Bind cache miss", name.c_str());
+  auto unit = bindCache.insert(bindPtr, key, inputs, name);
+  compiler.add(unit, std::move(inputs), std::move(module));
+  compiler.resolve(static_cast<void **>(bindPtr), unit, name, false);
+}
+
+struct JitFinaliser final {
+  JITContext &jit;
+  BindCache &bindCache;
+  BindCache bindCacheBackup;
+  bool finalized = false;
+  JitFinaliser(JITContext &j, BindCache &b)
+      : jit(j), bindCache(b), bindCacheBackup(b) {}
+  ~JitFinaliser() {
+    if (!finalized) {
+      jit.discardPendingUnits();
+      bindCache = std::move(bindCacheBackup);
+    }
+  }
+
+  void finalze() { finalized = true; }
+};
+
+void rtCompileProcessImplSoInternal(const RtCompileModuleList *modlist_head,
+                                    const Context &context) {
+  if (nullptr == modlist_head) {
+    // No jit modules to compile
+    return;
+  }
+  interruptPoint(context, "Init");
+  JITContext &myJit = getJit();
+  CompileStats stats(context);
+  ScopedStage totalStage(stats, "Compile");
+
+  JitModuleInfo moduleInfo(context, modlist_head);
+  auto &staticFunctions = getStaticFunctions();
+  for (auto &&fun : moduleInfo.functions()) {
+    if (fun.thunkVar != nullptr) {
+      staticFunctions.insert({fun.thunkVar, loadPointer(fun.thunkVar)});
+    }
+  }
+  const auto settings = getOptimizerSettings(context);
+  ModuleLoader loader(context, myJit, settings, stats);
+  myJit.clearSymMap();
+  auto &layout = myJit.getDataLayout();
+  enumModules(modlist_head, context, [&](const RtCompileModuleList &current) {
+    for (auto &&sym : toArray(current.symList,
+                              static_cast<std::size_t>(current.symListSize))) {
+      myJit.addSymbol(decorate(sym.name, layout), sym.sym);
+    }
+  });
+
+  // Only units whose inputs changed since the last call are recompiled, the
+  // code and thunks of the others stay untouched.
+  BindCache &bindCache = getBindCache();
+  JitFinaliser jitFinalizer(myJit, bindCache);
+  UnitCompiler compiler(context, myJit, settings, stats);
+  PointerUpdates updates;
+  LazyModuleUpdates lazyUpdates;
+  bool cancelled = false;
+  auto checkCancelled = [&]() {
+    cancelled = cancelled || isCancelled(context);
+    return cancelled;
+  };
+  enumModules(modlist_head, context, [&](const RtCompileModuleList &current) {
+    if (checkCancelled()) {
+      return;
+    }
+    if (context.lazyCompile) {
+      updateLazyModule(context, myJit, loader, moduleInfo, settings, stats,
+                       current, updates, lazyUpdates);
     } else {
-      *fun.thunkVar = addr;
+      updateModuleUnit(context, myJit, loader, moduleInfo, settings, stats,
+                       current, compiler, lazyUpdates);
     }
+  });
+
+  interruptPoint(context, "Generate bind functions");
+  for (auto &&bind : myJit.getBindInstances()) {
+    if (checkCancelled()) {
+      break;
+    }
+    updateBindUnit(context, myJit, loader, moduleInfo, settings, stats,
+                   bindCache, bind.first, compiler);
+  }
 
-    if (nullptr != context.interruptPointHandler) {
-      std::stringstream ss;
-      ss << fun.name.data() << " to " << addr;
-      auto str = ss.str();
-      interruptPoint(context, "Resolved", str.c_str());
+  if (!checkCancelled()) {
+    compiler.finish(updates);
+  }
+
+  if (checkCancelled()) {
+    // The finalizer discards the new code
+    interruptPoint(context, "Compilation cancelled");
+    return;
+  }
+
+  // Other threads may be running the previous code (or the static fallback
+  // of the thunks), switch them over before it is retired. It is only freed
+  // by freeRetiredDynamicCode(), once they can't run it anymore.
+  interruptPoint(context, "Update thunks and bind handles");
+  {
+    ScopedStage stage(stats, "Update thunks");
+    for (auto &&update : updates) {
+      publishPointer(update.first, update.second);
     }
+    myJit.commitUnits();
+    applyLazyModuleUpdates(myJit, lazyUpdates);
   }
-  interruptPoint(context, "Update bind handles");
-  applyBind(context, myJit, moduleInfo);
+  bindCache.evict(myJit, context.bindCacheSize);
   jitFinalizer.finalze();
+
+  if (nullptr != context.interruptPointHandler) {
+    const auto stats = bindCache.getStats();
+    std::stringstream ss;
+    ss << "hits " << stats.hits << " misses " << stats.misses << " evictions "
+       << stats.evictions << " entries " << stats.entries;
+    auto str = ss.str();
+    interruptPoint(context, "Bind cache", str.c_str());
+  }
 }
 
 } // anon namespace
@@ -441,6 +1327,7 @@ EXTERNAL void JIT_API_ENTRYPOINT(const void *modlist_head,
                                  const Context *context, size_t contextSize) {
   assert(nullptr != context);
   assert(sizeof(*context) == contextSize);
+  JitLock lock;
   rtCompileProcessImplSoInternal(
       static_cast<const RtCompileModuleList *>(modlist_head), *context);
 }
@@ -451,6 +1338,7 @@ EXTERNAL void JIT_REG_BIND_PAYLOAD(void *handle, void *originalFunc,
   assert(handle != nullptr);
   assert(originalFunc != nullptr);
   assert(exampleFunc != nullptr);
+  JitLock lock;
   JITContext &myJit = getJit();
   myJit.registerBind(handle, originalFunc, exampleFunc,
                      toArray(params, paramsSize));
@@ -458,7 +1346,22 @@ EXTERNAL void JIT_REG_BIND_PAYLOAD(void *handle, void *originalFunc,
 
 EXTERNAL void JIT_UNREG_BIND_PAYLOAD(void *handle) {
   assert(handle != nullptr);
+  JitLock lock;
   JITContext &myJit = getJit();
   myJit.unregisterBind(handle);
+  getBindCache().release(handle);
+}
+
+EXTERNAL void JIT_GET_BIND_CACHE_STATS(BindCacheStats *stats,
+                                       size_t statsSize) {
+  assert(nullptr != stats);
+  assert(sizeof(*stats) == statsSize);
+  JitLock lock;
+  *stats = getBindCache().getStats();
+}
+
+EXTERNAL void JIT_FREE_RETIRED_CODE() {
+  JitLock lock;
+  getJit().freeRetiredUnits();
 }
 }
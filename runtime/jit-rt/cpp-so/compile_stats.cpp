@@ -0,0 +1,239 @@
+//===-- compile_stats.cpp -------------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The trace file uses the Chrome trace event format (chrome://tracing), each
+// stage is a complete ("X") event of its thread. The code sizes are stored
+// in an additional top-level array, which trace viewers ignore.
+//
+//===----------------------------------------------------------------------===//
+
+#include "compile_stats.h"
+
+#include <cassert>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "context.h"
+
+namespace {
+
+uint64_t getThreadCpuTimeUs() {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+    return 0;
+  }
+  auto toUs = [](const FILETIME &time) {
+    return ((static_cast<uint64_t>(time.dwHighDateTime) << 32) |
+            time.dwLowDateTime) /
+           10;
+  };
+  return toUs(kernel) + toUs(user);
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+  timespec time;
+  if (0 != clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time)) {
+    return 0;
+  }
+  return static_cast<uint64_t>(time.tv_sec) * 1000000 +
+         static_cast<uint64_t>(time.tv_nsec) / 1000;
+#else
+  return 0;
+#endif
+}
+
+uint64_t getPeakMemory() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                            sizeof(counters))) {
+    return 0;
+  }
+  return counters.PeakWorkingSetSize;
+#else
+  rusage usage;
+  if (0 != getrusage(RUSAGE_SELF, &usage)) {
+    return 0;
+  }
+#ifdef __APPLE__
+  return static_cast<uint64_t>(usage.ru_maxrss); // bytes
+#else
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024; // kilobytes
+#endif
+#endif
+}
+
+uint64_t toUs(StatsClock::duration duration) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+}
+
+void writeJSONString(llvm::raw_ostream &os, llvm::StringRef str) {
+  os << '"';
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      os << ' ';
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+} // anon namespace
+
+StageTimer::StageTimer(StatsClock::time_point o, StageRecord &r)
+    : origin(o), start(StatsClock::now()), startCpuUs(getThreadCpuTimeUs()),
+      record(r) {}
+
+StageTimer::~StageTimer() {
+  const auto end = StatsClock::now();
+  const auto endCpuUs = getThreadCpuTimeUs();
+  record.startUs = toUs(start - origin);
+  record.wallUs = toUs(end - start);
+  record.cpuUs = endCpuUs >= startCpuUs ? endCpuUs - startCpuUs : 0;
+  record.peakMemory = getPeakMemory();
+}
+
+CompileStats::CompileStats(const Context &c)
+    : context(c), origin(StatsClock::now()) {}
+
+CompileStats::~CompileStats() {
+  if (nullptr != context.traceFile) {
+    writeTrace();
+  }
+}
+
+bool CompileStats::enabled() const {
+  return nullptr != context.stageHandler || codeSizesEnabled();
+}
+
+bool CompileStats::codeSizesEnabled() const {
+  return nullptr != context.codeSizeHandler || nullptr != context.traceFile;
+}
+
+void CompileStats::addStage(StageRecord record) {
+  if (nullptr != context.stageHandler) {
+    StageStats stats;
+    stats.stage = record.stage.c_str();
+    stats.object = record.object.c_str();
+    stats.startUs = record.startUs;
+    stats.wallUs = record.wallUs;
+    stats.cpuUs = record.cpuUs;
+    stats.peakMemory = record.peakMemory;
+    stats.thread = record.thread;
+    context.stageHandler(context.stageHandlerData, &stats);
+  }
+  if (nullptr != context.traceFile) {
+    stages.push_back(std::move(record));
+  }
+}
+
+void CompileStats::addCodeSizes(llvm::StringRef object) {
+  if (!codeSizesEnabled()) {
+    return;
+  }
+  auto buffer = llvm::MemoryBuffer::getMemBuffer(object, "", false);
+  auto objFile =
+      llvm::object::ObjectFile::createObjectFile(buffer->getMemBufferRef());
+  if (!objFile) {
+    llvm::consumeError(objFile.takeError());
+    return;
+  }
+  for (auto &&sym : llvm::object::computeSymbolSizes(**objFile)) {
+#if LDC_LLVM_VER >= 1100
+    auto type = sym.first.getType();
+    if (!type || *type != llvm::object::SymbolRef::ST_Function) {
+      llvm::consumeError(type.takeError());
+      continue;
+    }
+#else
+    if (sym.first.getType() != llvm::object::SymbolRef::ST_Function) {
+      continue;
+    }
+#endif
+    auto name = sym.first.getName();
+    if (!name) {
+      llvm::consumeError(name.takeError());
+      continue;
+    }
+    if (nullptr != context.codeSizeHandler) {
+      context.codeSizeHandler(context.codeSizeHandlerData,
+                              name->str().c_str(),
+                              static_cast<std::size_t>(sym.second));
+    }
+    if (nullptr != context.traceFile) {
+      codeSizes.push_back({name->str(), sym.second});
+    }
+  }
+}
+
+void CompileStats::writeTrace() const {
+  assert(nullptr != context.traceFile);
+  std::error_code ec;
+  llvm::raw_fd_ostream os(context.traceFile, ec, llvm::sys::fs::F_Text);
+  if (ec) {
+    return;
+  }
+  os << "{\"traceEvents\": [";
+  bool first = true;
+  for (auto &&stage : stages) {
+    os << (first ? "\n  " : ",\n  ");
+    first = false;
+    os << "{\"name\": ";
+    writeJSONString(os, stage.stage);
+    os << ", \"cat\": \"jit\", \"ph\": \"X\", \"pid\": 0, \"tid\": "
+       << stage.thread << ", \"ts\": " << stage.startUs
+       << ", \"dur\": " << stage.wallUs << ", \"args\": {\"object\": ";
+    writeJSONString(os, stage.object);
+    os << ", \"cpu_us\": " << stage.cpuUs
+       << ", \"peak_memory\": " << stage.peakMemory << "}}";
+  }
+  os << "\n],\n\"codeSizes\": [";
+  first = true;
+  for (auto &&size : codeSizes) {
+    os << (first ? "\n  " : ",\n  ");
+    first = false;
+    os << "{\"name\": ";
+    writeJSONString(os, size.first);
+    os << ", \"size\": " << size.second << "}";
+  }
+  os << "\n]}\n";
+}
+
+ScopedStage::ScopedStage(CompileStats &s, const char *stage,
+                         llvm::StringRef object)
+    : stats(s) {
+  if (stats.enabled()) {
+    record.stage = stage;
+    record.object = object.str();
+    timer.reset(new StageTimer(stats.getOrigin(), record));
+  }
+}
+
+ScopedStage::~ScopedStage() {
+  if (nullptr != timer) {
+    timer.reset();
+    stats.addStage(std::move(record));
+  }
+}
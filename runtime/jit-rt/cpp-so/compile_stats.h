@@ -0,0 +1,97 @@
+//===-- compile_stats.h - jit support ---------------------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Jit runtime - timing of the compilation stages and code size of the
+// compiled functions.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+
+struct Context;
+
+using StatsClock = std::chrono::steady_clock;
+
+struct StageRecord final {
+  std::string stage;
+  std::string object;
+  uint64_t startUs = 0; // since the start of the compilation
+  uint64_t wallUs = 0;
+  uint64_t cpuUs = 0;
+  uint64_t peakMemory = 0;
+  unsigned thread = 0;
+};
+
+/// Measures a stage of the current thread from construction to destruction
+/// into `record`.
+class StageTimer final {
+  StatsClock::time_point origin;
+  StatsClock::time_point start;
+  uint64_t startCpuUs;
+  StageRecord &record;
+
+public:
+  StageTimer(StatsClock::time_point origin, StageRecord &record);
+  ~StageTimer();
+};
+
+/// Statistics of a compilation. The stages and code sizes are reported to the
+/// handlers of the context when they are added, the trace file is written on
+/// destruction. Must only be used from the compiling thread, stages of other
+/// threads are measured into records which are added later.
+class CompileStats final {
+  const Context &context;
+  StatsClock::time_point origin;
+  std::vector<StageRecord> stages;
+  std::vector<std::pair<std::string, uint64_t>> codeSizes;
+
+public:
+  explicit CompileStats(const Context &context);
+  ~CompileStats();
+
+  CompileStats(const CompileStats &) = delete;
+  CompileStats &operator=(const CompileStats &) = delete;
+
+  /// Returns true if anything is collected.
+  bool enabled() const;
+
+  /// Returns true if the code sizes are collected.
+  bool codeSizesEnabled() const;
+
+  StatsClock::time_point getOrigin() const { return origin; }
+
+  void addStage(StageRecord record);
+
+  /// Adds the sizes of the functions defined in object file `object`.
+  void addCodeSizes(llvm::StringRef object);
+
+private:
+  void writeTrace() const;
+};
+
+/// Times a stage of the compiling thread and adds it to `stats`.
+class ScopedStage final {
+  CompileStats &stats;
+  StageRecord record;
+  std::unique_ptr<StageTimer> timer;
+
+public:
+  ScopedStage(CompileStats &stats, const char *stage,
+              llvm::StringRef object = "");
+  ~ScopedStage();
+};
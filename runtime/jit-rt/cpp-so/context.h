@@ -43,12 +43,32 @@ enum { ApiVersion = LDC_DYNAMIC_COMPILE_API_VERSION };
 #define JIT_UNREG_BIND_PAYLOAD                                                 \
   MAKE_JIT_API_CALL(unregisterBindPayloadImplSo,                               \
                     LDC_DYNAMIC_COMPILE_API_VERSION)
+#define JIT_GET_BIND_CACHE_STATS                                               \
+  MAKE_JIT_API_CALL(getBindCacheStatsImplSo, LDC_DYNAMIC_COMPILE_API_VERSION)
+#define JIT_FREE_RETIRED_CODE                                                  \
+  MAKE_JIT_API_CALL(freeRetiredCodeImplSo, LDC_DYNAMIC_COMPILE_API_VERSION)
 
 typedef void (*InterruptPointHandlerT)(void *, const char *action,
                                        const char *object);
 typedef void (*FatalHandlerT)(void *, const char *reason);
 typedef void (*DumpHandlerT)(void *, DumpStage stage, const char *str,
                              std::size_t len);
+typedef bool (*CancelHandlerT)(void *);
+
+// Times are in microseconds
+struct StageStats final {
+  const char *stage;
+  const char *object; // module or function, may be empty
+  uint64_t startUs;   // since the start of the compilation
+  uint64_t wallUs;
+  uint64_t cpuUs;      // of the compiling thread
+  uint64_t peakMemory; // of the process in bytes, 0 if unknown
+  unsigned thread;     // 0 is the calling thread
+};
+
+typedef void (*StageHandlerT)(void *, const StageStats *stats);
+typedef void (*CodeSizeHandlerT)(void *, const char *function,
+                                 std::size_t size);
 
 struct Context final {
   unsigned optLevel = 0;
@@ -59,4 +79,38 @@ struct Context final {
   void *fatalHandlerData = nullptr;
   DumpHandlerT dumpHandler = nullptr;
   void *dumpHandlerData = nullptr;
+  const char *cacheDir = nullptr; // persistent object cache, null if disabled
+  // Polled during compilation, returns true to discard the new code
+  CancelHandlerT cancelHandler = nullptr;
+  void *cancelHandlerData = nullptr;
+  // Compile the functions on their first call
+  bool lazyCompile = false;
+  // Optimize and codegen the units on that many threads if greater than 1
+  unsigned compileThreads = 0;
+  // Number of unused bind specializations kept for reuse
+  unsigned bindCacheSize = 0;
+  // Tiered compilation if non-zero: functions are instrumented until they
+  // were called that many times and then recompiled with their profile
+  unsigned tieredThreshold = 0;
+  // Optimizer options, the defaults for optLevel and sizeLevel if not set
+  int inlineThreshold = -1;
+  bool disableInlining = false;
+  bool disableLoopUnrolling = false;
+  bool disableLoopVectorization = false;
+  bool disableSLPVectorization = false;
+  bool fastMath = false;
+  bool disableSimplifyDruntimeCalls = false;
+  bool disableGCToStack = false;
+  bool stripDebug = true;
+  // Override the host cpu and features if not null
+  const char *targetCpu = nullptr;
+  const char *targetFeatures = nullptr;
+  // Timing of the compilation stages, called from the calling thread
+  StageHandlerT stageHandler = nullptr;
+  void *stageHandlerData = nullptr;
+  // Machine code size of each compiled function
+  CodeSizeHandlerT codeSizeHandler = nullptr;
+  void *codeSizeHandlerData = nullptr;
+  // Chrome trace (JSON) of the stages is written there if not null
+  const char *traceFile = nullptr;
 };
@@ -15,13 +15,18 @@
 #include "jit_context.h"
 
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
 
 #include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/ExecutionEngine/RuntimeDyld.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Object/ObjectFile.h"
 #include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
@@ -75,16 +80,25 @@ auto getSymbolInProcess(const std::string &name)
 #endif
 }
 
+void lazyCompileFailed() {
+  fprintf(stderr, "Dynamic compiler fatal: lazy compilation failed\n");
+  fflush(stderr);
+  abort();
+}
+
 } // anon namespace
 
 JITContext::ListenerCleaner::ListenerCleaner(JITContext &o,
-                                             llvm::raw_ostream *stream)
+                                             llvm::raw_ostream *stream,
+                                             std::string *objectCopy)
     : owner(o) {
   owner.listenerlayer.getTransform().stream = stream;
+  owner.listenerlayer.getTransform().objectCopy = objectCopy;
 }
 
 JITContext::ListenerCleaner::~ListenerCleaner() {
   owner.listenerlayer.getTransform().stream = nullptr;
+  owner.listenerlayer.getTransform().objectCopy = nullptr;
 }
 
 JITContext::JITContext()
@@ -108,14 +122,20 @@ JITContext::JITContext()
   llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
 }
 
+std::unique_ptr<llvm::TargetMachine> JITContext::createHostTargetMachine() {
+  return createTargetMachine();
+}
+
 JITContext::~JITContext() {}
 
-llvm::Error JITContext::addModule(std::unique_ptr<llvm::Module> module,
-                                  llvm::raw_ostream *asmListener) {
+llvm::Error JITContext::addUnit(const void *id, UnitInputs inputs,
+                                std::unique_ptr<llvm::Module> module,
+                                llvm::raw_ostream *asmListener,
+                                std::string *objectCopy) {
+  assert(nullptr != id);
   assert(nullptr != module);
-  reset();
 
-  ListenerCleaner cleaner(*this, asmListener);
+  ListenerCleaner cleaner(*this, asmListener, objectCopy);
   // Add the set to the JIT with the resolver we created above
 #if LDC_LLVM_VER >= 700
   auto handle = execSession.allocateVModule();
@@ -128,23 +148,197 @@ llvm::Error JITContext::addModule(std::unique_ptr<llvm::Module> module,
     execSession.releaseVModule(handle);
     return err;
   }
-  moduleHandle = handle;
 #else
   auto result = compileLayer.addModule(std::move(module), createResolver());
   if (!result) {
     return llvm::make_error<llvm::StringError>("addModule failed",
                                                llvm::inconvertibleErrorCode());
   }
-  moduleHandle = result.get();
+  auto handle = result.get();
 #endif
-  compiled = true;
+  setUnit(id, handle, std::move(inputs));
   return llvm::Error::success();
 }
 
+llvm::Error
+JITContext::addUnitObject(const void *id, UnitInputs inputs,
+                          std::unique_ptr<llvm::MemoryBuffer> object,
+                          llvm::raw_ostream *asmListener) {
+  assert(nullptr != id);
+  assert(nullptr != object);
+
+  ListenerCleaner cleaner(*this, asmListener, nullptr);
+#if LDC_LLVM_VER >= 700
+  auto handle = execSession.allocateVModule();
+  if (auto err = listenerlayer.addObject(handle, std::move(object))) {
+    execSession.releaseVModule(handle);
+    return err;
+  }
+  if (auto err = listenerlayer.emitAndFinalize(handle)) {
+    execSession.releaseVModule(handle);
+    return err;
+  }
+#else
+  auto objFile =
+      llvm::object::ObjectFile::createObjectFile(object->getMemBufferRef());
+  if (!objFile) {
+    return objFile.takeError();
+  }
+  auto binary =
+      std::make_shared<llvm::object::OwningBinary<llvm::object::ObjectFile>>(
+          std::move(*objFile), std::move(object));
+  auto result = listenerlayer.addObject(std::move(binary), createResolver());
+  if (!result) {
+    return result.takeError();
+  }
+  auto handle = result.get();
+#endif
+  setUnit(id, handle, std::move(inputs));
+  return llvm::Error::success();
+}
+
+const UnitInputs *JITContext::getUnitInputs(const void *id) const {
+  assert(nullptr != id);
+  auto it = units.find(id);
+  if (units.end() == it) {
+    return nullptr;
+  }
+  return &it->second.inputs;
+}
+
+void JITContext::commitUnits() {
+  for (auto &&it : pendingUnits) {
+    auto old = units.find(it.first);
+    if (units.end() != old) {
+      retiredModules.push_back(old->second.handle);
+      units.erase(old);
+    }
+    units.insert(std::move(it));
+  }
+  pendingUnits.clear();
+}
+
+void JITContext::discardPendingUnits() {
+  for (auto &&it : pendingUnits) {
+    removeModule(it.second.handle);
+  }
+  pendingUnits.clear();
+}
+
+llvm::Expected<void *>
+JITContext::createLazyCallback(std::function<void *()> compile) {
+  assert(compile);
+  if (nullptr == callbackManager) {
+    const llvm::Triple triple(llvm::sys::getProcessTriple());
+    const auto errorHandler =
+        static_cast<llvm::JITTargetAddress>(reinterpret_cast<uintptr_t>(
+            &lazyCompileFailed));
+#if LDC_LLVM_VER >= 800
+    auto manager = llvm::orc::createLocalCompileCallbackManager(
+        triple, execSession, errorHandler);
+    if (!manager) {
+      return manager.takeError();
+    }
+    callbackManager = std::move(*manager);
+#elif LDC_LLVM_VER >= 700
+    callbackManager = llvm::orc::createLocalCompileCallbackManager(
+        triple, execSession, errorHandler);
+#else
+    callbackManager =
+        llvm::orc::createLocalCompileCallbackManager(triple, errorHandler);
+#endif
+    if (nullptr == callbackManager) {
+      return llvm::make_error<llvm::StringError>(
+          "Lazy compilation is not supported on this target",
+          llvm::inconvertibleErrorCode());
+    }
+  }
+
+  auto action = [compile]() {
+    return static_cast<llvm::JITTargetAddress>(
+        reinterpret_cast<uintptr_t>(compile()));
+  };
+#if LDC_LLVM_VER >= 700
+  auto addr = callbackManager->getCompileCallback(std::move(action));
+  if (!addr) {
+    return addr.takeError();
+  }
+  return reinterpret_cast<void *>(static_cast<uintptr_t>(*addr));
+#elif LDC_LLVM_VER >= 600
+  auto info = callbackManager->getCompileCallback();
+  if (!info) {
+    return info.takeError();
+  }
+  info->setCompileAction(std::move(action));
+  return reinterpret_cast<void *>(static_cast<uintptr_t>(info->getAddress()));
+#else
+  auto info = callbackManager->getCompileCallback();
+  info.setCompileAction(std::move(action));
+  return reinterpret_cast<void *>(static_cast<uintptr_t>(info.getAddress()));
+#endif
+}
+
+void JITContext::removeUnit(const void *id) {
+  assert(nullptr != id);
+  auto it = units.find(id);
+  if (units.end() != it) {
+    retiredModules.push_back(it->second.handle);
+    units.erase(it);
+  }
+  it = pendingUnits.find(id);
+  if (pendingUnits.end() != it) {
+    removeModule(it->second.handle);
+    pendingUnits.erase(it);
+  }
+}
+
+void JITContext::freeRetiredUnits() {
+  for (auto &&handle : retiredModules) {
+    removeModule(handle);
+  }
+  retiredModules.clear();
+}
+
 llvm::JITSymbol JITContext::findSymbol(const std::string &name) {
   return compileLayer.findSymbol(name, false);
 }
 
+llvm::JITSymbol JITContext::findSymbol(const void *unitId,
+                                       const std::string &name) {
+  assert(nullptr != unitId);
+  auto it = pendingUnits.find(unitId);
+  if (pendingUnits.end() == it) {
+    it = units.find(unitId);
+    if (units.end() == it) {
+      return llvm::JITSymbol(nullptr);
+    }
+  }
+  return compileLayer.findSymbolIn(it->second.handle, name, false);
+}
+
+const llvm::Module *JITContext::getParsedModule(const void *id,
+                                                llvm::StringRef irData) const {
+  assert(nullptr != id);
+  auto it = parsedModules.find(id);
+  if (parsedModules.end() == it ||
+      it->second.irData.data() != irData.data() ||
+      it->second.irData.size() != irData.size()) {
+    return nullptr;
+  }
+  return it->second.module.get();
+}
+
+const llvm::Module &
+JITContext::addParsedModule(const void *id, llvm::StringRef irData,
+                            std::unique_ptr<llvm::Module> module) {
+  assert(nullptr != id);
+  assert(nullptr != module);
+  auto &parsed = parsedModules[id];
+  parsed.irData = irData;
+  parsed.module = std::move(module);
+  return *parsed.module;
+}
+
 void JITContext::clearSymMap() { symMap.clear(); }
 
 void JITContext::addSymbol(std::string &&name, void *value) {
@@ -152,11 +346,12 @@ void JITContext::addSymbol(std::string &&name, void *value) {
 }
 
 void JITContext::reset() {
-  if (compiled) {
-    removeModule(moduleHandle);
-    moduleHandle = {};
-    compiled = false;
+  discardPendingUnits();
+  for (auto &&it : units) {
+    removeModule(it.second.handle);
   }
+  units.clear();
+  freeRetiredUnits();
 }
 
 void JITContext::registerBind(void *handle, void *originalFunc,
@@ -164,7 +359,8 @@ void JITContext::registerBind(void *handle, void *originalFunc,
                               const llvm::ArrayRef<ParamSlice> &params) {
   assert(bindInstances.count(handle) == 0);
   BindDesc::ParamsVec vec(params.begin(), params.end());
-  bindInstances.insert({handle, {originalFunc, exampleFunc, std::move(vec)}});
+  bindInstances.insert(
+      {handle, {originalFunc, exampleFunc, std::move(vec), ++lastBindSerial}});
 }
 
 void JITContext::unregisterBind(void *handle) {
@@ -178,6 +374,22 @@ bool JITContext::hasBindFunction(const void *handle) const {
   return it != bindInstances.end();
 }
 
+uint64_t JITContext::getBindSerial(const void *handle) const {
+  assert(handle != nullptr);
+  auto it = bindInstances.find(const_cast<void *>(handle));
+  return it != bindInstances.end() ? it->second.serial : 0;
+}
+
+void JITContext::setUnit(const void *id, ModuleHandleT handle,
+                         UnitInputs inputs) {
+  auto it = pendingUnits.find(id);
+  if (pendingUnits.end() != it) {
+    removeModule(it->second.handle);
+    pendingUnits.erase(it);
+  }
+  pendingUnits.insert({id, Unit{handle, std::move(inputs)}});
+}
+
 void JITContext::removeModule(const ModuleHandleT &handle) {
   cantFail(compileLayer.removeModule(handle));
 #if LDC_LLVM_VER >= 700
@@ -190,17 +402,19 @@ std::shared_ptr<llvm::orc::SymbolResolver> JITContext::createResolver() {
   return llvm::orc::createLegacyLookupResolver(
       execSession,
       [this](const std::string &name) -> llvm::JITSymbol {
-        if (auto Sym = compileLayer.findSymbol(name, false)) {
-          return Sym;
-        } else if (auto Err = Sym.takeError()) {
-          return std::move(Err);
-        }
+        // Prefer the host symbols, references to other units go through the
+        // thunks and therefore stay valid when those units are recompiled.
         auto it = symMap.find(name);
         if (symMap.end() != it) {
           return llvm::JITSymbol(
               reinterpret_cast<llvm::JITTargetAddress>(it->second),
               llvm::JITSymbolFlags::Exported);
         }
+        if (auto Sym = compileLayer.findSymbol(name, false)) {
+          return Sym;
+        } else if (auto Err = Sym.takeError()) {
+          return std::move(Err);
+        }
         if (auto SymAddr = getSymbolInProcess(name)) {
           return llvm::JITSymbol(SymAddr, llvm::JITSymbolFlags::Exported);
         }
@@ -213,16 +427,11 @@ std::shared_ptr<llvm::orc::SymbolResolver> JITContext::createResolver() {
 #else
 std::shared_ptr<llvm::JITSymbolResolver> JITContext::createResolver() {
   // Build our symbol resolver:
-  // Lambda 1: Look back into the JIT itself to find symbols that are part of
-  //           the same "logical dylib".
+  // Lambda 1: Look for the host symbols first, references to other units go
+  //           through the thunks and therefore stay valid when those units
+  //           are recompiled. Then look back into the JIT itself.
   // Lambda 2: Search for external symbols in the host process.
   return llvm::orc::createLambdaResolver(
-      [this](const std::string &name) {
-        if (auto Sym = compileLayer.findSymbol(name, false)) {
-          return Sym;
-        }
-        return llvm::JITSymbol(nullptr);
-      },
       [this](const std::string &name) {
         auto it = symMap.find(name);
         if (symMap.end() != it) {
@@ -230,6 +439,12 @@ std::shared_ptr<llvm::JITSymbolResolver> JITContext::createResolver() {
               reinterpret_cast<llvm::JITTargetAddress>(it->second),
               llvm::JITSymbolFlags::Exported);
         }
+        if (auto Sym = compileLayer.findSymbol(name, false)) {
+          return Sym;
+        }
+        return llvm::JITSymbol(nullptr);
+      },
+      [](const std::string &name) {
         if (auto SymAddr = getSymbolInProcess(name)) {
           return llvm::JITSymbol(SymAddr, llvm::JITSymbolFlags::Exported);
         }
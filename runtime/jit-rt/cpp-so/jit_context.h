@@ -14,14 +14,18 @@
 
 #pragma once
 
+#include <functional>
 #include <map>
 #include <memory>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "llvm/ADT/MapVector.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/ObjectTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
@@ -36,21 +40,41 @@
 #include "disassembler.h"
 
 namespace llvm {
+class MemoryBuffer;
 class raw_ostream;
 class TargetMachine;
 } // namespace llvm
 
 using SymMap = std::map<std::string, void *>;
 
+/// Inputs a unit of jitted code was compiled from.
+struct UnitInputs final {
+  std::vector<const void *> modules; // jit modules linked into the unit
+  std::vector<const void *> binds;   // bind handles generated into the unit
+  // State of the inputs (settings, dynamicCompileConst values, bind payloads)
+  // at compilation time, the unit must be recompiled when it changes.
+  std::string snapshot;
+  // Hot functions compiled with their profile in tiered mode
+  std::string tiers;
+};
+
 class JITContext final {
 private:
   struct ModuleListener {
     llvm::TargetMachine &targetmachine;
     llvm::raw_ostream *stream = nullptr;
+    std::string *objectCopy = nullptr;
 
     ModuleListener(llvm::TargetMachine &tm) : targetmachine(tm) {}
 
     template <typename T> auto operator()(T &&object) -> T {
+      if (nullptr != objectCopy) {
+#if LDC_LLVM_VER >= 700
+        *objectCopy = object->getBuffer().str();
+#else
+        *objectCopy = object->getBinary()->getData().str();
+#endif
+      }
       if (nullptr != stream) {
 #if LDC_LLVM_VER >= 700
         auto objFile =
@@ -92,21 +116,46 @@ private:
   ListenerLayerT listenerlayer;
   CompileLayerT compileLayer;
   llvm::LLVMContext context;
-  bool compiled = false;
-  ModuleHandleT moduleHandle;
   SymMap symMap;
 
+  // Jit modules as parsed from their bitcode, reused by later compilations.
+  struct ParsedModule final {
+    llvm::StringRef irData;
+    std::unique_ptr<llvm::Module> module;
+  };
+  std::map<const void *, ParsedModule> parsedModules;
+
+  // Jitted code is kept in independent units (one per jit module, lazily
+  // compiled function and bind specialization), so that only changed units
+  // have to be recompiled.
+  struct Unit final {
+    ModuleHandleT handle;
+    UnitInputs inputs;
+  };
+  std::map<const void *, Unit> units;
+  // Units compiled by the current compilation, they replace the units above
+  // on commitUnits().
+  std::map<const void *, Unit> pendingUnits;
+  // Code of replaced and removed units, other threads may still be running it
+  // until freeRetiredUnits() is called.
+  std::vector<ModuleHandleT> retiredModules;
+  // Trampolines for lazy compilation, created on first use
+  std::unique_ptr<llvm::orc::JITCompileCallbackManager> callbackManager;
+
   struct BindDesc final {
     void *originalFunc;
     void *exampleFunc;
     using ParamsVec = llvm::SmallVector<ParamSlice, 5>;
     ParamsVec params;
+    uint64_t serial; // unique for each registration
   };
   llvm::MapVector<void *, BindDesc> bindInstances;
+  uint64_t lastBindSerial = 0;
 
   struct ListenerCleaner final {
     JITContext &owner;
-    ListenerCleaner(JITContext &o, llvm::raw_ostream *stream);
+    ListenerCleaner(JITContext &o, llvm::raw_ostream *stream,
+                    std::string *objectCopy);
     ~ListenerCleaner();
   };
 
@@ -115,15 +164,65 @@ public:
   ~JITContext();
 
   llvm::TargetMachine &getTargetMachine() { return *targetmachine; }
+
+  /// Creates a new target machine for the host, like the one of the jit, e.g.
+  /// for worker threads.
+  static std::unique_ptr<llvm::TargetMachine> createHostTargetMachine();
   const llvm::DataLayout &getDataLayout() const { return dataLayout; }
 
-  llvm::Error addModule(std::unique_ptr<llvm::Module> module,
-                        llvm::raw_ostream *asmListener);
+  /// Compiles `module` as pending unit `id`, which replaces the previous code
+  /// of this unit on commitUnits(). Code of other units stays untouched. The
+  /// object file is copied to `objectCopy` unless null.
+  llvm::Error addUnit(const void *id, UnitInputs inputs,
+                      std::unique_ptr<llvm::Module> module,
+                      llvm::raw_ostream *asmListener,
+                      std::string *objectCopy = nullptr);
+
+  /// Like addUnit(), but for an already compiled object file.
+  llvm::Error addUnitObject(const void *id, UnitInputs inputs,
+                            std::unique_ptr<llvm::MemoryBuffer> object,
+                            llvm::raw_ostream *asmListener);
+
+  /// Returns the inputs unit `id` was compiled from or null if there is no
+  /// such (committed) unit.
+  const UnitInputs *getUnitInputs(const void *id) const;
+
+  /// Replaces the units by the pending ones. All references to the previous
+  /// code must have been updated, it is retired (see freeRetiredUnits()).
+  void commitUnits();
+
+  /// Frees the pending units, e.g. if the compilation was cancelled.
+  void discardPendingUnits();
+
+  /// Returns the address of a trampoline which calls `compile` when it is
+  /// called for the first time and then jumps to the address returned by
+  /// `compile`, preserving the arguments.
+  llvm::Expected<void *> createLazyCallback(std::function<void *()> compile);
+
+  /// Removes unit `id`, its code is retired unless it is still pending.
+  void removeUnit(const void *id);
+
+  /// Frees the code retired by commitUnits() and removeUnit(), no thread may
+  /// be running it anymore.
+  void freeRetiredUnits();
 
   llvm::JITSymbol findSymbol(const std::string &name);
 
+  /// Looks up `name` in (the pending version of) unit `unitId`.
+  llvm::JITSymbol findSymbol(const void *unitId, const std::string &name);
+
   llvm::LLVMContext &getContext() { return context; }
 
+  /// Returns the module parsed from `irData` of jit module `id` by a previous
+  /// compilation or null.
+  const llvm::Module *getParsedModule(const void *id,
+                                      llvm::StringRef irData) const;
+
+  /// Keeps `module`, parsed from `irData` of jit module `id`, for later
+  /// compilations. The module must not be changed.
+  const llvm::Module &addParsedModule(const void *id, llvm::StringRef irData,
+                                      std::unique_ptr<llvm::Module> module);
+
   void clearSymMap();
 
   void addSymbol(std::string &&name, void *value);
@@ -137,6 +236,10 @@ public:
 
   bool hasBindFunction(const void *handle) const;
 
+  /// Returns the registration serial of bind `handle` or 0 if it isn't
+  /// registered.
+  uint64_t getBindSerial(const void *handle) const;
+
   const llvm::MapVector<void *, BindDesc> &getBindInstances() const {
     return bindInstances;
   }
@@ -144,6 +247,8 @@ public:
 private:
   void removeModule(const ModuleHandleT &handle);
 
+  void setUnit(const void *id, ModuleHandleT handle, UnitInputs inputs);
+
 #if LDC_LLVM_VER >= 700
   std::shared_ptr<llvm::orc::SymbolResolver> createResolver();
 #else
@@ -0,0 +1,117 @@
+//===-- object_cache.cpp --------------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Cache entries are named `jitcache_<md5 of the key>.o`, new entries are
+// written to temporary files and renamed, so that concurrently running
+// processes never see partial entries.
+//
+//===----------------------------------------------------------------------===//
+
+#include "object_cache.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "context.h"
+#include "optimizer.h"
+
+namespace {
+
+void hashInt(llvm::MD5 &hash, unsigned value) {
+  hash.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<uint8_t *>(&value),
+                                      sizeof(value)));
+}
+
+void hashString(llvm::MD5 &hash, llvm::StringRef str) {
+  hashInt(hash, static_cast<unsigned>(str.size()));
+  hash.update(str);
+}
+
+llvm::SmallString<128> getEntryPath(llvm::StringRef cacheDir,
+                                    llvm::StringRef key) {
+  llvm::SmallString<128> path(cacheDir);
+  llvm::sys::path::append(path, "jitcache_" + key + ".o");
+  return path;
+}
+
+} // anon namespace
+
+std::string calculateObjectKey(const llvm::TargetMachine &targetMachine,
+                               const OptimizerSettings &settings,
+                               const llvm::Module &module) {
+  llvm::MD5 hash;
+  hashString(hash, LLVM_VERSION_STRING);
+  hashInt(hash, ApiVersion);
+  hashString(hash, getSettingsKey(settings));
+  hashString(hash, targetMachine.getTargetTriple().str());
+  hashString(hash, targetMachine.getTargetCPU());
+  hashString(hash, targetMachine.getTargetFeatureString());
+
+  llvm::SmallString<4096> bitcode;
+  llvm::raw_svector_ostream os(bitcode);
+#if LDC_LLVM_VER >= 700
+  llvm::WriteBitcodeToFile(module, os);
+#else
+  llvm::WriteBitcodeToFile(&module, os);
+#endif
+  hash.update(bitcode.str());
+
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+  llvm::SmallString<32> str;
+  llvm::MD5::stringifyResult(result, str);
+  return std::string(str.str());
+}
+
+std::unique_ptr<llvm::MemoryBuffer> loadCachedObject(llvm::StringRef cacheDir,
+                                                     llvm::StringRef key) {
+  auto buffer = llvm::MemoryBuffer::getFile(getEntryPath(cacheDir, key), -1,
+                                            /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    return nullptr;
+  }
+  return std::move(*buffer);
+}
+
+void storeCachedObject(llvm::StringRef cacheDir, llvm::StringRef key,
+                       llvm::StringRef object) {
+  if (llvm::sys::fs::create_directories(cacheDir)) {
+    return;
+  }
+  const auto path = getEntryPath(cacheDir, key);
+  llvm::SmallString<128> tempFile;
+  int fd;
+  if (llvm::sys::fs::createUniqueFile(llvm::Twine(path) + ".tmp%%%%%%%", fd,
+                                      tempFile)) {
+    return;
+  }
+
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+    os << object;
+    os.close();
+    if (os.has_error()) {
+      os.clear_error();
+      llvm::sys::fs::remove(tempFile);
+      return;
+    }
+  }
+
+  if (llvm::sys::fs::rename(tempFile, path)) {
+    llvm::sys::fs::remove(tempFile);
+  }
+}
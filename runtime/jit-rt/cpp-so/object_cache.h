@@ -0,0 +1,43 @@
+//===-- object_cache.h - jit support ----------------------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Jit runtime - persistent cache of the compiled object files, allows to skip
+// optimization and codegen for code compiled by previous runs.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+
+namespace llvm {
+class MemoryBuffer;
+class Module;
+class TargetMachine;
+}
+
+struct OptimizerSettings;
+
+/// Returns the cache key for the unoptimized `module`. Besides the IR (which
+/// contains the values of the dynamicCompileConst variables and the bind
+/// payloads at this stage) it covers the settings and the host target.
+std::string calculateObjectKey(const llvm::TargetMachine &targetMachine,
+                               const OptimizerSettings &settings,
+                               const llvm::Module &module);
+
+/// Returns the cached object for `key` or null.
+std::unique_ptr<llvm::MemoryBuffer> loadCachedObject(llvm::StringRef cacheDir,
+                                                     llvm::StringRef key);
+
+/// Adds `object` to the cache, errors are ignored.
+void storeCachedObject(llvm::StringRef cacheDir, llvm::StringRef key,
+                       llvm::StringRef object);
@@ -13,8 +13,10 @@
 
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/IR/Verifier.h"
 
 #include "llvm/ADT/Triple.h"
@@ -28,25 +30,60 @@
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
 #include "context.h"
+#include "gen/passes/Passes.h"
 #include "utils.h"
 #include "valueparser.h"
 
 namespace {
+void addSimplifyDRuntimeCallsPass(const llvm::PassManagerBuilder &builder,
+                                  llvm::legacy::PassManagerBase &pm) {
+  if (builder.OptLevel >= 2 && builder.SizeLevel == 0) {
+    pm.add(createSimplifyDRuntimeCalls());
+  }
+}
+
+void addGarbageCollect2StackPass(const llvm::PassManagerBuilder &builder,
+                                 llvm::legacy::PassManagerBase &pm) {
+  if (builder.OptLevel >= 2 && builder.SizeLevel == 0) {
+    pm.add(createGarbageCollect2Stack());
+  }
+}
+
+void addHoistGCAllocationsPass(const llvm::PassManagerBuilder &builder,
+                               llvm::legacy::PassManagerBase &pm) {
+  if (builder.OptLevel >= 2 && builder.SizeLevel == 0) {
+    pm.add(createHoistGCAllocations());
+  }
+}
+
+void addInferNoCapturePass(const llvm::PassManagerBuilder &builder,
+                           llvm::legacy::PassManagerBase &pm) {
+  if (builder.OptLevel >= 2 && builder.SizeLevel == 0) {
+    pm.add(createInferNoCapture());
+  }
+}
+
 // TODO: share this function with compiler
 void addOptimizationPasses(llvm::legacy::PassManagerBase &mpm,
                            llvm::legacy::FunctionPassManager &fpm,
-                           unsigned optLevel, unsigned sizeLevel) {
+                           const OptimizerSettings &settings) {
+  const auto optLevel = settings.optLevel;
+  const auto sizeLevel = settings.sizeLevel;
   llvm::PassManagerBuilder builder;
   builder.OptLevel = optLevel;
   builder.SizeLevel = sizeLevel;
 
-  // TODO: expose this option from jit
-  if (/*willInline()*/ true) {
+  if (!settings.disableInlining) {
 #if LDC_LLVM_VER >= 400
-    auto params = llvm::getInlineParams(optLevel, sizeLevel);
+    auto params = settings.inlineThreshold >= 0
+                      ? llvm::getInlineParams(settings.inlineThreshold)
+                      : llvm::getInlineParams(optLevel, sizeLevel);
     builder.Inliner = llvm::createFunctionInliningPass(params);
 #else
-    builder.Inliner = llvm::createFunctionInliningPass(optLevel, sizeLevel);
+    builder.Inliner =
+        settings.inlineThreshold >= 0
+            ? llvm::createFunctionInliningPass(settings.inlineThreshold)
+            : llvm::createFunctionInliningPass(optLevel, sizeLevel);
 #endif
   } else {
 #if LDC_LLVM_VER >= 400
@@ -57,25 +94,34 @@ void addOptimizationPasses(llvm::legacy::PassManagerBase &mpm,
   }
   builder.DisableUnitAtATime = false;
 
-  // TODO: Expose this option
-  builder.DisableUnrollLoops = optLevel == 0;
+  builder.DisableUnrollLoops = optLevel == 0 || settings.disableLoopUnrolling;
 
-  // TODO: expose this option
-  if (/*disableLoopVectorization*/ false) {
+  if (settings.disableLoopVectorization) {
     builder.LoopVectorize = false;
     // If option wasn't forced via cmd line (-vectorize-loops, -loop-vectorize)
   } else if (!builder.LoopVectorize) {
     builder.LoopVectorize = optLevel > 1 && sizeLevel < 2;
   }
 
-  // TODO: expose this option
   builder.SLPVectorize =
-      /*disableSLPVectorization*/ false ? false : optLevel > 1 && sizeLevel < 2;
+      settings.disableSLPVectorization ? false : optLevel > 1 && sizeLevel < 2;
+
+  if (!settings.disableSimplifyDruntimeCalls) {
+    builder.addExtension(llvm::PassManagerBuilder::EP_LoopOptimizerEnd,
+                         addSimplifyDRuntimeCallsPass);
+  }
+  if (!settings.disableGCToStack) {
+    builder.addExtension(llvm::PassManagerBuilder::EP_CGSCCOptimizerLate,
+                         addInferNoCapturePass);
+    builder.addExtension(llvm::PassManagerBuilder::EP_LoopOptimizerEnd,
+                         addGarbageCollect2StackPass);
+    builder.addExtension(llvm::PassManagerBuilder::EP_LoopOptimizerEnd,
+                         addHoistGCAllocationsPass);
+  }
 
   // TODO: sanitizers support in jit?
-  // TODO: lang specific passes support
   // TODO: addStripExternalsPass?
-  // TODO: PGO support in jit?
+  // PGO: in tiered mode the profile is attached to the IR (see profile.cpp)
 
   builder.populateFunctionPassManager(fpm);
   builder.populateModulePassManager(mpm);
@@ -92,13 +138,13 @@ void setupPasses(llvm::TargetMachine &targetMachine,
   fpm.add(llvm::createTargetTransformInfoWrapperPass(
       targetMachine.getTargetIRAnalysis()));
 
-  if (/*stripDebug*/ true) {
+  if (settings.stripDebug) {
     mpm.add(llvm::createStripSymbolsPass(true));
   }
   mpm.add(llvm::createStripDeadPrototypesPass());
   mpm.add(llvm::createStripDeadDebugInfoPass());
 
-  addOptimizationPasses(mpm, fpm, settings.optLevel, settings.sizeLevel);
+  addOptimizationPasses(mpm, fpm, settings);
 }
 
 struct FuncFinalizer final {
@@ -109,6 +155,27 @@ struct FuncFinalizer final {
   ~FuncFinalizer() { fpm.doFinalization(); }
 };
 
+void setFastMath(llvm::Module &module) {
+  for (auto &&func : module.functions()) {
+    if (func.isDeclaration()) {
+      continue;
+    }
+    for (auto attr : {"unsafe-fp-math", "no-infs-fp-math", "no-nans-fp-math",
+                      "no-signed-zeros-fp-math"}) {
+      func.addFnAttr(attr, "true");
+    }
+    for (auto &&inst : llvm::instructions(func)) {
+      if (llvm::isa<llvm::FPMathOperator>(&inst)) {
+#if LDC_LLVM_VER >= 600
+        inst.setFast(true);
+#else
+        inst.setHasUnsafeAlgebra(true);
+#endif
+      }
+    }
+  }
+}
+
 void stripComdat(llvm::Module &module) {
   for (auto &&func : module.functions()) {
     func.setComdat(nullptr);
@@ -126,6 +193,9 @@ void optimizeModule(const Context &context, llvm::TargetMachine &targetMachine,
   // There is llvm bug related tp comdat and IR based pgo
   // and anyway comdat is useless at this stage
   stripComdat(module);
+  if (settings.fastMath) {
+    setFastMath(module);
+  }
   llvm::legacy::PassManager mpm;
   llvm::legacy::FunctionPassManager fpm(&module);
   const auto name = module.getName();
@@ -151,6 +221,54 @@ void optimizeModule(const Context &context, llvm::TargetMachine &targetMachine,
   mpm.run(module);
 }
 
+OptimizerSettings getOptimizerSettings(const Context &context) {
+  OptimizerSettings settings;
+  settings.optLevel = context.optLevel;
+  settings.sizeLevel = context.sizeLevel;
+  settings.inlineThreshold = context.inlineThreshold;
+  settings.disableInlining = context.disableInlining;
+  settings.disableLoopUnrolling = context.disableLoopUnrolling;
+  settings.disableLoopVectorization = context.disableLoopVectorization;
+  settings.disableSLPVectorization = context.disableSLPVectorization;
+  settings.fastMath = context.fastMath;
+  settings.disableSimplifyDruntimeCalls = context.disableSimplifyDruntimeCalls;
+  settings.disableGCToStack = context.disableGCToStack;
+  settings.stripDebug = context.stripDebug;
+  if (nullptr != context.targetCpu) {
+    settings.targetCpu = context.targetCpu;
+  }
+  if (nullptr != context.targetFeatures) {
+    settings.targetFeatures = context.targetFeatures;
+  }
+  return settings;
+}
+
+std::string getSettingsKey(const OptimizerSettings &settings) {
+  std::string ret;
+  auto append = [&](const void *data, std::size_t size) {
+    ret.append(static_cast<const char *>(data), size);
+  };
+  append(&settings.optLevel, sizeof(settings.optLevel));
+  append(&settings.sizeLevel, sizeof(settings.sizeLevel));
+  append(&settings.inlineThreshold, sizeof(settings.inlineThreshold));
+  const bool flags[] = {settings.disableInlining,
+                        settings.disableLoopUnrolling,
+                        settings.disableLoopVectorization,
+                        settings.disableSLPVectorization,
+                        settings.fastMath,
+                        settings.disableSimplifyDruntimeCalls,
+                        settings.disableGCToStack,
+                        settings.stripDebug};
+  for (auto flag : flags) {
+    ret += flag ? '1' : '0';
+  }
+  // The strings can't contain zeros
+  ret += settings.targetCpu;
+  ret += '\0';
+  ret += settings.targetFeatures;
+  return ret;
+}
+
 void setRtCompileVar(const Context &context, llvm::Module &module,
                      const char *name, const void *init) {
   assert(nullptr != name);
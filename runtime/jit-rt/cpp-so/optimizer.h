@@ -14,6 +14,7 @@
 #pragma once
 
 #include <memory>
+#include <string>
 
 namespace llvm {
 namespace legacy {
@@ -29,8 +30,25 @@ struct Context;
 struct OptimizerSettings final {
   unsigned optLevel = 0;
   unsigned sizeLevel = 0;
+  int inlineThreshold = -1; // default for the levels if negative
+  bool disableInlining = false;
+  bool disableLoopUnrolling = false;
+  bool disableLoopVectorization = false;
+  bool disableSLPVectorization = false;
+  bool fastMath = false;
+  bool disableSimplifyDruntimeCalls = false;
+  bool disableGCToStack = false;
+  bool stripDebug = true;
+  // Override the host cpu and features if not empty
+  std::string targetCpu;
+  std::string targetFeatures;
 };
 
+OptimizerSettings getOptimizerSettings(const Context &context);
+
+/// Returns a string identifying the settings, for comparisons and cache keys.
+std::string getSettingsKey(const OptimizerSettings &settings);
+
 void optimizeModule(const Context &context, llvm::TargetMachine &targetMachine,
                     const OptimizerSettings &settings, llvm::Module &module);
 
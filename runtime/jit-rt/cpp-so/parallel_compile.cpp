@@ -0,0 +1,153 @@
+//===-- parallel_compile.cpp ----------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Each worker owns a target machine and takes the next job from a shared
+// counter until all jobs are done.
+//
+//===----------------------------------------------------------------------===//
+
+#include "parallel_compile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "context.h"
+#include "jit_context.h"
+#include "optimizer.h"
+
+namespace {
+
+bool emitObject(llvm::TargetMachine &targetMachine, llvm::Module &module,
+                std::string &object) {
+  llvm::SmallVector<char, 0> buffer;
+  llvm::raw_svector_ostream os(buffer);
+  llvm::legacy::PassManager pm;
+  if (targetMachine.addPassesToEmitFile(pm, os,
+#if LDC_LLVM_VER >= 700
+                                        nullptr,
+#endif
+                                        llvm::TargetMachine::CGFT_ObjectFile)) {
+    return false;
+  }
+  pm.run(module);
+  object.assign(buffer.data(), buffer.size());
+  return true;
+}
+
+// Times a stage of a job if requested.
+class JobStage final {
+  std::unique_ptr<StageTimer> timer;
+
+public:
+  JobStage(CodegenJob &job, const char *stage, llvm::StringRef object,
+           unsigned thread, bool measure, StatsClock::time_point origin) {
+    if (measure) {
+      job.stages.emplace_back();
+      auto &record = job.stages.back();
+      record.stage = stage;
+      record.object = object.str();
+      record.thread = thread;
+      timer.reset(new StageTimer(origin, record));
+    }
+  }
+};
+
+void runJob(llvm::TargetMachine &targetMachine,
+            const OptimizerSettings &settings, CodegenJob &job,
+            unsigned thread, bool measure, StatsClock::time_point origin) {
+  // The records must not move while they are being measured
+  job.stages.reserve(3);
+  llvm::LLVMContext llvmContext;
+  std::unique_ptr<llvm::Module> mod;
+  {
+    JobStage stage(job, "Parse IR", "", thread, measure, origin);
+    auto buffer = llvm::MemoryBuffer::getMemBuffer(job.bitcode, "", false);
+    auto parsed = llvm::parseBitcodeFile(*buffer, llvmContext);
+    if (!parsed) {
+      job.error = "Unable to parse IR: " + llvm::toString(parsed.takeError());
+      return;
+    }
+    mod = std::move(*parsed);
+  }
+  llvm::Module &module = *mod;
+  const auto name = module.getName();
+
+  {
+    JobStage stage(job, "Optimize", name, thread, measure, origin);
+    // No handlers, they may only be called from the compiling thread
+    Context context;
+    optimizeModule(context, targetMachine, settings, module);
+
+    std::string err;
+    llvm::raw_string_ostream errstream(err);
+    if (llvm::verifyModule(module, &errstream)) {
+      errstream.flush();
+      job.error = "module verification failed:" + err;
+      return;
+    }
+  }
+
+  if (job.printOptimized) {
+    llvm::raw_string_ostream os(job.optimizedIR);
+    module.print(os, nullptr, false, true);
+  }
+
+  JobStage stage(job, "Codegen", name, thread, measure, origin);
+  if (!emitObject(targetMachine, module, job.object)) {
+    job.error = "Target does not support object emission";
+  }
+}
+
+} // anon namespace
+
+void runCodegenJobs(const OptimizerSettings &settings,
+                    llvm::MutableArrayRef<CodegenJob> jobs,
+                    unsigned threadsCount, bool measureStages,
+                    StatsClock::time_point statsOrigin) {
+  threadsCount = std::max(1u, std::min(threadsCount,
+                                       static_cast<unsigned>(jobs.size())));
+  // Target machines are created upfront, target initialization isn't
+  // thread-safe.
+  std::vector<std::unique_ptr<llvm::TargetMachine>> targetMachines;
+  for (unsigned i = 0; i < threadsCount; ++i) {
+    targetMachines.push_back(JITContext::createHostTargetMachine());
+  }
+
+  std::atomic<std::size_t> nextJob(0);
+  auto worker = [&](unsigned thread) {
+    auto &targetMachine = *targetMachines[thread];
+    for (auto i = nextJob++; i < jobs.size(); i = nextJob++) {
+      runJob(targetMachine, settings, jobs[i], thread, measureStages,
+             statsOrigin);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < threadsCount; ++i) {
+    threads.emplace_back(worker, i);
+  }
+  // The calling thread is one of the workers
+  worker(0);
+  for (auto &&thread : threads) {
+    thread.join();
+  }
+}
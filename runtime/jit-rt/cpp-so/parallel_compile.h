@@ -0,0 +1,48 @@
+//===-- parallel_compile.h - jit support ------------------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Jit runtime - optimization and codegen of independent units on a pool of
+// worker threads.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+
+#include "compile_stats.h"
+
+struct OptimizerSettings;
+
+struct CodegenJob final {
+  // Input: the unoptimized module as bitcode, workers parse it into contexts
+  // of their own as LLVMContext isn't thread-safe.
+  std::string bitcode;
+  // Request the optimized IR as text (for the dump handler)
+  bool printOptimized = false;
+
+  // Results
+  std::string object;
+  std::string optimizedIR;
+  std::string error; // empty on success
+  // Timing of the stages, measured if requested
+  std::vector<StageRecord> stages;
+};
+
+/// Optimizes and compiles `jobs` to object files on `threadsCount` threads
+/// and returns once all jobs are done. The jobs must not depend on the state
+/// of the jit, no handlers are called from the worker threads. The stages
+/// are timed relative to `statsOrigin` if `measureStages` is set.
+void runCodegenJobs(const OptimizerSettings &settings,
+                    llvm::MutableArrayRef<CodegenJob> jobs,
+                    unsigned threadsCount, bool measureStages,
+                    StatsClock::time_point statsOrigin);
@@ -0,0 +1,309 @@
+//===-- profile.cpp -------------------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The counters live in jit runtime memory, instrumented code refers to them
+// by absolute address. Sites (conditional branches, switches and indirect
+// calls) are numbered in instruction order, so the profile of a function
+// matches its IR as long as the number of sites is the same.
+//
+//===----------------------------------------------------------------------===//
+
+#include "profile.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <set>
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+namespace {
+
+#if LDC_LLVM_VER >= 800
+using TerminatorT = llvm::Instruction;
+#else
+using TerminatorT = llvm::TerminatorInst;
+#endif
+
+void profileIndirectCall(IndirectCallProfile *site, void *target) {
+  for (int i = 0; i < IndirectCallProfile::Slots; ++i) {
+    if (site->targets[i] == target) {
+      ++site->counts[i];
+      return;
+    }
+    if (site->targets[i] == nullptr) {
+      site->targets[i] = target;
+      site->counts[i] = 1;
+      return;
+    }
+  }
+  ++site->other;
+}
+
+struct Sites final {
+  std::vector<TerminatorT *> branches;
+  std::vector<llvm::Instruction *> indirectCalls;
+  std::size_t edgesCount = 0;
+};
+
+Sites collectSites(llvm::Function &func) {
+  Sites ret;
+  for (auto &&bb : func) {
+    for (auto &&inst : bb) {
+      llvm::CallSite cs(&inst);
+      if (cs && nullptr == cs.getCalledFunction() && !cs.isInlineAsm()) {
+        ret.indirectCalls.push_back(&inst);
+      }
+    }
+    auto term = bb.getTerminator();
+    if (nullptr == term) {
+      continue;
+    }
+    if (auto br = llvm::dyn_cast<llvm::BranchInst>(term)) {
+      if (br->isConditional()) {
+        ret.branches.push_back(term);
+        ret.edgesCount += 2;
+      }
+    } else if (llvm::isa<llvm::SwitchInst>(term)) {
+      ret.branches.push_back(term);
+      ret.edgesCount += term->getNumSuccessors();
+    }
+  }
+  return ret;
+}
+
+bool matches(const FunctionProfile &profile, const Sites &sites) {
+  return profile.edgeCounts.size() == sites.edgesCount &&
+         profile.indirectCalls.size() == sites.indirectCalls.size();
+}
+
+llvm::Constant *getAddress(llvm::Module &module, const void *ptr,
+                           llvm::Type *type) {
+  auto intType = module.getDataLayout().getIntPtrType(module.getContext());
+  return llvm::ConstantExpr::getIntToPtr(
+      llvm::ConstantInt::get(intType, reinterpret_cast<uintptr_t>(ptr)), type);
+}
+
+void increment(llvm::IRBuilder<> &builder, llvm::Value *counter) {
+  auto val = builder.CreateLoad(counter);
+  builder.CreateStore(builder.CreateAdd(val, builder.getInt64(1)), counter);
+}
+
+void instrument(llvm::Function &func, const Sites &sites,
+                FunctionProfile &profile) {
+  auto &module = *func.getParent();
+  auto &ctx = module.getContext();
+  auto counterType = llvm::Type::getInt64PtrTy(ctx);
+  auto bytePtrType = llvm::Type::getInt8PtrTy(ctx);
+
+  llvm::IRBuilder<> builder(&*func.getEntryBlock().getFirstInsertionPt());
+  increment(builder, getAddress(module, &profile.entryCount, counterType));
+
+  auto edges = getAddress(module, profile.edgeCounts.data(), counterType);
+  uint64_t base = 0;
+  for (auto term : sites.branches) {
+    builder.SetInsertPoint(term);
+    llvm::Value *index = nullptr;
+    if (auto br = llvm::dyn_cast<llvm::BranchInst>(term)) {
+      index = builder.CreateSelect(br->getCondition(), builder.getInt64(base),
+                                   builder.getInt64(base + 1));
+    } else {
+      // Successor 0 is the default destination, then the cases in order
+      auto sw = llvm::cast<llvm::SwitchInst>(term);
+      index = builder.getInt64(base);
+      uint64_t caseIndex = base + 1;
+      for (auto &&c : sw->cases()) {
+        auto isCase = builder.CreateICmpEQ(sw->getCondition(),
+                                           c.getCaseValue());
+        index = builder.CreateSelect(isCase, builder.getInt64(caseIndex),
+                                     index);
+        ++caseIndex;
+      }
+    }
+    increment(builder, builder.CreateInBoundsGEP(edges, index));
+    base += term->getNumSuccessors();
+  }
+  assert(base == profile.edgeCounts.size());
+
+  auto helperType = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(ctx), {bytePtrType, bytePtrType}, false);
+  auto helper = getAddress(
+      module, reinterpret_cast<const void *>(&profileIndirectCall),
+      helperType->getPointerTo());
+  for (std::size_t i = 0; i < sites.indirectCalls.size(); ++i) {
+    auto call = sites.indirectCalls[i];
+    builder.SetInsertPoint(call);
+    llvm::CallSite cs(call);
+    builder.CreateCall(
+        helper, {getAddress(module, &profile.indirectCalls[i], bytePtrType),
+                 builder.CreateBitCast(cs.getCalledValue(), bytePtrType)});
+  }
+}
+
+llvm::MDNode *createWeights(llvm::LLVMContext &ctx,
+                            llvm::ArrayRef<uint64_t> counts) {
+  const auto max = *std::max_element(counts.begin(), counts.end());
+  if (0 == max) {
+    return nullptr;
+  }
+  const uint64_t scale = max / std::numeric_limits<uint32_t>::max() + 1;
+  std::vector<uint32_t> weights;
+  for (auto count : counts) {
+    weights.push_back(static_cast<uint32_t>(count / scale));
+  }
+  return llvm::MDBuilder(ctx).createBranchWeights(weights);
+}
+
+// Replaces `call` by `if (callee == address) target(...) else callee(...)`,
+// the direct call can be inlined. `address` is the profiled callee, i.e. the
+// AOT thunk or symbol `target` was resolved from, not the jitted function.
+void promoteIndirectCall(llvm::CallInst *call, llvm::Function *target,
+                         const void *address, llvm::MDNode *weights) {
+  auto &module = *call->getModule();
+  auto bytePtrType = llvm::Type::getInt8PtrTy(call->getContext());
+  llvm::IRBuilder<> builder(call);
+  auto isTarget = builder.CreateICmpEQ(
+      builder.CreateBitCast(call->getCalledValue(), bytePtrType),
+      getAddress(module, address, bytePtrType));
+  TerminatorT *thenTerm = nullptr;
+  TerminatorT *elseTerm = nullptr;
+  llvm::SplitBlockAndInsertIfThenElse(isTarget, call, &thenTerm, &elseTerm,
+                                      weights);
+  auto tail = call->getParent();
+
+  auto direct = llvm::cast<llvm::CallInst>(call->clone());
+  direct->setCalledFunction(target);
+  direct->insertBefore(thenTerm);
+  call->removeFromParent();
+  call->insertBefore(elseTerm);
+
+  if (!call->getType()->isVoidTy()) {
+    auto phi = llvm::PHINode::Create(call->getType(), 2, "", &tail->front());
+    call->replaceAllUsesWith(phi);
+    phi->addIncoming(direct, thenTerm->getParent());
+    phi->addIncoming(call, elseTerm->getParent());
+  }
+}
+
+void applyProfile(
+    llvm::Function &func, const Sites &sites, const FunctionProfile &profile,
+    llvm::function_ref<llvm::Function *(const void *)> resolveTarget) {
+  auto &ctx = func.getContext();
+#if LDC_LLVM_VER >= 700
+  func.setEntryCount(llvm::Function::ProfileCount(
+      profile.entryCount, llvm::Function::PCT_Real));
+#else
+  func.setEntryCount(profile.entryCount);
+#endif
+
+  std::size_t base = 0;
+  for (auto term : sites.branches) {
+    const auto count = term->getNumSuccessors();
+    llvm::ArrayRef<uint64_t> counts(&profile.edgeCounts[base], count);
+    if (auto weights = createWeights(ctx, counts)) {
+      term->setMetadata(llvm::LLVMContext::MD_prof, weights);
+    }
+    base += count;
+  }
+
+  for (std::size_t i = 0; i < sites.indirectCalls.size(); ++i) {
+    auto call = llvm::dyn_cast<llvm::CallInst>(sites.indirectCalls[i]);
+    if (nullptr == call || call->isMustTailCall()) {
+      continue;
+    }
+    const auto &site = profile.indirectCalls[i];
+    const auto top = std::max_element(std::begin(site.counts),
+                                      std::end(site.counts)) -
+                     std::begin(site.counts);
+    uint64_t total = site.other;
+    for (auto count : site.counts) {
+      total += count;
+    }
+    // Only a dominant target is worth the check
+    const auto hits = site.counts[top];
+    if (0 == hits || hits * 2 < total) {
+      continue;
+    }
+    auto target = resolveTarget(site.targets[top]);
+    if (nullptr == target ||
+        target->getFunctionType() != call->getFunctionType()) {
+      continue;
+    }
+    promoteIndirectCall(call, target, site.targets[top],
+                        createWeights(ctx, {hits, total - hits}));
+  }
+}
+
+} // anon namespace
+
+std::string ModuleProfile::getTiers(uint64_t threshold) const {
+  std::set<std::string> hot;
+  for (auto &&func : functions) {
+    if (func.second->entryCount >= threshold) {
+      hot.insert(func.first);
+    }
+  }
+  std::string ret = std::to_string(threshold);
+  for (auto &&name : hot) {
+    ret += ';';
+    ret += name;
+  }
+  return ret;
+}
+
+void ModuleProfile::prepareModule(
+    llvm::Module &module, uint64_t threshold,
+    llvm::function_ref<llvm::Function *(const void *)> resolveTarget,
+    llvm::function_ref<void(llvm::Function &)> onHot) {
+  assert(0 != threshold);
+  std::vector<llvm::Function *> funcs;
+  for (auto &&func : module.functions()) {
+    if (!func.isDeclaration()) {
+      funcs.push_back(&func);
+    }
+  }
+
+  // Promoted calls add direct calls, so collect all sites first
+  std::vector<Sites> sites;
+  for (auto func : funcs) {
+    sites.push_back(collectSites(*func));
+  }
+
+  for (std::size_t i = 0; i < funcs.size(); ++i) {
+    auto &func = *funcs[i];
+    auto &profile = functions[func.getName().str()];
+    if (nullptr != profile && matches(*profile, sites[i]) &&
+        profile->entryCount >= threshold) {
+      onHot(func);
+      applyProfile(func, sites[i], *profile, resolveTarget);
+      continue;
+    }
+
+    if (nullptr == profile || !matches(*profile, sites[i])) {
+      // The function has changed, so has its profile
+      if (nullptr != profile) {
+        retired.push_back(std::move(profile));
+      }
+      profile.reset(new FunctionProfile);
+      profile->edgeCounts.resize(sites[i].edgesCount);
+      profile->indirectCalls.resize(sites[i].indirectCalls.size(),
+                                    IndirectCallProfile());
+    }
+    instrument(func, sites[i], *profile);
+  }
+}
@@ -0,0 +1,66 @@
+//===-- profile.h - jit support ---------------------------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Jit runtime - tiered compilation. Functions are first compiled with
+// lightweight counters (entry, branch edges and indirect call targets), hot
+// functions are recompiled with the collected profile.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llvm/ADT/STLExtras.h"
+
+namespace llvm {
+class Function;
+class Module;
+}
+
+struct IndirectCallProfile final {
+  enum { Slots = 2 };
+  void *targets[Slots];
+  uint64_t counts[Slots];
+  uint64_t other;
+};
+
+/// Counters of an instrumented function, updated by the jitted code without
+/// synchronization.
+struct FunctionProfile final {
+  uint64_t entryCount = 0;
+  // Sized when the function is instrumented and never resized afterwards
+  std::vector<uint64_t> edgeCounts;
+  std::vector<IndirectCallProfile> indirectCalls;
+};
+
+/// Profiles of the functions of a jit module.
+class ModuleProfile final {
+  std::unordered_map<std::string, std::unique_ptr<FunctionProfile>> functions;
+  // Replaced profiles, they may still be updated by running code
+  std::vector<std::unique_ptr<FunctionProfile>> retired;
+
+public:
+  /// Returns the hot functions (called at least `threshold` times) in a
+  /// canonical form, the module must be recompiled when they change.
+  std::string getTiers(uint64_t threshold) const;
+
+  /// Applies the profile to the hot functions of `module` (as branch weights
+  /// and by promoting dominant indirect call targets, which are mapped to
+  /// functions of the module by `resolveTarget`) and instruments the others.
+  /// Calls `onHot` for each hot function.
+  void prepareModule(
+      llvm::Module &module, uint64_t threshold,
+      llvm::function_ref<llvm::Function *(const void *)> resolveTarget,
+      llvm::function_ref<void(llvm::Function &)> onHot);
+};
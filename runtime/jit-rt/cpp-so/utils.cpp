@@ -9,6 +9,7 @@
 
 #include "utils.h"
 
+#include <atomic>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
@@ -46,3 +47,28 @@ void verifyModule(const Context &context, llvm::Module &module) {
     fatal(context, desc);
   }
 }
+
+bool isCancelled(const Context &context) {
+  return nullptr != context.cancelHandler &&
+         context.cancelHandler(context.cancelHandlerData);
+}
+
+void publishPointer(void **dst, void *value) {
+  assert(nullptr != dst);
+  static_assert(sizeof(std::atomic<void *>) == sizeof(void *),
+                "std::atomic<void *> must have the layout of void *");
+  reinterpret_cast<std::atomic<void *> *>(dst)->store(
+      value, std::memory_order_release);
+}
+
+void *loadPointer(void *const *src) {
+  assert(nullptr != src);
+  return reinterpret_cast<const std::atomic<void *> *>(src)->load(
+      std::memory_order_acquire);
+}
+
+bool replacePointer(void **dst, void *expected, void *value) {
+  assert(nullptr != dst);
+  return reinterpret_cast<std::atomic<void *> *>(dst)->compare_exchange_strong(
+      expected, value, std::memory_order_acq_rel);
+}
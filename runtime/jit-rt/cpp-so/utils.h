@@ -24,3 +24,15 @@ void fatal(const Context &context, const std::string &reason);
 void interruptPoint(const Context &context, const char *desc,
                     const char *object = "");
 void verifyModule(const Context &context, llvm::Module &module);
+bool isCancelled(const Context &context);
+
+/// Atomically stores a pointer which may be read concurrently by other
+/// threads, i.e. thunk variables and bind handles.
+void publishPointer(void **dst, void *value);
+
+/// Atomically loads a pointer stored by publishPointer.
+void *loadPointer(void *const *src);
+
+/// Atomically replaces the pointer at `dst` by `value` if it is `expected`,
+/// returns whether it was replaced.
+bool replacePointer(void **dst, void *expected, void *value);
@@ -14,6 +14,7 @@
 
 #include <cstddef> // size_t
 
+struct BindCacheStats;
 struct Context;
 struct ParamSlice;
 
@@ -33,6 +34,10 @@ struct ParamSlice;
 #define JIT_UNREG_BIND_PAYLOAD                                                 \
   MAKE_JIT_API_CALL(unregisterBindPayloadImplSo,                               \
                     LDC_DYNAMIC_COMPILE_API_VERSION)
+#define JIT_GET_BIND_CACHE_STATS                                               \
+  MAKE_JIT_API_CALL(getBindCacheStatsImplSo, LDC_DYNAMIC_COMPILE_API_VERSION)
+#define JIT_FREE_RETIRED_CODE                                                  \
+  MAKE_JIT_API_CALL(freeRetiredCodeImplSo, LDC_DYNAMIC_COMPILE_API_VERSION)
 
 extern "C" {
 
@@ -50,6 +55,11 @@ EXTERNAL void JIT_REG_BIND_PAYLOAD(void *handle, void *originalFunc,
 
 EXTERNAL void JIT_UNREG_BIND_PAYLOAD(void *handle);
 
+EXTERNAL void JIT_GET_BIND_CACHE_STATS(BindCacheStats *stats,
+                                       std::size_t statsSize);
+
+EXTERNAL void JIT_FREE_RETIRED_CODE();
+
 void rtCompileProcessImpl(const Context *context, std::size_t contextSize) {
   JIT_API_ENTRYPOINT(dynamiccompile_modules_head, context, contextSize);
 }
@@ -60,4 +70,10 @@ void registerBindPayload(void *handle, void *originalFunc,
 }
 
 void unregisterBindPayload(void *handle) { JIT_UNREG_BIND_PAYLOAD(handle); }
+
+void getBindCacheStatsImpl(BindCacheStats *stats, std::size_t statsSize) {
+  JIT_GET_BIND_CACHE_STATS(stats, statsSize);
+}
+
+void freeRetiredCodeImpl() { JIT_FREE_RETIRED_CODE(); }
 }
@@ -0,0 +1,100 @@
+#!/usr/bin/env python
+#
+# Minimal HTTP cache server for testing -cache-remote.
+#
+# Usage: http_cache_server.py [--no-length] <dir> <command> [<args>...]
+#
+# Serves GET and PUT requests for files in <dir> on an ephemeral port of
+# 127.0.0.1 while running <command>, with `@URL@` in the arguments replaced by
+# the server's URL. Exits with the command's exit code.
+#
+# With --no-length, responses have no Content-Length header, their end is only
+# marked by closing the connection.
+
+import os
+import subprocess
+import sys
+import threading
+
+try:
+    from http.server import BaseHTTPRequestHandler, HTTPServer
+    from socketserver import ThreadingMixIn
+except ImportError: # Python 2
+    from BaseHTTPServer import BaseHTTPRequestHandler, HTTPServer
+    from SocketServer import ThreadingMixIn
+
+class Server(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+
+class Handler(BaseHTTPRequestHandler):
+    def path_for_key(self):
+        key = self.path.strip('/')
+        if not key or '/' in key or '\\' in key or key.startswith('.'):
+            return None
+        return os.path.join(self.server.directory, key)
+
+    def reply(self, status, body=b''):
+        self.send_response(status)
+        if not self.server.no_length:
+            self.send_header('Content-Length', str(len(body)))
+        self.send_header('Connection', 'close')
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self):
+        path = self.path_for_key()
+        if path is None or not os.path.isfile(path):
+            self.reply(404)
+            return
+        with open(path, 'rb') as f:
+            self.reply(200, f.read())
+
+    def do_PUT(self):
+        path = self.path_for_key()
+        if path is None:
+            self.reply(400)
+            return
+        length = int(self.headers.get('Content-Length', 0))
+        body = self.rfile.read(length)
+        temp = '%s.tmp%d' % (path, threading.current_thread().ident)
+        with open(temp, 'wb') as f:
+            f.write(body)
+        if os.path.exists(path):
+            os.remove(path)
+        os.rename(temp, path)
+        self.reply(201)
+
+    def log_message(self, format, *args):
+        pass
+
+def main():
+    args = sys.argv[1:]
+    no_length = len(args) > 0 and args[0] == '--no-length'
+    if no_length:
+        args = args[1:]
+    if len(args) < 2:
+        sys.stderr.write('Usage: %s [--no-length] <dir> <command> [<args>...]\n'
+                         % sys.argv[0])
+        return 2
+
+    directory = args[0]
+    if not os.path.isdir(directory):
+        os.makedirs(directory)
+
+    server = Server(('127.0.0.1', 0), Handler)
+    server.directory = directory
+    server.no_length = no_length
+    thread = threading.Thread(target=server.serve_forever)
+    thread.daemon = True
+    thread.start()
+
+    url = 'http://127.0.0.1:%d' % server.server_address[1]
+    command = [arg.replace('@URL@', url) for arg in args[1:]]
+    try:
+        return subprocess.call(command)
+    finally:
+        server.shutdown()
+        server.server_close()
+
+if __name__ == '__main__':
+    sys.exit(main())